@@ -0,0 +1,425 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__ACCEL_H)
+#define __ACCEL_H
+
+#include <nori/mesh.h>
+#include <nori/bbox.h>
+#include <nori/triaccel.h>
+#include <nori/raypacket.h>
+
+/// Number of entries of the per-ray triangle mailbox (power of two)
+#define NORI_MAILBOX_SIZE 8
+
+/* Set to 1 to count the triangle tests that are avoided by mailboxing,
+   e.g. using "DEFINES += NORI_MAILBOX_STATS=1" */
+#if !defined(NORI_MAILBOX_STATS)
+#define NORI_MAILBOX_STATS 0
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Small per-ray cache of recently tested triangles ("mailbox")
+ *
+ * When primitives are clipped to the cells of a spatial subdivision,
+ * a large triangle is referenced by many of the leaves that a ray
+ * visits. The mailbox remembers the global indices of the triangles
+ * that were tested last in a tiny direct-mapped table, which allows
+ * repeated tests to be skipped. It is meant to live on the stack
+ * during a single traversal.
+ */
+struct Mailbox {
+	IndexType ids[NORI_MAILBOX_SIZE];
+#if NORI_MAILBOX_STATS == 1
+	/// Number of triangle references encountered during the traversal
+	uint32_t references;
+	/// Number of triangle tests that were skipped
+	uint32_t skipped;
+#endif
+
+	/// Create an empty mailbox
+	inline Mailbox() {
+		for (int i=0; i<NORI_MAILBOX_SIZE; ++i)
+			ids[i] = (IndexType) -1;
+#if NORI_MAILBOX_STATS == 1
+		references = skipped = 0;
+#endif
+	}
+
+	/// Check whether a triangle has been tested already and record it
+	inline bool testAndSet(IndexType id) {
+		IndexType &slot = ids[id & (NORI_MAILBOX_SIZE - 1)];
+		if (slot == id)
+			return true;
+		slot = id;
+		return false;
+	}
+};
+
+/**
+ * \brief Superclass of all ray tracing acceleration data structures
+ *
+ * An accelerator indexes the triangles of all meshes that are registered
+ * with it and answers closest-hit and shadow ray queries. The scene
+ * instantiates one of them based on the <tt>&lt;accel&gt;</tt> tag of the
+ * scene description (e.g. <tt>&lt;accel type="bvh"/&gt;</tt>) and falls
+ * back to the SAH kd-tree when no such tag is specified.
+ *
+ * Triangles are identified by a global primitive index, which enumerates
+ * the triangles of all registered meshes in the order in which the
+ * meshes were added. The meshes themselves are owned by the \ref Scene.
+ */
+class Accel : public NoriObject {
+public:
+	/// Release all memory
+	virtual ~Accel();
+
+	/**
+	 * \brief Register a triangle mesh for inclusion in the accelerator.
+	 *
+	 * This function can only be used before \ref build() is called
+	 */
+	void addMesh(Mesh *mesh);
+
+	/// Build the acceleration data structure
+	virtual void build() = 0;
+
+	/**
+	 * \brief Update the accelerator after some of its meshes have moved
+	 *
+	 * Must be called after the vertex positions of registered meshes
+	 * have changed (e.g. using \ref Mesh::setTransform()), where
+	 * \c changed lists the affected meshes. Accelerators that support
+	 * it refit the bounds of the affected parts of the hierarchy and
+	 * only rebuild when this degrades its quality too much.
+	 *
+	 * The default implementation always rebuilds the accelerator.
+	 */
+	virtual void update(const std::vector<const Mesh *> &changed);
+
+	/**
+	 * \brief Intersect a ray against all triangle meshes registered
+	 * with the accelerator
+	 *
+	 * Detailed information about the intersection, if any, will be
+	 * stored in the provided \ref Intersection data record.
+	 *
+	 * The <tt>shadowRay</tt> parameter specifies whether this detailed
+	 * information is really needed. When set to \c true, the
+	 * function just checks whether or not there is occlusion, but without
+	 * providing any more detail (i.e. \c its will not be filled with
+	 * contents). This is usually much faster.
+	 *
+	 * \return \c true If an intersection was found
+	 */
+	virtual bool rayIntersect(const Ray3f &ray, Intersection &its,
+		bool shadowRay = false) const = 0;
+
+	/**
+	 * \brief Check whether anything blocks the segment <tt>[mint, maxt]</tt>
+	 * of a shadow ray
+	 *
+	 * This any-hit query first tests the triangle that blocked the most
+	 * recent shadow ray of the calling thread, since consecutive shadow
+	 * rays (e.g. towards the same luminaire) are frequently stopped by the
+	 * same occluder. Only if that fails, the accelerator is traversed
+	 * using \ref findOccluder().
+	 */
+	bool occluded(const Ray3f &ray) const;
+
+	/**
+	 * \brief Find the closest intersection of every ray in a packet
+	 *
+	 * The default implementation traces the rays one at a time.
+	 * Accelerators can override it with a traversal that processes
+	 * the whole packet at once, which pays off for coherent rays.
+	 */
+	virtual void rayIntersectPacket(RayPacketN &packet) const;
+
+	//// Return an axis-aligned bounding box containing all registered geometry
+	virtual const BoundingBox3f &getBoundingBox() const = 0;
+
+	/// Return the total number of internally represented triangles
+	inline IndexType getPrimitiveCount() const { return m_primitiveCount; }
+
+	/// Return the total number of meshes registered with the accelerator
+	inline uint32_t getMeshCount() const { return (uint32_t) m_meshes.size(); }
+
+	/// Return one of the registered meshes
+	inline Mesh *getMesh(uint32_t idx) { return m_meshes[idx]; }
+
+	/// Return one of the registered meshes (const version)
+	inline const Mesh *getMesh(uint32_t idx) const { return m_meshes[idx]; }
+
+	/// Return the memory used by the leaf-ordered triangle and packet buffers (in bytes)
+	inline size_t getTriangleBufferSize() const {
+		return m_triangleCount * sizeof(TriAccel) + m_packetCount * sizeof(TriAccelN)
+			+ m_packetOffsetCount * sizeof(IndexType);
+	}
+
+	EClassType getClassType() const { return EAccel; }
+protected:
+	/* Queries the world and bottom-level accelerators directly */
+	friend class InstanceAccel;
+
+	/// Create an empty accelerator
+	Accel();
+
+	/**
+	 * \brief Release the acceleration data structure so that \ref build()
+	 * can be called again
+	 *
+	 * The registered meshes are kept. Subclasses that override this
+	 * function must call the base class implementation, which releases
+	 * the triangle and packet buffers.
+	 */
+	virtual void clear();
+
+	/**
+	 * \brief Compute the mesh and triangle indices corresponding to
+	 * a global primitive index
+	 *
+	 * On return, \c idx contains the triangle index relative to
+	 * the returned mesh.
+	 */
+	inline uint32_t findMesh(IndexType &idx) const {
+		std::vector<IndexType>::const_iterator it = std::lower_bound(
+				m_sizeMap.begin(), m_sizeMap.end(), idx+1) - 1;
+		idx -= *it;
+		return (uint32_t) (it - m_sizeMap.begin());
+	}
+
+	/**
+	 * \brief Traverse the accelerator in search of any triangle that
+	 * intersects the ray segment <tt>[mint, maxt]</tt>
+	 *
+	 * Implementations may visit nodes in any order and stop at the first
+	 * hit. On success, \c entry should be set to the position of the
+	 * occluder in the triangle buffer (or <tt>(IndexType) -1</tt> if it
+	 * is unknown), which is then cached for the calling thread.
+	 *
+	 * The default implementation performs a shadow ray query using
+	 * \ref rayIntersect().
+	 */
+	virtual bool findOccluder(const Ray3f &ray, float mint, float maxt,
+		IndexType &entry) const;
+
+	/**
+	 * \brief Check whether entry \c entry of the triangle buffer intersects
+	 * the ray segment <tt>[mint, maxt]</tt>
+	 *
+	 * Out-of-range entries (e.g. a cached occluder of a previous build)
+	 * are reported as not intersecting.
+	 */
+	inline bool occludedBy(IndexType entry, const Ray3f &ray, float mint, float maxt) const {
+		float u, v, t;
+		return entry < m_triangleCount
+			&& m_triangles[entry].rayIntersect(ray, u, v, t)
+			&& t >= mint && t <= maxt;
+	}
+
+	/**
+	 * \brief Fill in the remaining fields of an intersection record
+	 *
+	 * Expects that \c its.mesh, \c its.t and the barycentric coordinates
+	 * (in \c its.uv) of the hit have already been set by the traversal
+	 * code. Computes the position, texture coordinates and the geometric
+	 * and shading frames of triangle \c primIndex (relative to its mesh).
+	 */
+	void fillIntersection(IndexType primIndex, Intersection &its) const;
+
+	/**
+	 * \brief Create the leaf-ordered triangle buffer \ref m_triangles
+	 *
+	 * \param indices
+	 *    List of global primitive indices in the order in which they
+	 *    are referenced by the leaves of the accelerator. Entry \c i
+	 *    of the resulting buffer describes triangle \c indices[i].
+	 */
+	void createTriangleBuffer(const IndexType *indices, size_t count);
+
+	/**
+	 * \brief Pack the triangles of each leaf into SIMD packets
+	 *
+	 * Must be called after \ref createTriangleBuffer(). Each entry of
+	 * \c leaves specifies the range <tt>[start, end)</tt> of a leaf
+	 * within the triangle buffer.
+	 */
+	void createPacketBuffer(const std::vector<std::pair<IndexType, IndexType> > &leaves);
+
+	/**
+	 * \brief Refresh the entries of the triangle and packet buffers after
+	 * meshes have moved
+	 *
+	 * \param changed
+	 *    Flags indexed by the position of a mesh in \ref m_meshes
+	 */
+	void updateTriangleBuffer(const std::vector<bool> &changed);
+
+	/// Fill a triangle record using the current vertex positions of its mesh
+	inline void fillTriAccel(TriAccel &tri, uint32_t meshIndex, IndexType primIndex) const {
+		const Mesh *mesh = m_meshes[meshIndex];
+		const Point3f *positions = mesh->getVertexPositions();
+
+		const Point3f &p0 = positions[mesh->getIndex(3*(size_t) primIndex+0)],
+		              &p1 = positions[mesh->getIndex(3*(size_t) primIndex+1)],
+		              &p2 = positions[mesh->getIndex(3*(size_t) primIndex+2)];
+
+		tri.p0 = p0;
+		tri.e1 = p1 - p0;
+		tri.e2 = p2 - p0;
+		tri.meshIndex = meshIndex;
+		tri.primIndex = primIndex;
+		tri.index = m_sizeMap[meshIndex] + primIndex;
+	}
+
+	/**
+	 * \brief Check whether any triangle of a leaf intersects the ray
+	 * segment <tt>[mint, maxt]</tt>
+	 *
+	 * On success, \c entry is set to the position of the occluder in
+	 * the triangle buffer.
+	 */
+	inline bool occludedLeaf(IndexType start, IndexType end, const Ray3f &ray,
+			float mint, float maxt, IndexType &entry) const {
+		float u, v, t;
+
+		if (m_packets && end - start > 1) {
+			const TriAccelN *packet = m_packets + m_packetOffsets[start];
+			for (IndexType first=start; first < end; first += NORI_SIMD_WIDTH, ++packet) {
+				int lane = packet->rayIntersect(ray, mint, maxt, u, v, t);
+				if (lane >= 0) {
+					entry = first + (IndexType) lane;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		for (IndexType i=start; i != end; ++i) {
+			if (m_triangles[i].rayIntersect(ray, u, v, t) && t >= mint && t <= maxt) {
+				entry = i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * \brief Intersect a ray against the triangles of a leaf
+	 *
+	 * Leaves with more than one triangle are processed \c NORI_SIMD_WIDTH
+	 * triangles at a time using the packet buffer. Single triangles (and
+	 * accelerators without a packet buffer) use the scalar test.
+	 *
+	 * On success, \c maxt and the fields \c t, \c uv and \c mesh of the
+	 * intersection record are updated, and \c primIndex is set to the
+	 * index of the triangle within its mesh.
+	 *
+	 * When a \ref Mailbox is given, triangles that have already been
+	 * tested during the current traversal are skipped. Packets are only
+	 * skipped when this applies to all of their triangles.
+	 *
+	 * \return \c true if a hit closer than \c maxt was found
+	 */
+	inline bool intersectLeaf(IndexType start, IndexType end, const Ray3f &ray,
+			float mint, float &maxt, bool shadowRay, Intersection &its,
+			IndexType &primIndex, Mailbox *mailbox = NULL) const {
+		bool foundIntersection = false;
+		float u, v, t;
+
+		if (m_packets && end - start > 1) {
+			const TriAccelN *packet = m_packets + m_packetOffsets[start];
+			for (IndexType entry=start; entry < end; entry += NORI_SIMD_WIDTH, ++packet) {
+				if (mailbox) {
+					bool tested = true;
+					for (int i=0; i<NORI_SIMD_WIDTH; ++i) {
+						if (packet->index[i] != (IndexType) -1 && !mailbox->testAndSet(packet->index[i]))
+							tested = false;
+					}
+#if NORI_MAILBOX_STATS == 1
+					uint32_t lanes = (uint32_t) std::min(end - entry, (IndexType) NORI_SIMD_WIDTH);
+					mailbox->references += lanes;
+					if (tested)
+						mailbox->skipped += lanes;
+#endif
+					if (tested)
+						continue;
+				}
+
+				int lane = packet->rayIntersect(ray, mint, maxt, u, v, t);
+				if (lane < 0)
+					continue;
+				if (shadowRay)
+					return true;
+				maxt = t;
+				its.t = t;
+				its.uv = Point2f(u, v);
+				its.mesh = m_meshes[packet->meshIndex[lane]];
+				primIndex = packet->primIndex[lane];
+				foundIntersection = true;
+			}
+			return foundIntersection;
+		}
+
+		for (IndexType entry=start; entry != end; ++entry) {
+			const TriAccel &tri = m_triangles[entry];
+
+			if (mailbox) {
+				bool tested = mailbox->testAndSet(tri.index);
+#if NORI_MAILBOX_STATS == 1
+				mailbox->references++;
+				if (tested)
+					mailbox->skipped++;
+#endif
+				if (tested)
+					continue;
+			}
+
+			bool success = tri.rayIntersect(ray, u, v, t);
+
+			if (success && t >= mint && t <= maxt) {
+				if (shadowRay)
+					return true;
+				maxt = t;
+				its.t = t;
+				its.uv = Point2f(u, v);
+				its.mesh = m_meshes[tri.meshIndex];
+				primIndex = tri.primIndex;
+				foundIntersection = true;
+			}
+		}
+		return foundIntersection;
+	}
+protected:
+	std::vector<Mesh *> m_meshes;
+	std::vector<IndexType> m_sizeMap;
+	IndexType m_primitiveCount;
+	TriAccel *m_triangles;
+	size_t m_triangleCount;
+	TriAccelN *m_packets;
+	size_t m_packetCount;
+	IndexType *m_packetOffsets;
+	size_t m_packetOffsetCount;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __ACCEL_H */
@@ -0,0 +1,62 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__ATOMIC_H)
+#define __ATOMIC_H
+
+#include <nori/common.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Atomically add \c delta to the 64-bit integer at \c dst
+ *
+ * QAtomicInt only supports 32-bit integers, which is not enough for
+ * statistics counters that are incremented once per ray.
+ *
+ * \return The new value of the integer
+ */
+inline int64_t atomicAdd(volatile int64_t *dst, int64_t delta) {
+#if defined(_MSC_VER)
+	return _InterlockedExchangeAdd64(dst, delta) + delta;
+#else
+	return __sync_add_and_fetch(dst, delta);
+#endif
+}
+
+/// Atomically raise the 64-bit integer at \c dst to at least \c value
+inline void atomicMax(volatile int64_t *dst, int64_t value) {
+	int64_t current = *dst;
+	while (current < value) {
+#if defined(_MSC_VER)
+		int64_t previous = _InterlockedCompareExchange64(dst, value, current);
+#else
+		int64_t previous = __sync_val_compare_and_swap(dst, current, value);
+#endif
+		if (previous == current)
+			break;
+		current = previous;
+	}
+}
+
+NORI_NAMESPACE_END
+
+#endif /* __ATOMIC_H */
@@ -0,0 +1,286 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__BVH_H)
+#define __BVH_H
+
+#include <nori/accel.h>
+
+/** Compile-time BVH depth limit. Allows to put the
+    traversal stack on the stack */
+#define NORI_BVH_MAXDEPTH 64
+
+/// Maximum number of centroid bins used by the SAH builder
+#define NORI_BVH_MAXBINS 64
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Bounding volume hierarchy using the binned surface area heuristic
+ *
+ * The builder evaluates the SAH at a fixed number of candidate planes
+ * per axis by binning the triangle centroids ("On fast Construction of
+ * SAH-based Bounding Volume Hierarchies" by Ingo Wald). This makes the
+ * construction considerably cheaper than the O(N log N) perfect split
+ * kd-tree build, at the cost of a slightly lower tree quality.
+ *
+ * The nodes are stored in depth-first order, i.e. the left child of an
+ * inner node immediately follows its parent. Each triangle is referenced
+ * exactly once.
+ *
+ * When meshes move (see \ref update()), the bounds of the affected
+ * nodes are refitted bottom-up while the topology of the hierarchy is
+ * kept. Since this gradually degrades its quality, the hierarchy is
+ * rebuilt once its SAH cost exceeds that of the originally built one
+ * by more than the factor <tt>rebuildThreshold</tt> (1.5 by default).
+ *
+ * For very large scenes, the <tt>compressed</tt> property selects a more
+ * compact representation: each node stores the bounds of its two children
+ * quantized to 8 bits relative to its own (dequantized) bounds, which
+ * halves the size of a node to 16 bytes. The leaves reference the
+ * triangles through the leaf-ordered list of primitive indices alone,
+ * i.e. without the leaf-ordered copies of the triangles and the SIMD
+ * packets. Traversal becomes somewhat slower, since the child bounds
+ * have to be reconstructed and the vertices are fetched from the meshes.
+ *
+ * Can be selected using <tt>&lt;accel type="bvh"/&gt;</tt>.
+ */
+class BVH : public Accel {
+public:
+	/// Create a new and empty BVH
+	BVH(const PropertyList &propList);
+
+	/// Release all memory
+	virtual ~BVH();
+
+	/// Build the BVH
+	void build();
+
+	/**
+	 * \brief Refit the bounds of all nodes that contain triangles of
+	 * the given meshes (see \ref Accel::update())
+	 *
+	 * Compressed hierarchies are always rebuilt.
+	 */
+	void update(const std::vector<const Mesh *> &changed);
+
+	/// Intersect a ray against the BVH (see \ref Accel::rayIntersect())
+	bool rayIntersect(const Ray3f &ray, Intersection &its,
+		bool shadowRay = false) const;
+
+	//// Return an axis-aligned bounding box containing the entire tree
+	inline const BoundingBox3f &getBoundingBox() const {
+		return m_bbox;
+	}
+
+	/// Return a brief string summary of the instance (for debugging purposes)
+	QString toString() const;
+protected:
+	/// Any-hit traversal for shadow rays (see \ref Accel::findOccluder())
+	bool findOccluder(const Ray3f &ray, float mint, float maxt, IndexType &entry) const;
+
+	/// Release the hierarchy so that it can be built again
+	void clear();
+
+	/// Compute the SAH cost of the hierarchy in \ref m_nodes
+	float computeCost() const;
+
+	/// Closest-hit traversal of the compressed representation
+	bool rayIntersectCompressed(const Ray3f &ray, Intersection &its, bool shadowRay) const;
+
+	/// Any-hit traversal of the compressed representation
+	bool findOccluderCompressed(const Ray3f &ray, float mint, float maxt) const;
+
+	/// BVH node in depth-first order (32 bytes)
+	struct BVHNode {
+		/// Bounds of all triangles in the subtree
+		BoundingBox3f bbox;
+		/// Index of the right child (inner) or first index (leaf)
+		uint32_t offset;
+		/// Number of triangles, zero for inner nodes
+		uint16_t primCount;
+		/// Split axis of inner nodes
+		uint8_t axis;
+		/// Zero, except for nodes marked by subclasses (see \ref LazyBVH)
+		uint8_t flags;
+
+		inline bool isLeaf() const { return primCount > 0; }
+	};
+
+	/// Bounds quantized relative to those of the parent node
+	struct QuantizedBounds {
+		uint8_t min[3];
+		uint8_t max[3];
+	};
+
+	/// Node of the compressed representation, indexed like \ref m_nodes (16 bytes)
+	struct QuantizedBVHNode {
+		union {
+			/// Bounds of the left and right child (inner nodes)
+			QuantizedBounds child[2];
+			/// Number of triangles (leaves)
+			uint32_t primCount;
+		};
+		/// Split axis or \c ELeaf in the upper two bits, \ref BVHNode::offset in the rest
+		uint32_t data;
+
+		enum {
+			ELeaf = 3,
+			EOffsetMask = 0x3FFFFFFF
+		};
+
+		inline bool isLeaf() const { return (data >> 30) == ELeaf; }
+		inline uint32_t getAxis() const { return data >> 30; }
+		inline uint32_t getOffset() const { return data & EOffsetMask; }
+	};
+
+	/// Per-triangle information used during construction
+	struct BuildPrimitive {
+		BoundingBox3f bbox;
+		Point3f centroid;
+		uint32_t index;
+	};
+
+	/**
+	 * \brief Create \ref m_nodes and \ref m_indices from the list of
+	 * primitives (called by \ref build())
+	 *
+	 * The default implementation invokes \ref buildRecursive() on all
+	 * primitives. Subclasses can override this to use a different
+	 * construction algorithm while sharing the rest of the hierarchy.
+	 */
+	virtual void buildHierarchy(BuildPrimitive *prims, uint32_t primCount);
+
+	/**
+	 * \brief Allow subclasses to postpone the construction of a subtree
+	 *
+	 * Called by \ref buildRecursive() for every node that is not turned
+	 * into a leaf right away. When this function returns \c true, it has
+	 * initialized the node itself and the primitive range is not split.
+	 * The default implementation always returns \c false.
+	 */
+	virtual bool deferSubtree(uint32_t /* nodeIdx */, BuildPrimitive * /* prims */,
+			uint32_t /* start */, uint32_t /* end */, uint32_t /* depth */) {
+		return false;
+	}
+
+	/// Recursively build the subtree for the given primitive range
+	void buildRecursive(BuildPrimitive *prims, uint32_t start,
+		uint32_t end, uint32_t depth);
+
+	/// Create a leaf node referencing the given primitive range
+	void createLeaf(uint32_t nodeIdx, BuildPrimitive *prims,
+		uint32_t start, uint32_t end);
+
+	/**
+	 * \brief Recursively convert \ref m_nodes into the compressed representation
+	 *
+	 * \param bbox
+	 *    Dequantized bounds of the node, which conservatively contain its
+	 *    exact bounds and serve as the reference frame of its children
+	 */
+	void compressRecursive(uint32_t nodeIdx, const BoundingBox3f &bbox);
+
+	/**
+	 * \brief Reconstruct the bounds of a child of a compressed node
+	 *
+	 * Quantization step 0 of an axis maps exactly onto the minimum of
+	 * the parent bounds and step 255 onto the maximum.
+	 */
+	static inline BoundingBox3f dequantize(const BoundingBox3f &parent,
+			const QuantizedBounds &q) {
+		BoundingBox3f result;
+		for (int i=0; i<3; ++i) {
+			float scale = (parent.max[i] - parent.min[i]) * (1.0f / 255.0f);
+			result.min[i] = parent.min[i] + q.min[i] * scale;
+			result.max[i] = parent.max[i] - (255 - q.max[i]) * scale;
+		}
+		return result;
+	}
+
+	/**
+	 * \brief Intersect a ray against a leaf of the compressed representation
+	 *
+	 * Behaves like \ref Accel::intersectLeaf(), but fetches the triangles
+	 * from the meshes.
+	 */
+	inline bool intersectCompactLeaf(uint32_t start, uint32_t end, const Ray3f &ray,
+			float mint, float &maxt, bool shadowRay, Intersection &its,
+			IndexType &primIndex) const {
+		bool foundIntersection = false;
+		float u, v, t;
+
+		for (uint32_t i=start; i != end; ++i) {
+			IndexType index = m_indices[i];
+			uint32_t meshIdx = findMesh(index);
+			const Mesh *mesh = m_meshes[meshIdx];
+
+			if (mesh->rayIntersect(index, ray, u, v, t) && t >= mint && t <= maxt) {
+				if (shadowRay)
+					return true;
+				maxt = t;
+				its.t = t;
+				its.uv = Point2f(u, v);
+				its.mesh = mesh;
+				primIndex = index;
+				foundIntersection = true;
+			}
+		}
+		return foundIntersection;
+	}
+
+	/// Ray-AABB slab test using the precomputed reciprocal direction
+	static inline bool intersectBox(const BoundingBox3f &bbox,
+			const Ray3f &ray, float mint, float maxt) {
+		for (int i=0; i<3; ++i) {
+			float t0 = (bbox.min[i] - ray.o[i]) * ray.dRcp[i],
+			      t1 = (bbox.max[i] - ray.o[i]) * ray.dRcp[i];
+			if (t0 > t1)
+				std::swap(t0, t1);
+			/* Conservatively account for rounding errors in the
+			   far plane computation */
+			t1 *= 1 + 4 * std::numeric_limits<float>::epsilon();
+			/* Note: NaNs (0*inf) fail the comparisons below and
+			   leave the interval unchanged */
+			mint = t0 > mint ? t0 : mint;
+			maxt = t1 < maxt ? t1 : maxt;
+			if (mint > maxt)
+				return false;
+		}
+		return true;
+	}
+protected:
+	std::vector<BVHNode> m_nodes;
+	std::vector<QuantizedBVHNode> m_quantizedNodes;
+	std::vector<IndexType> m_indices;
+	BoundingBox3f m_bbox;
+	float m_traversalCost;
+	float m_queryCost;
+	int m_binCount;
+	int m_maxLeafSize;
+	bool m_compressed;
+	bool m_packetBuffer;
+	float m_rebuildThreshold;
+	float m_buildCost;
+	uint32_t m_maxDepth;
+	uint32_t m_leafCount;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __BVH_H */
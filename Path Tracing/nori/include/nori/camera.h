@@ -20,6 +20,7 @@
 #define __CAMERA_H
 
 #include <nori/object.h>
+#include <nori/raypacket.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -59,6 +60,23 @@ public:
 		const Point2f &samplePosition,
 		const Point2f &apertureSample) const = 0;
 
+	/**
+	 * \brief Importance sample a packet of rays
+	 *
+	 * Fills in the first \c packet.count rays of the packet, where ray
+	 * \c i corresponds to <tt>samplePositions[i]</tt> and
+	 * <tt>apertureSamples[i]</tt> (see \ref sampleRay()). The associated
+	 * importance weights are written to \c weights.
+	 *
+	 * The default implementation calls \ref sampleRay() for each ray.
+	 */
+	virtual void sampleRayPacket(RayPacketN &packet, Color3f *weights,
+			const Point2f *samplePositions,
+			const Point2f *apertureSamples) const {
+		for (uint32_t i=0; i<packet.count; ++i)
+			weights[i] = sampleRay(packet.rays[i], samplePositions[i], apertureSamples[i]);
+	}
+
 	/// Return the size of the output image in pixels
 	inline const Vector2i &getOutputSize() const { return m_outputSize; }
 
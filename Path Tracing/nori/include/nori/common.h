@@ -37,6 +37,8 @@
 #include <stdint.h>
 #include <ImathPlatform.h>
 
+class QFile;
+
 /* Convenience definitions */
 #define NORI_NAMESPACE_BEGIN namespace nori {
 #define NORI_NAMESPACE_END }
@@ -63,12 +65,29 @@
 #if defined(__GNUC__)
 #define EXPECT_TAKEN(a)        __builtin_expect(a, true)
 #define EXPECT_NOT_TAKEN(a)    __builtin_expect(a, false)
+#define NORI_PREFETCH(a)       __builtin_prefetch(a)
 #if defined(__linux) 
 #define __restrict             __restrict__
 #endif
 #else
 #define EXPECT_TAKEN(a)        a
 #define EXPECT_NOT_TAKEN(a)    a
+#define NORI_PREFETCH(a)
+#endif
+
+/* Storage class for plain variables with one instance per thread */
+#if defined(_MSC_VER)
+#define NORI_THREAD_LOCAL      __declspec(thread)
+#else
+#define NORI_THREAD_LOCAL      __thread
+#endif
+
+/* Width of triangle and vertex indices in bits (32 or 64). 64-bit indices
+   lift the limits of 2^32 triangles per scene and 2^31 kd-tree references
+   at the cost of larger index buffers and kd-tree nodes. Can be changed
+   at compile time, e.g. using "DEFINES += NORI_INDEX_WIDTH=64" */
+#if !defined(NORI_INDEX_WIDTH)
+#define NORI_INDEX_WIDTH 32
 #endif
 
 /* MSVC is missing a few C99 functions */
@@ -136,6 +155,15 @@ typedef TBoundingBox<Point4i>   BoundingBox4i;
 typedef TRay<Point2f, Vector2f> Ray2f;
 typedef TRay<Point3f, Vector3f> Ray3f;
 
+/// Triangle and vertex index type (see \c NORI_INDEX_WIDTH)
+#if NORI_INDEX_WIDTH == 64
+typedef uint64_t IndexType;
+#elif NORI_INDEX_WIDTH == 32
+typedef uint32_t IndexType;
+#else
+#error NORI_INDEX_WIDTH must be 32 or 64
+#endif
+
 /// Some more forward declarations
 class NoriObject;
 class NoriObjectFactory;
@@ -149,9 +177,11 @@ class Integrator;
 class Sampler;
 class Luminaire;
 class KDTree;
+class Accel;
 class Scene;
 class ReconstructionFilter;
 struct LuminaireQueryRecord;
+struct Intersection;
 class PhaseFunction;
 class Medium;
 
@@ -205,6 +235,15 @@ inline float lerp(float t, float v1, float v2) {
     return ((float) 1 - t) * v1 + t * v2;
 }
 
+/// Insert two zero bits between each of the lower 10 bits of \c v (used to compute Morton codes)
+inline uint32_t expandBits(uint32_t v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
 /// Always-positive modulo operation
 inline int mod(int a, int b) {
 	int r = a % b;
@@ -263,6 +302,20 @@ extern void freeAligned(void *ptr);
 /// Return the number of cores (real and virtual)
 extern int getCoreCount();
 
+/// Return the peak resident set size of the process in bytes (0 if unknown)
+extern size_t getPeakMemoryUsage();
+
+/// Return the name of the machine
+extern QString getHostName();
+
+/// Round a file offset up to the next multiple of 64 bytes (used by the on-disk caches)
+inline uint64_t alignCacheOffset(uint64_t offset) {
+	return (offset + 63) & ~((uint64_t) 63);
+}
+
+/// Pad a cache file with zeros up to \c offset and then write a block of data
+extern bool writeCacheSection(QFile &file, uint64_t offset, const void *data, size_t size);
+
 NORI_NAMESPACE_END
 
 #endif /* __COMMON_H */
@@ -31,6 +31,7 @@
 #define __KDTREE_GENERIC_H
 
 #include <nori/bbox.h>
+#include <nori/atomic.h>
 #include <boost/static_assert.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <QElapsedTimer>
@@ -38,6 +39,7 @@
 #include <QMutex>
 #include <QThread>
 #include <stack>
+#include <deque>
 #include <map>
 
 /** Compile-time KD-tree depth limit. Allows to put certain
@@ -52,7 +54,16 @@
 
 /// Allocate nodes & index lists in blocks of 512 KiB
 #define NORI_KD_BLOCKSIZE_KD  (512*1024/sizeof(KDNode))
-#define NORI_KD_BLOCKSIZE_IDX (512*1024/sizeof(uint32_t))
+#define NORI_KD_BLOCKSIZE_IDX (512*1024/sizeof(IndexType))
+
+/// Subtrees with fewer primitives are never handed to another builder thread
+#define NORI_KD_MIN_TASK_SIZE 4096
+
+/// Parallel min-max binning: minimum number of primitives per job
+#define NORI_KD_MIN_BIN_CHUNK 32768
+
+/// Parallel edge event sort: minimum number of events per job
+#define NORI_KD_MIN_SORT_CHUNK 65536
 
 /**
  * \brief To avoid numerical issues, the size of the scene 
@@ -81,7 +92,7 @@ NORI_NAMESPACE_BEGIN
 class OrderedChunkAllocator {
 public:
 	inline OrderedChunkAllocator(size_t minAllocation = NORI_KD_MIN_ALLOC)
-			: m_minAllocation(minAllocation) {
+			: m_minAllocation(minAllocation), m_usage(NULL), m_peakUsage(NULL) {
 		m_chunks.reserve(16);
 	}
 
@@ -89,10 +100,21 @@ public:
 		cleanup();
 	}
 
+	/**
+	 * \brief Add the size of all chunks to a counter that can be shared
+	 * by several allocators, and keep track of its maximum
+	 */
+	inline void setUsageCounter(volatile int64_t *usage, volatile int64_t *peakUsage) {
+		m_usage = usage;
+		m_peakUsage = peakUsage;
+	}
+
 	/**
 	 * \brief Release all memory used by the allocator
 	 */
 	void cleanup() {
+		if (m_usage)
+			atomicAdd(m_usage, -(int64_t) size());
 		for (std::vector<Chunk>::iterator it = m_chunks.begin();
 				it != m_chunks.end(); ++it)
 			freeAligned((*it).start);
@@ -145,6 +167,9 @@ public:
 		chunk.size = allocSize;
 		m_chunks.push_back(chunk);
 
+		if (m_usage)
+			atomicMax(m_peakUsage, atomicAdd(m_usage, (int64_t) allocSize));
+
 		return reinterpret_cast<T *>(chunk.start);
 	}
 
@@ -199,6 +224,18 @@ public:
 			result += (*it).used();
 		return result;
 	}
+
+	/**
+	 * \brief Return the size of the largest block that can be
+	 * allocated without creating a new chunk
+	 */
+	size_t available() const {
+		size_t result = 0;
+		for (std::vector<Chunk>::const_iterator it = m_chunks.begin();
+				it != m_chunks.end(); ++it)
+			result = std::max(result, (*it).remainder());
+		return result;
+	}
 private:
 	struct Chunk {
 		size_t size;
@@ -215,6 +252,7 @@ private:
 
 	size_t m_minAllocation;
 	std::vector<Chunk> m_chunks;
+	volatile int64_t *m_usage, *m_peakUsage;
 };
 
 /**
@@ -365,13 +403,13 @@ public:
 		}
 	}
 
-	inline void set(uint32_t index, int value) {
+	inline void set(size_t index, int value) {
 		uint8_t *ptr = m_buffer + (index >> 2);
 		uint8_t shift = (index & 3) << 1;
 		*ptr = (*ptr & ~(3 << shift)) | (value << shift);
 	}
 
-	inline int get(uint32_t index) const {
+	inline int get(size_t index) const {
 		uint8_t *ptr = m_buffer + (index >> 2);
 		uint8_t shift = (index & 3) << 1;
 		return (*ptr >> shift) & 3;
@@ -390,30 +428,35 @@ private:
  *
  * This class defines the byte layout for KD-tree nodes and
  * provides methods for querying the tree structure.
+ *
+ * The index type determines the maximum number of primitives and
+ * primitive references. With 32-bit indices (the default), nodes take up
+ * 8 bytes and a tree can hold up to 2^31 primitive references. 64-bit
+ * indices double the size of the nodes and lift this limit.
  */
-template <typename BoundingBoxType> class KDTreeBase {
+template <typename BoundingBoxType, typename _IndexType = uint32_t> class KDTreeBase {
 public:
-	/// Index number format (max 2^32 prims)
-	typedef uint32_t IndexType;
+	/// Index number format
+	typedef _IndexType IndexType;
 
 	/// Size number format
-	typedef uint32_t SizeType;
+	typedef _IndexType SizeType;
 
 	/**
-	 * \brief KD-tree node in 8 bytes. 
+	 * \brief KD-tree node in 8 (32-bit indices) or 16 bytes (64-bit indices)
 	 */
 	struct KDNode {
 		union {
 			/* Inner node */
 			struct {
-				/* Bit layout:
-				   31   : False (inner node)
-				   30   : Indirection node flag
-				   29-3 : Offset to the left child 
-				          or indirection table entry
-				   2-0  : Split axis
+				/* Bit layout (n = number of bits of IndexType):
+				   n-1   : False (inner node)
+				   n-2   : Indirection node flag
+				   n-3..2: Offset to the left child 
+				           or indirection table entry
+				   1-0   : Split axis
 				*/
-				uint32_t combined;
+				IndexType combined;
 
 				/// Split plane coordinate
 				float split;
@@ -422,28 +465,26 @@ public:
 			/* Leaf node */
 			struct {
 				/* Bit layout:
-				   31   : True (leaf node)
-				   30-0 : Offset to the node's primitive list
+				   n-1   : True (leaf node)
+				   n-2..0: Offset to the node's primitive list
 				*/
-				uint32_t combined;
+				IndexType combined;
 
 				/// End offset of the primitive list
-				uint32_t end;
+				IndexType end;
 			} leaf;
 		};
 
-		enum EMask {
-			ETypeMask = 1 << 31,
-			EIndirectionMask = 1 << 30,
-			ELeafOffsetMask = ~ETypeMask,
-			EInnerAxisMask = 0x3,
-			EInnerOffsetMask = ~(EInnerAxisMask + EIndirectionMask),
-			ERelOffsetLimit = (1<<28) - 1
-		};
+		static const IndexType ETypeMask = (IndexType) 1 << (sizeof(IndexType) * 8 - 1);
+		static const IndexType EIndirectionMask = (IndexType) 1 << (sizeof(IndexType) * 8 - 2);
+		static const IndexType ELeafOffsetMask = ~ETypeMask;
+		static const IndexType EInnerAxisMask = 0x3;
+		static const IndexType EInnerOffsetMask = ~(EInnerAxisMask + EIndirectionMask);
+		static const IndexType ERelOffsetLimit = ((IndexType) 1 << (sizeof(IndexType) * 8 - 4)) - 1;
 
 		/// Initialize a leaf kd-Tree node
-		inline void initLeafNode(unsigned int offset, unsigned int numPrims) {
-			leaf.combined = (uint32_t) ETypeMask | offset;
+		inline void initLeafNode(IndexType offset, IndexType numPrims) {
+			leaf.combined = ETypeMask | offset;
 			leaf.end = offset + numPrims;
 		}
 
@@ -452,9 +493,9 @@ public:
 		 * relative offset to the left child node is too large.
 		 */
 		inline bool initInnerNode(int axis, float split, ptrdiff_t relOffset) {
-			if (relOffset < 0 || relOffset > ERelOffsetLimit)
+			if (relOffset < 0 || (IndexType) relOffset > ERelOffsetLimit)
 				return false;
-			inner.combined = axis | ((uint32_t) relOffset << 2);
+			inner.combined = (IndexType) axis | ((IndexType) relOffset << 2);
 			inner.split = split;
 			return true;
 		}
@@ -468,26 +509,26 @@ public:
 		 * stores an index into a globally shared pointer list.
 		 */
 		inline void initIndirectionNode(int axis, float split, 
-				uint32_t indirectionEntry) {
+				IndexType indirectionEntry) {
 			inner.combined = EIndirectionMask 
-				| ((uint32_t) indirectionEntry << 2)
-				| axis;
+				| (indirectionEntry << 2)
+				| (IndexType) axis;
 			inner.split = split;
 		}
 
 		/// Is this a leaf node?
 		inline bool isLeaf() const {
-			return leaf.combined & (uint32_t) ETypeMask;
+			return (leaf.combined & ETypeMask) != 0;
 		}
 
 		/// Is this an indirection node?
 		inline bool isIndirection() const {
-			return leaf.combined & (uint32_t) EIndirectionMask;
+			return (leaf.combined & EIndirectionMask) != 0;
 		}
 
 		/// Assuming this is a leaf node, return the first primitive index
 		inline IndexType getPrimStart() const {
-			return leaf.combined & (uint32_t) ELeafOffsetMask;
+			return leaf.combined & ELeafOffsetMask;
 		}
 
 		/// Assuming this is a leaf node, return the last primitive index
@@ -497,24 +538,24 @@ public:
 
 		/// Return the index of an indirection node
 		inline IndexType getIndirectionIndex() const {
-			return(inner.combined & (uint32_t) EInnerOffsetMask) >> 2;
+			return (inner.combined & EInnerOffsetMask) >> 2;
 		}
 
 		/// Return the left child (assuming that this is an interior node)
 		inline const KDNode * getLeft() const {
 			return this + 
-				((inner.combined & (uint32_t) EInnerOffsetMask) >> 2);
+				((inner.combined & EInnerOffsetMask) >> 2);
 		}
 
 		/// Return the sibling of the current node
 		inline const KDNode * getSibling() const {
-			return (const KDNode *) ((ptrdiff_t) this ^ (ptrdiff_t) 8);
+			return (const KDNode *) ((ptrdiff_t) this ^ (ptrdiff_t) sizeof(KDNode));
 		}
 
 		/// Return the left child (assuming that this is an interior node)
 		inline KDNode * getLeft() {
 			return this + 
-				((inner.combined & (uint32_t) EInnerOffsetMask) >> 2);
+				((inner.combined & EInnerOffsetMask) >> 2);
 		}
 
 		/// Return the left child (assuming that this is an interior node)
@@ -532,11 +573,11 @@ public:
 
 		/// Return the split axis (assuming that this is an interior node)
 		inline int getAxis() const {
-			return inner.combined & (uint32_t) EInnerAxisMask;
+			return (int) (inner.combined & EInnerAxisMask);
 		}
 	};
 
-	BOOST_STATIC_ASSERT(sizeof(KDNode) == 8);
+	BOOST_STATIC_ASSERT(sizeof(KDNode) == 2 * sizeof(IndexType));
 
 	/// Return the root node of the kd-tree
 	inline const KDNode *getRoot() const {
@@ -622,11 +663,14 @@ NORI_NAMESPACE_BEGIN
  * builder. When multiple processors are available, the build process runs
  * in parallel.
  *
+ * The last template parameter selects the index type, which limits the
+ * number of primitives and references (see \ref KDTreeBase).
+ *
  * \author Wenzel Jakob
  * \ingroup librender
  */
-template <typename BoundingBoxType, typename TreeConstructionHeuristic, typename Derived> 
-	class GenericKDTree : public KDTreeBase<BoundingBoxType> {
+template <typename BoundingBoxType, typename TreeConstructionHeuristic, typename Derived,
+	typename _IndexType = uint32_t> class GenericKDTree : public KDTreeBase<BoundingBoxType, _IndexType> {
 protected:
 	// Some forward declarations
 	struct MinMaxBins;
@@ -634,7 +678,7 @@ protected:
 	struct EdgeEventOrdering;
 
 public:
-	typedef KDTreeBase<BoundingBoxType>            Parent;
+	typedef KDTreeBase<BoundingBoxType, _IndexType> Parent;
 	typedef typename Parent::SizeType       SizeType;
 	typedef typename Parent::IndexType      IndexType;
 	typedef typename Parent::KDNode         KDNode;
@@ -663,7 +707,12 @@ public:
 		m_maxDepth = 0;
 		m_retract = true;
 		m_parallelBuild = true;
+		m_threadCount = 0;
 		m_minMaxBins = 128;
+		m_memoryBudget = 0;
+		m_probabilityLayout = true;
+		m_tempMemory = m_peakTempMemory = 0;
+		m_budgetFallbacks = 0;
 	}
 
 	/**
@@ -830,6 +879,22 @@ public:
 		return m_parallelBuild;
 	}
 
+	/**
+	 * \brief Set the number of threads used by a parallel
+	 * build (0 = one per core)
+	 */
+	inline void setThreadCount(SizeType threadCount) {
+		m_threadCount = threadCount;
+	}
+
+	/**
+	 * \brief Return the number of threads used by a parallel
+	 * build (0 = one per core)
+	 */
+	inline SizeType getThreadCount() const {
+		return m_threadCount;
+	}
+
 	/**
 	 * \brief Specify the number of primitives, at which the builder will 
 	 * switch from (approximate) Min-Max binning to the accurate 
@@ -847,7 +912,68 @@ public:
 	inline SizeType getExactPrimitiveThreshold() const {
 		return m_exactPrimThreshold;
 	}
+
+	/**
+	 * \brief Limit the temporary memory of the builder (in bytes)
+	 *
+	 * The edge event lists of the O(n log n) method take more than ten
+	 * times the space of the index lists used by min-max binning. When switching
+	 * over to it would exceed the budget, the builder keeps binning
+	 * instead, which also means that these subtrees are built without
+	 * primitive clipping. Zero (the default) disables the limit.
+	 *
+	 * The budget covers the chunk allocators of all builder threads,
+	 * their classification storage, and the index or event lists that
+	 * are held by queued subtree jobs during a parallel build.
+	 */
+	inline void setMemoryBudget(size_t memoryBudget) {
+		m_memoryBudget = memoryBudget;
+	}
+
+	/// Return the temporary memory budget of the builder (0 = unlimited)
+	inline size_t getMemoryBudget() const {
+		return m_memoryBudget;
+	}
+
+	/**
+	 * \brief Specify the order in which the nodes are stored
+	 *
+	 * The finished tree is stored in depth-first order, and the children
+	 * of a node are always adjacent. By default, the subtree of the child
+	 * with the higher probability according to the construction heuristic
+	 * follows right after them, so that the likely path of a query
+	 * through the tree stays within a small part of memory. Otherwise,
+	 * the subtree of the left child comes first.
+	 */
+	inline void setProbabilityLayout(bool probabilityLayout) {
+		m_probabilityLayout = probabilityLayout;
+	}
+
+	/// Return whether the nodes are stored in order of their probabilities
+	inline bool getProbabilityLayout() const {
+		return m_probabilityLayout;
+	}
+
+	/// Return the peak temporary memory usage of the last build in bytes
+	inline size_t getPeakTempMemory() const {
+		return (size_t) m_peakTempMemory;
+	}
 protected:
+	/**
+	 * \brief Release the tree so that \ref buildInternal()
+	 * can be called again
+	 */
+	void clear() {
+		if (m_indices) {
+			delete[] m_indices;
+			m_indices = NULL;
+		}
+		if (m_nodes) {
+			freeAligned(m_nodes-1); // undo alignment shift
+			m_nodes = NULL;
+		}
+	}
+
 	/**
 	 * \brief Build a KD-tree over the supplied geometry
 	 *
@@ -875,10 +1001,14 @@ protected:
 			return;
 		}
 
-		if (primCount <= m_exactPrimThreshold)
-			m_parallelBuild = false;
+		SizeType threadCount = m_threadCount > 0 ? m_threadCount
+			: (SizeType) getCoreCount();
+		if (!m_parallelBuild || primCount < 2*NORI_KD_MIN_TASK_SIZE)
+			threadCount = 1;
 
-		BuildContext ctx(primCount, m_minMaxBins);
+		m_tempMemory = m_peakTempMemory = 0;
+		m_budgetFallbacks = 0;
+		BuildContext ctx(0, primCount, m_minMaxBins, &m_tempMemory, &m_peakTempMemory);
 
 		/* Establish an ad-hoc depth cutoff value (Formula from PBRT) */
 		if (m_maxDepth == 0)
@@ -909,33 +1039,32 @@ protected:
 				<< "  Min-max bins               : " << m_minMaxBins << endl
 				<< "  O(n log n method)          : use for " << m_exactPrimThreshold << " primitives" << endl
 				<< "  Perfect splits             : " << m_clip << endl
+				<< "  Memory budget              : " << m_memoryBudget / 1024 << " KiB" << endl
 				<< "  Retract bad splits         : " << m_retract << endl
 				<< "  Stopping primitive count   : " << m_stopPrims << endl
-				<< "  Build tree in parallel     : " << m_parallelBuild << endl << endl;
+				<< "  Builder threads            : " << threadCount << endl << endl;
 		#endif
 
-		SizeType procCount = getCoreCount();
-		if (procCount == 1)
-			m_parallelBuild = false;
-
-		if (m_parallelBuild) {
-			m_builders.resize(procCount);
-			for (SizeType i=0; i<procCount; ++i) {
-				m_builders[i] = new TreeBuilder(i, this);
-				m_builders[i]->start();
-			}
+		/* The calling thread acts as builder number zero */
+		m_interface.reset(threadCount);
+		m_interface.contexts[0] = &ctx;
+		for (SizeType i=1; i<threadCount; ++i) {
+			TreeBuilder *builder = new TreeBuilder((IndexType) i, this);
+			m_interface.contexts[i] = &builder->getContext();
+			m_builders.push_back(builder);
 		}
+		for (SizeType i=0; i<m_builders.size(); ++i)
+			m_builders[i]->start();
 
 		KDNode *prelimRoot = ctx.nodes.allocate(1);
 		buildTreeMinMax(ctx, 1, prelimRoot, bbox, bbox, 
 				indices, primCount, true, 0);
 		ctx.leftAlloc.release(indices);
 
-		if (m_parallelBuild) {
-			m_interface.mutex.lock();
-			m_interface.done = true;
-			m_interface.cond.wakeAll();
-			m_interface.mutex.unlock();
+		if (isParallel()) {
+			/* Done with the root -- help out with the remaining subtrees */
+			subtreeFinished();
+			processJobs(ctx);
 			for (SizeType i=0; i<m_builders.size(); ++i) 
 				m_builders[i]->wait();
 		}
@@ -988,9 +1117,9 @@ protected:
 			stack.pop();
 			typename std::map<const KDNode *, IndexType>::const_iterator it 
 				= m_interface.threadMap.find(node);
-			// Check if we're switching to a subtree built by a worker thread
+			// Check if we're switching to a subtree built by another thread
 			if (it != m_interface.threadMap.end()) 
-				context = &m_builders[(*it).second]->getContext();
+				context = m_interface.contexts[(*it).second];
 
 			if (node->isLeaf()) {
 				SizeType primStart = node->getPrimStart(),
@@ -1033,12 +1162,22 @@ protected:
 					throw NoriException("Cannot represent relative pointer -- "
 						"too many primitives?");
 
-				float tmp = bbox.min[axis];
-				bbox.min[axis] = split;
-				stack.push(boost::make_tuple(left+1, children+1, context, bbox));
-				bbox.min[axis] = tmp;
-				bbox.max[axis] = split;
-				stack.push(boost::make_tuple(left, children, context, bbox));
+				BoundingBoxType leftBBox(bbox), rightBBox(bbox);
+				leftBBox.max[axis] = split;
+				rightBBox.min[axis] = split;
+
+				/* The subtree that is popped first is stored right after
+				   the children. With the probability layout, this is the
+				   child that is more likely to be visited by a query */
+				if (m_probabilityLayout &&
+					TreeConstructionHeuristic::getQuantity(rightBBox) >
+					TreeConstructionHeuristic::getQuantity(leftBBox)) {
+					stack.push(boost::make_tuple(left, children, context, leftBBox));
+					stack.push(boost::make_tuple(left+1, children+1, context, rightBBox));
+				} else {
+					stack.push(boost::make_tuple(left+1, children+1, context, rightBBox));
+					stack.push(boost::make_tuple(left, children, context, leftBBox));
+				}
 			}
 		}
 
@@ -1052,6 +1191,11 @@ protected:
 		}
 		std::vector<KDNode *>().swap(m_indirections);
 
+		SizeType workUnits = (SizeType) m_interface.threadMap.size();
+		#if NORI_KD_VERBOSE == 1
+			SizeType stolenJobs = m_interface.stolenJobs;
+		#endif
+		m_interface.reset(0);
 		if (m_builders.size() > 0) {
 			for (SizeType i=0; i<m_builders.size(); ++i)
 				delete m_builders[i];
@@ -1075,7 +1219,8 @@ protected:
 
 		#if NORI_KD_VERBOSE == 1
 			cout << "Structural kd-tree statistics" << endl
-				<< "  Parallel work units         : " << m_interface.threadMap.size() << endl
+				<< "  Parallel work units         : " << workUnits << endl
+				<< "  Stolen jobs                 : " << stolenJobs << endl
 				<< "  Node storage cost           : " << (nodePtr * sizeof(KDNode)) / 1024 << " KiB" << endl
 				<< "  Index storage cost          : " << (indexPtr * sizeof(IndexType)) / 1024 << " KiB" << endl
 				<< "  Inner nodes                 : " << ctx.innerNodeCount << endl
@@ -1094,9 +1239,15 @@ protected:
 		#endif
 
 		cout << "Finished after " << timer.elapsed() << " ms (used "  
-			<< totalUsage/1024 << " KiB of temp. memory)" << endl 
+			<< totalUsage/1024 << " KiB of temp. memory, " << workUnits
+			<< " parallel work units)" << endl 
 			<< "The final kd-tree requires " << (nodePtr*sizeof(KDNode) + 
 			indexPtr * sizeof(IndexType)) / 1024 << " KiB of memory" << endl;
+
+		if (m_budgetFallbacks > 0)
+			cout << "Used min-max binning instead of the O(n log n) method for "
+				<< m_budgetFallbacks << " nodes to stay within the memory budget of "
+				<< m_memoryBudget / 1024 << " KiB" << endl;
 	}
 
 protected:
@@ -1129,19 +1280,19 @@ protected:
 
 		/// Create a new edge event
 		inline EdgeEvent(uint16_t type, int axis, float pos, IndexType index)
-		 : pos(pos), index(index), type(type), axis(axis) { }
+		 : index(index), pos(pos), type(type), axis(axis) { }
 
+		/// Primitive index (first to avoid padding with 64-bit indices)
+		IndexType index;
 		/// Plane position
 		float pos;
-		/// Primitive index
-		IndexType index;
 		/// Event type: end/planar/start
 		unsigned int type:2;
 		/// Event axis
 		unsigned int axis:2;
 	};
 
-	BOOST_STATIC_ASSERT(sizeof(EdgeEvent) == 12);
+	BOOST_STATIC_ASSERT(sizeof(EdgeEvent) == sizeof(IndexType) + 8);
 
 	/// Edge event comparison functor
 	struct EdgeEventOrdering : public std::binary_function<EdgeEvent, EdgeEvent, bool> {
@@ -1176,6 +1327,7 @@ protected:
 	 * also records some useful statistics.
 	 */
 	struct BuildContext {
+		IndexType id;
 		OrderedChunkAllocator leftAlloc, rightAlloc;
 		BlockedVector<KDNode, NORI_KD_BLOCKSIZE_KD> nodes;
 		BlockedVector<IndexType, NORI_KD_BLOCKSIZE_IDX> indices;
@@ -1188,10 +1340,15 @@ protected:
 		SizeType primIndexCount;
 		SizeType retractedSplits;
 		SizeType pruned;
+		volatile int64_t *usage;
 
-		BuildContext(SizeType primCount, SizeType binCount)
-			: minMaxBins(binCount) {
+		BuildContext(IndexType id, SizeType primCount, SizeType binCount,
+				volatile int64_t *usage, volatile int64_t *peakUsage)
+			: id(id), minMaxBins(binCount), usage(usage) {
+			leftAlloc.setUsageCounter(usage, peakUsage);
+			rightAlloc.setUsageCounter(usage, peakUsage);
 			classStorage.setPrimitiveCount(primCount);
+			atomicMax(peakUsage, atomicAdd(usage, (int64_t) classStorage.size()));
 			leafNodeCount = 0;
 			nonemptyLeafNodeCount = 0;
 			innerNodeCount = 0;
@@ -1200,6 +1357,10 @@ protected:
 			pruned = 0;
 		}
 
+		~BuildContext() {
+			atomicAdd(usage, -(int64_t) classStorage.size());
+		}
+
 		size_t size() {
 			return leftAlloc.size() + rightAlloc.size() 
 				+ nodes.capacity() * sizeof(KDNode)
@@ -1218,26 +1379,147 @@ protected:
 	};
 
 	/**
-	 * \brief Communication data structure used to pass jobs to
-	 * kd-tree builder threads
+	 * \brief Unit of work that is executed by the kd-tree builder threads
+	 *
+	 * Jobs either build an entire subtree (these are owned by the
+	 * job queues and deleted after execution) or process one chunk of
+	 * a data-parallel operation, in which case \ref join points to a
+	 * counter of unfinished jobs owned by the thread that waits for
+	 * them (see \ref runJobs()).
+	 */
+	struct BuildJob {
+		SizeType *join;
+
+		inline BuildJob() : join(NULL) { }
+		virtual ~BuildJob() { }
+
+		/// Execute the job using the context of the current thread
+		virtual void execute(BuildContext &ctx) = 0;
+	};
+
+	/**
+	 * \brief Build a subtree using min-max binning or the O(n log n)
+	 * method. The job carries its own copy of the primitive index
+	 * or edge event list, which counts as temporary memory of the
+	 * builder until the job has moved it into its allocator.
+	 */
+	struct SubtreeJob : public BuildJob {
+		GenericKDTree *parent;
+		unsigned int depth;
+		KDNode *node;
+		BoundingBoxType nodeBoundingBox, tightBBox;
+		std::vector<IndexType> indices;
+		std::vector<EdgeEvent> events;
+		SizeType primCount, badRefines;
+
+		/// Return the size of the index or edge event list
+		inline size_t payloadSize() const {
+			return indices.capacity() * sizeof(IndexType)
+				+ events.capacity() * sizeof(EdgeEvent);
+		}
+
+		void execute(BuildContext &ctx) {
+			parent->m_interface.mutex.lock();
+			parent->m_interface.threadMap[node] = ctx.id;
+			parent->m_interface.mutex.unlock();
+
+			OrderedChunkAllocator &leftAlloc = ctx.leftAlloc;
+			if (events.empty()) {
+				IndexType *temp = leftAlloc.allocate<IndexType>(indices.size());
+				std::copy(indices.begin(), indices.end(), temp);
+				int64_t payload = (int64_t) payloadSize();
+				std::vector<IndexType>().swap(indices);
+				parent->trackTempMemory(-payload);
+				parent->buildTreeMinMax(ctx, depth, node, nodeBoundingBox,
+					tightBBox, temp, primCount, true, badRefines);
+				leftAlloc.release(temp);
+			} else {
+				size_t eventCount = events.size();
+				EdgeEvent *eventStart = leftAlloc.allocate<EdgeEvent>(eventCount),
+						  *eventEnd = eventStart + eventCount;
+				std::copy(events.begin(), events.end(), eventStart);
+				int64_t payload = (int64_t) payloadSize();
+				std::vector<EdgeEvent>().swap(events);
+				parent->trackTempMemory(-payload);
+				parent->buildTree(ctx, depth, node, nodeBoundingBox,
+					eventStart, eventEnd, primCount, true, badRefines);
+				leftAlloc.release(eventStart);
+			}
+		}
+	};
+
+	/// Min-max bin a chunk of a primitive list into private counters
+	struct BinJob : public BuildJob {
+		const MinMaxBins *bins;
+		const Derived *derived;
+		const IndexType *indices;
+		SizeType primCount;
+		std::vector<SizeType> minBins, maxBins;
+
+		void execute(BuildContext &) {
+			bins->binRange(derived, indices, primCount, &minBins[0], &maxBins[0]);
+		}
+	};
+
+	/// Sort a chunk of an edge event list
+	struct SortJob : public BuildJob {
+		EdgeEvent *start, *end;
+
+		void execute(BuildContext &) {
+			std::sort(start, end, EdgeEventOrdering());
+		}
+	};
+
+	/// Merge two adjacent sorted runs of edge events into a target buffer
+	struct MergeJob : public BuildJob {
+		EdgeEvent *start, *middle, *end, *target;
+
+		void execute(BuildContext &) {
+			std::merge(start, middle, middle, end, target, EdgeEventOrdering());
+		}
+	};
+
+	/**
+	 * \brief Shared state of the work-stealing job system used
+	 * by the parallel tree construction.
+	 *
+	 * Every builder thread has a job queue. New jobs are appended
+	 * to the back of the queue of the thread that created them, which
+	 * also takes its own jobs from the back (i.e. it descends depth-first
+	 * as in a serial build). Idle threads steal from the front of other
+	 * queues, which contains the oldest and hence largest subtrees.
+	 * Subtree jobs are only created for nodes with at least
+	 * \ref NORI_KD_MIN_TASK_SIZE primitives, so all operations simply
+	 * use one lock.
 	 */
 	struct BuildInterface {
-		/* Communcation */
 		QMutex mutex;
-		QWaitCondition cond, condJobTaken;
+		/// Signaled when new jobs are available or the build is done
+		QWaitCondition cond;
+		/// Signaled when a group of data-parallel jobs has finished
+		QWaitCondition condJoin;
+		std::vector<std::deque<BuildJob *> > queues;
+		std::vector<BuildContext *> contexts;
+		/// Maps roots of subtrees built by a job to the thread in question
 		std::map<const KDNode *, IndexType> threadMap;
+		/// Subtree jobs that are queued or running (incl. the root)
+		SizeType pendingJobs;
+		SizeType stolenJobs;
 		bool done;
 
-		/* Job description for building a subtree */
-		int depth;
-		KDNode *node;
-		BoundingBoxType nodeBoundingBox;
-		EdgeEvent *eventStart, *eventEnd;
-		SizeType primCount;
-		int badRefines;
-
 		inline BuildInterface() {
-			node = NULL;
+			reset(0);
+		}
+
+		/// Prepare for a build with the given number of threads
+		void reset(SizeType threadCount) {
+			queues.clear();
+			queues.resize(threadCount);
+			contexts.clear();
+			contexts.resize(threadCount);
+			threadMap.clear();
+			pendingJobs = 1;
+			stolenJobs = 0;
 			done = false;
 		}
 	};
@@ -1248,43 +1530,14 @@ protected:
 	class TreeBuilder : public QThread {
 	public:
 		TreeBuilder(IndexType id, GenericKDTree *parent) 
-			: QThread(), m_id(id),
-			m_parent(parent),
-			m_context(parent->cast()->getPrimitiveCount(),
-					  parent->getMinMaxBins()),
-			m_interface(parent->m_interface) {
+			: QThread(), m_parent(parent),
+			m_context(id, parent->cast()->getPrimitiveCount(),
+					  parent->getMinMaxBins(), &parent->m_tempMemory,
+					  &parent->m_peakTempMemory) {
 		}
 
 		void run() {
-			OrderedChunkAllocator &leftAlloc = m_context.leftAlloc;
-			while (true) {
-				m_interface.mutex.lock();
-				while (!m_interface.done && !m_interface.node)
-					m_interface.cond.wait(&m_interface.mutex);
-				if (m_interface.done) {
-					m_interface.mutex.unlock();
-					break;
-				}
-				int depth = m_interface.depth;
-				KDNode *node = m_interface.node;
-				BoundingBoxType nodeBoundingBox = m_interface.nodeBoundingBox;
-				size_t eventCount = m_interface.eventEnd - m_interface.eventStart;
-				SizeType primCount = m_interface.primCount;
-				int badRefines = m_interface.badRefines;
-				EdgeEvent *eventStart = leftAlloc.allocate<EdgeEvent>(eventCount),
-						  *eventEnd = eventStart + eventCount;
-				memcpy(eventStart, m_interface.eventStart, 
-						eventCount * sizeof(EdgeEvent));
-				m_interface.threadMap[node] = m_id;
-				m_interface.node = NULL;
-				m_interface.condJobTaken.wakeOne();
-				m_interface.mutex.unlock();
-
-				std::sort(eventStart, eventEnd, EdgeEventOrdering());
-				m_parent->buildTree(m_context, depth, node,
-					nodeBoundingBox, eventStart, eventEnd, primCount, true, badRefines);
-				leftAlloc.release(eventStart);
-			}
+			m_parent->processJobs(m_context);
 		}
 
 		inline BuildContext &getContext() {
@@ -1292,12 +1545,214 @@ protected:
 		}
 
 	private:
-		IndexType m_id;
 		GenericKDTree *m_parent;
 		BuildContext m_context;
-		BuildInterface &m_interface;
 	};
 
+	/// Are several threads working on the current build?
+	inline bool isParallel() const {
+		return m_interface.contexts.size() > 1;
+	}
+
+	/**
+	 * \brief Remove a job from the queue of the thread \c id or
+	 * steal one from another thread. Must be called with the
+	 * lock held.
+	 */
+	BuildJob *takeJob(IndexType id) {
+		std::deque<BuildJob *> &queue = m_interface.queues[id];
+		if (!queue.empty()) {
+			BuildJob *job = queue.back();
+			queue.pop_back();
+			return job;
+		}
+		SizeType threadCount = (SizeType) m_interface.queues.size();
+		for (SizeType i=1; i<threadCount; ++i) {
+			std::deque<BuildJob *> &victim = m_interface.queues[(id + i) % threadCount];
+			if (!victim.empty()) {
+				BuildJob *job = victim.front();
+				victim.pop_front();
+				m_interface.stolenJobs++;
+				return job;
+			}
+		}
+		return NULL;
+	}
+
+	/// Called whenever the construction of a subtree job has finished
+	void subtreeFinished() {
+		m_interface.mutex.lock();
+		if (--m_interface.pendingJobs == 0) {
+			m_interface.done = true;
+			m_interface.cond.wakeAll();
+		}
+		m_interface.mutex.unlock();
+	}
+
+	/// Execute jobs until the tree construction has finished
+	void processJobs(BuildContext &ctx) {
+		m_interface.mutex.lock();
+		while (true) {
+			BuildJob *job = takeJob(ctx.id);
+			if (job) {
+				m_interface.mutex.unlock();
+				job->execute(ctx);
+				if (job->join) {
+					m_interface.mutex.lock();
+					if (--*job->join == 0)
+						m_interface.condJoin.wakeAll();
+				} else {
+					delete job;
+					subtreeFinished();
+					m_interface.mutex.lock();
+				}
+			} else if (m_interface.done) {
+				break;
+			} else {
+				m_interface.cond.wait(&m_interface.mutex);
+			}
+		}
+		m_interface.mutex.unlock();
+	}
+
+	/// Add memory that is not owned by a chunk allocator to the temp. memory counters
+	inline void trackTempMemory(int64_t size) {
+		int64_t usage = atomicAdd(&m_tempMemory, size);
+		if (size > 0)
+			atomicMax(&m_peakTempMemory, usage);
+	}
+
+	/// Queue a subtree job, which may be picked up by another thread
+	void spawnSubtree(BuildContext &ctx, SubtreeJob *job) {
+		job->parent = this;
+		trackTempMemory((int64_t) job->payloadSize());
+		m_interface.mutex.lock();
+		m_interface.queues[ctx.id].push_back(job);
+		m_interface.pendingJobs++;
+		m_interface.cond.wakeOne();
+		m_interface.mutex.unlock();
+	}
+
+	/**
+	 * \brief Execute a group of data-parallel jobs and wait until
+	 * all of them have finished.
+	 *
+	 * The calling thread processes the jobs itself unless they have
+	 * been stolen by idle threads in the meantime.
+	 */
+	void runJobs(BuildContext &ctx, BuildJob **jobs, SizeType jobCount) {
+		SizeType remaining = jobCount;
+		std::deque<BuildJob *> &queue = m_interface.queues[ctx.id];
+
+		m_interface.mutex.lock();
+		for (SizeType i=0; i<jobCount; ++i) {
+			jobs[i]->join = &remaining;
+			queue.push_back(jobs[i]);
+		}
+		m_interface.cond.wakeAll();
+
+		while (remaining > 0) {
+			if (!queue.empty() && queue.back()->join == &remaining) {
+				BuildJob *job = queue.back();
+				queue.pop_back();
+				m_interface.mutex.unlock();
+				job->execute(ctx);
+				m_interface.mutex.lock();
+				--remaining;
+			} else {
+				m_interface.condJoin.wait(&m_interface.mutex);
+			}
+		}
+		m_interface.mutex.unlock();
+	}
+
+	/**
+	 * \brief Min-max binning of a large primitive list. The list is
+	 * binned in chunks by several threads if possible.
+	 */
+	void binMinMax(BuildContext &ctx, IndexType *indices, SizeType primCount) {
+		SizeType jobCount = std::min((SizeType) m_interface.contexts.size(),
+				primCount / NORI_KD_MIN_BIN_CHUNK);
+		if (jobCount <= 1) {
+			ctx.minMaxBins.bin(cast(), indices, primCount);
+			return;
+		}
+
+		std::vector<BinJob> jobs(jobCount);
+		std::vector<BuildJob *> jobPtrs(jobCount);
+		SizeType binCount = m_minMaxBins * PointType::Dimension;
+		for (SizeType i=0; i<jobCount; ++i) {
+			SizeType start = (SizeType) (((uint64_t) primCount * i) / jobCount),
+					 end = (SizeType) (((uint64_t) primCount * (i+1)) / jobCount);
+			BinJob &job = jobs[i];
+			job.bins = &ctx.minMaxBins;
+			job.derived = cast();
+			job.indices = indices + start;
+			job.primCount = end - start;
+			job.minBins.resize(binCount, 0);
+			job.maxBins.resize(binCount, 0);
+			jobPtrs[i] = &job;
+		}
+		runJobs(ctx, &jobPtrs[0], jobCount);
+
+		ctx.minMaxBins.clear(primCount);
+		for (SizeType i=0; i<jobCount; ++i)
+			ctx.minMaxBins.accumulate(&jobs[i].minBins[0], &jobs[i].maxBins[0]);
+	}
+
+	/**
+	 * \brief Sort an edge event list. Large lists are split into
+	 * runs that are sorted and then merged in parallel.
+	 */
+	void sortEvents(BuildContext &ctx, EdgeEvent *eventStart, EdgeEvent *eventEnd) {
+		size_t eventCount = eventEnd - eventStart;
+		SizeType runCount = 1;
+		while (runCount * 2 <= m_interface.contexts.size() &&
+				eventCount / (runCount * 2) >= NORI_KD_MIN_SORT_CHUNK)
+			runCount *= 2;
+
+		if (runCount == 1) {
+			std::sort(eventStart, eventEnd, EdgeEventOrdering());
+			return;
+		}
+
+		std::vector<size_t> bounds(runCount + 1);
+		for (SizeType i=0; i<=runCount; ++i)
+			bounds[i] = (eventCount * i) / runCount;
+
+		std::vector<SortJob> sortJobs(runCount);
+		std::vector<BuildJob *> jobPtrs(runCount);
+		for (SizeType i=0; i<runCount; ++i) {
+			sortJobs[i].start = eventStart + bounds[i];
+			sortJobs[i].end = eventStart + bounds[i+1];
+			jobPtrs[i] = &sortJobs[i];
+		}
+		runJobs(ctx, &jobPtrs[0], runCount);
+
+		/* Merge pairs of runs, ping-ponging between two buffers */
+		EdgeEvent *temp = static_cast<EdgeEvent *>(
+				allocAligned(sizeof(EdgeEvent) * eventCount));
+		EdgeEvent *source = eventStart, *target = temp;
+		for (SizeType width = 1; width < runCount; width *= 2) {
+			SizeType mergeCount = runCount / (2 * width);
+			std::vector<MergeJob> mergeJobs(mergeCount);
+			for (SizeType i=0; i<mergeCount; ++i) {
+				SizeType run = 2 * width * i;
+				MergeJob &job = mergeJobs[i];
+				job.start = source + bounds[run];
+				job.middle = source + bounds[run + width];
+				job.end = source + bounds[run + 2 * width];
+				job.target = target + bounds[run];
+				jobPtrs[i] = &job;
+			}
+			runJobs(ctx, &jobPtrs[0], mergeCount);
+			std::swap(source, target);
+		}
+		if (source != eventStart)
+			memcpy(eventStart, source, sizeof(EdgeEvent) * eventCount);
+		freeAligned(temp);
+	}
+
 	/// Cast to the derived class
 	inline Derived *cast() {
 		return static_cast<Derived *>(this);
@@ -1355,6 +1810,25 @@ protected:
 		return boost::make_tuple(eventStart, eventEnd, actualPrimCount);
 	}
 
+	/**
+	 * \brief Check whether the O(n log n) method can build a subtree
+	 * without exceeding the memory budget
+	 *
+	 * Besides the node's own event list, the builder needs space for the
+	 * lists of the children and, with primitive clipping, temporary lists
+	 * for straddling primitives. These are estimated conservatively.
+	 */
+	inline bool withinMemoryBudget(const OrderedChunkAllocator &alloc,
+			SizeType primCount) const {
+		if (m_memoryBudget == 0)
+			return true;
+		size_t listSize = sizeof(EdgeEvent) * 2 * PointType::Dimension * (size_t) primCount,
+		       required = (m_clip ? 4 : 2) * listSize;
+		if (alloc.available() >= required)
+			return true;
+		return (size_t) m_tempMemory + required <= m_memoryBudget;
+	}
+
 	/**
 	 * \brief Leaf node creation helper function
 	 *
@@ -1496,33 +1970,11 @@ protected:
 				? ctx.leftAlloc : ctx.rightAlloc;
 		boost::tuple<EdgeEvent *, EdgeEvent *, SizeType> events  
 				= createEventList(alloc, nodeBoundingBox, indices, primCount);
-		float cost;
-		if (m_parallelBuild) {
-			m_interface.mutex.lock();
-			m_interface.depth = depth;
-			m_interface.node = node;
-			m_interface.nodeBoundingBox = nodeBoundingBox;
-			m_interface.eventStart = boost::get<0>(events);
-			m_interface.eventEnd = boost::get<1>(events);
-			m_interface.primCount = boost::get<2>(events);
-			m_interface.badRefines = badRefines;
-			m_interface.cond.wakeOne();
-
-			/* Wait for a worker thread to take this job */
-			while (m_interface.node)
-				m_interface.condJobTaken.wait(&m_interface.mutex);
-			m_interface.mutex.unlock();
+		sortEvents(ctx, boost::get<0>(events), boost::get<1>(events));
 
-			// Never tear down this subtree (return a cost of -infinity)
-			cost = -std::numeric_limits<float>::infinity();
-		} else {
-			std::sort(boost::get<0>(events), boost::get<1>(events), 
-					EdgeEventOrdering());
-
-			cost = buildTree(ctx, depth, node, nodeBoundingBox,
-				boost::get<0>(events), boost::get<1>(events), 
-				boost::get<2>(events), isLeftChild, badRefines);
-		}
+		float cost = buildTree(ctx, depth, node, nodeBoundingBox,
+			boost::get<0>(events), boost::get<1>(events), 
+			boost::get<2>(events), isLeftChild, badRefines);
 		alloc.release(boost::get<0>(events));
 		return cost;
 	}
@@ -1566,16 +2018,19 @@ protected:
 			return leafCost;
 		}
 
-		if (primCount <= m_exactPrimThreshold) 
-			return transitionToNLogN(ctx, depth, node, nodeBoundingBox, indices,
-				primCount, isLeftChild, badRefines);
+		if (primCount <= m_exactPrimThreshold) {
+			if (withinMemoryBudget(isLeftChild ? ctx.leftAlloc : ctx.rightAlloc, primCount))
+				return transitionToNLogN(ctx, depth, node, nodeBoundingBox, indices,
+					primCount, isLeftChild, badRefines);
+			atomicAdd(&m_budgetFallbacks, 1);
+		}
 
 		/* ==================================================================== */
 	    /*                              Binning                                 */
 	    /* ==================================================================== */
 
 		ctx.minMaxBins.setBoundingBox(tightBBox);
-		ctx.minMaxBins.bin(cast(), indices, primCount);
+		binMinMax(ctx, indices, primCount);
 
 		/* ==================================================================== */
 	    /*                        Split candidate search                        */
@@ -1638,19 +2093,41 @@ protected:
 		}
 		ctx.innerNodeCount++;
 
-		BoundingBoxType childBoundingBox(nodeBoundingBox);
-		childBoundingBox.max[bestSplit.axis] = bestSplit.pos;
-
-		float leftCost = buildTreeMinMax(ctx, depth+1, children,
-				childBoundingBox, boost::get<0>(partition), boost::get<1>(partition), 
-				bestSplit.numLeft, true, badRefines);
+		BoundingBoxType leftBoundingBox(nodeBoundingBox), rightBoundingBox(nodeBoundingBox);
+		leftBoundingBox.max[bestSplit.axis] = bestSplit.pos;
+		rightBoundingBox.min[bestSplit.axis] = bestSplit.pos;
+
+		float leftCost, rightCost;
+		if (isParallel() && bestSplit.numLeft >= NORI_KD_MIN_TASK_SIZE 
+				&& bestSplit.numRight >= NORI_KD_MIN_TASK_SIZE) {
+			/* Let another thread build the right subtree if one
+			   becomes idle in the meantime */
+			SubtreeJob *job = new SubtreeJob();
+			job->depth = depth+1;
+			job->node = children + 1;
+			job->nodeBoundingBox = rightBoundingBox;
+			job->tightBBox = boost::get<2>(partition);
+			job->indices.assign(boost::get<3>(partition), 
+				boost::get<3>(partition) + bestSplit.numRight);
+			job->primCount = bestSplit.numRight;
+			job->badRefines = badRefines;
+			spawnSubtree(ctx, job);
+
+			leftCost = buildTreeMinMax(ctx, depth+1, children,
+					leftBoundingBox, boost::get<0>(partition), boost::get<1>(partition), 
+					bestSplit.numLeft, true, badRefines);
 
-		childBoundingBox.min[bestSplit.axis] = bestSplit.pos;
-		childBoundingBox.max[bestSplit.axis] = nodeBoundingBox.max[bestSplit.axis];
+			// Never tear down this subtree (return a cost of -infinity)
+			rightCost = -std::numeric_limits<float>::infinity();
+		} else {
+			leftCost = buildTreeMinMax(ctx, depth+1, children,
+					leftBoundingBox, boost::get<0>(partition), boost::get<1>(partition), 
+					bestSplit.numLeft, true, badRefines);
 
-		float rightCost = buildTreeMinMax(ctx, depth+1, children + 1,
-				childBoundingBox, boost::get<2>(partition), boost::get<3>(partition), 
-				bestSplit.numRight, false, badRefines);
+			rightCost = buildTreeMinMax(ctx, depth+1, children + 1,
+					rightBoundingBox, boost::get<2>(partition), boost::get<3>(partition), 
+					bestSplit.numRight, false, badRefines);
+		}
 
 		TreeConstructionHeuristic tch(nodeBoundingBox);
 		std::pair<float, float> prob = tch(bestSplit.axis, 
@@ -2085,13 +2562,38 @@ protected:
 		}
 		ctx.innerNodeCount++;
 
-		float leftCost = buildTree(ctx, depth+1, children,
-				leftNodeBoundingBox, leftEventsStart, leftEventsEnd,
-				bestSplit.numLeft - prunedLeft, true, badRefines);
+		SizeType leftPrims = bestSplit.numLeft - prunedLeft,
+				 rightPrims = bestSplit.numRight - prunedRight;
+		float leftCost, rightCost;
+
+		if (isParallel() && leftPrims >= NORI_KD_MIN_TASK_SIZE 
+				&& rightPrims >= NORI_KD_MIN_TASK_SIZE) {
+			/* Let another thread build the right subtree if one
+			   becomes idle in the meantime */
+			SubtreeJob *job = new SubtreeJob();
+			job->depth = depth+1;
+			job->node = children + 1;
+			job->nodeBoundingBox = rightNodeBoundingBox;
+			job->events.assign(rightEventsStart, rightEventsEnd);
+			job->primCount = rightPrims;
+			job->badRefines = badRefines;
+			spawnSubtree(ctx, job);
+
+			leftCost = buildTree(ctx, depth+1, children,
+					leftNodeBoundingBox, leftEventsStart, leftEventsEnd,
+					leftPrims, true, badRefines);
 
-		float rightCost = buildTree(ctx, depth+1, children+1,
-				rightNodeBoundingBox, rightEventsStart, rightEventsEnd,
-				bestSplit.numRight - prunedRight, false, badRefines);
+			// Never tear down this subtree (return a cost of -infinity)
+			rightCost = -std::numeric_limits<float>::infinity();
+		} else {
+			leftCost = buildTree(ctx, depth+1, children,
+					leftNodeBoundingBox, leftEventsStart, leftEventsEnd,
+					leftPrims, true, badRefines);
+
+			rightCost = buildTree(ctx, depth+1, children+1,
+					rightNodeBoundingBox, rightEventsStart, rightEventsEnd,
+					rightPrims, false, badRefines);
+		}
 
 		std::pair<float, float> prob = tch(bestSplit.axis, 
 			bestSplit.pos - nodeBoundingBox.min[bestSplit.axis],
@@ -2166,26 +2668,53 @@ protected:
 		 */
 		void bin(const Derived *derived, IndexType *indices, 
 				SizeType primCount) {
-			m_primCount = primCount;
-			memset(m_minBins, 0, sizeof(SizeType) * PointType::Dimension * m_binCount);
-			memset(m_maxBins, 0, sizeof(SizeType) * PointType::Dimension * m_binCount);
+			clear(primCount);
+			binRange(derived, indices, primCount, m_minBins, m_maxBins);
+		}
+
+		/**
+		 * \brief Bin a part of a primitive list into the supplied
+		 * (zero-initialized) counter arrays instead of the
+		 * internal ones.
+		 *
+		 * This function only reads the state of the instance and
+		 * can therefore be called by several threads at once (see
+		 * \ref GenericKDTree::binMinMax()).
+		 */
+		void binRange(const Derived *derived, const IndexType *indices, 
+				SizeType primCount, SizeType *minBins, SizeType *maxBins) const {
 			const int64_t maxBin = m_binCount-1;
 
-			for (SizeType i=0; i<m_primCount; ++i) {
+			for (SizeType i=0; i<primCount; ++i) {
 				const BoundingBoxType bbox = derived->getBoundingBox(indices[i]);
 				for (int axis=0; axis<PointType::Dimension; ++axis) {
 					int64_t minIdx = (int64_t) ((bbox.min[axis] - m_bbox.min[axis]) 
 							* m_invBinSize[axis]);
 					int64_t maxIdx = (int64_t) ((bbox.max[axis] - m_bbox.min[axis]) 
 							* m_invBinSize[axis]);
-					m_maxBins[axis * m_binCount 
+					maxBins[axis * m_binCount 
 						+ std::max((int64_t) 0, std::min(maxIdx, maxBin))]++;
-					m_minBins[axis * m_binCount 
+					minBins[axis * m_binCount 
 						+ std::max((int64_t) 0, std::min(minIdx, maxBin))]++;
 				}
 			}
 		}
 
+		/// Reset all counters before binning \c primCount primitives
+		void clear(SizeType primCount) {
+			m_primCount = primCount;
+			memset(m_minBins, 0, sizeof(SizeType) * PointType::Dimension * m_binCount);
+			memset(m_maxBins, 0, sizeof(SizeType) * PointType::Dimension * m_binCount);
+		}
+
+		/// Add counters computed by \ref binRange()
+		void accumulate(const SizeType *minBins, const SizeType *maxBins) {
+			for (int i=0; i<m_binCount * PointType::Dimension; ++i) {
+				m_minBins[i] += minBins[i];
+				m_maxBins[i] += maxBins[i];
+			}
+		}
+
 		/**
 		 * \brief Evaluate the tree construction heuristic at each bin boundary
 		 * and return the minimizer for the given cost constants. Min-max
@@ -2401,6 +2930,8 @@ protected:
 	float m_queryCost;
 	float m_emptySpaceBonus;
 	bool m_clip, m_retract, m_parallelBuild;
+	bool m_probabilityLayout;
+	SizeType m_threadCount;
 	SizeType m_maxDepth;
 	SizeType m_stopPrims;
 	SizeType m_maxBadRefines;
@@ -2408,6 +2939,9 @@ protected:
 	SizeType m_minMaxBins;
 	SizeType m_nodeCount;
 	SizeType m_indexCount;
+	size_t m_memoryBudget;
+	volatile int64_t m_tempMemory, m_peakTempMemory;
+	volatile int64_t m_budgetFallbacks;
 	std::vector<TreeBuilder *> m_builders;
 	std::vector<KDNode *> m_indirections;
 	QMutex m_indirectionLock;
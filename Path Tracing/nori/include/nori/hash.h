@@ -0,0 +1,84 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__HASH_H)
+#define __HASH_H
+
+#include <nori/common.h>
+#include <cstring>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Incremental 64-bit hash function for binary data
+ *
+ * Used to derive keys for the on-disk caches from the contents of
+ * meshes and the parameters that influence a cached result. The data
+ * is processed in 8-byte words (an FNV-1a variant with a final
+ * avalanche step), which is fast enough to hash large vertex buffers
+ * on every start. This is not a cryptographic hash function.
+ */
+class Hasher {
+public:
+	/// Create a new hasher
+	inline Hasher() : m_hash(0xcbf29ce484222325ULL) { }
+
+	/// Hash a block of memory
+	inline void update(const void *data, size_t size) {
+		const uint8_t *ptr = static_cast<const uint8_t *>(data);
+		while (size >= 8) {
+			uint64_t word;
+			memcpy(&word, ptr, 8);
+			mix(word);
+			ptr += 8; size -= 8;
+		}
+		if (size > 0) {
+			uint64_t word = 0;
+			memcpy(&word, ptr, size);
+			mix(word ^ ((uint64_t) size << 56));
+		}
+	}
+
+	/// Hash a plain value (e.g. an integer or a float)
+	template <typename T> inline void update(const T &value) {
+		update(&value, sizeof(T));
+	}
+
+	/// Return the hash of all data seen so far
+	inline uint64_t get() const {
+		uint64_t h = m_hash;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+private:
+	inline void mix(uint64_t word) {
+		m_hash ^= word;
+		m_hash *= 0x100000001b3ULL;
+		m_hash ^= m_hash >> 29;
+	}
+private:
+	uint64_t m_hash;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __HASH_H */
@@ -0,0 +1,191 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__INSTANCE_H)
+#define __INSTANCE_H
+
+#include <nori/accel.h>
+#include <nori/transform.h>
+#include <map>
+
+/// Depth limit of the top-level hierarchy over all instances
+#define NORI_INSTANCE_MAXDEPTH 64
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Transformed copy of a shared mesh
+ *
+ * Meshes that are declared with an \c id attribute are not rendered by
+ * themselves. Instead, they can be placed into the scene any number of
+ * times by instances that reference them, e.g.
+ *
+ * <pre>
+ * &lt;mesh type="obj" id="tree"&gt;
+ *     &lt;string name="filename" value="tree.obj"/&gt;
+ * &lt;/mesh&gt;
+ *
+ * &lt;instance&gt;
+ *     &lt;ref id="tree"/&gt;
+ *     &lt;transform name="toWorld"&gt;
+ *         &lt;translate value="5, 0, 0"/&gt;
+ *     &lt;/transform&gt;
+ * &lt;/instance&gt;
+ * </pre>
+ *
+ * All instances of a mesh share its triangles, its BSDF and a single
+ * bottom-level accelerator (see \ref InstanceAccel). Shared meshes can
+ * not be luminaires.
+ */
+class Instance : public NoriObject {
+public:
+	/// Create a new instance (the mesh is specified by a child object)
+	Instance(const PropertyList &propList);
+
+	/// Register the shared mesh
+	void addChild(NoriObject *child);
+
+	/// Check that a mesh has been specified
+	void activate();
+
+	/// Return the shared mesh
+	inline const Mesh *getMesh() const { return m_mesh; }
+
+	/// Return the shared mesh
+	inline Mesh *getMesh() { return m_mesh; }
+
+	/// Return the transformation from object to world space
+	inline const Transform &getTransform() const { return m_toWorld; }
+
+	/// Return the transformation from world to object space
+	inline const Transform &getInverseTransform() const { return m_toLocal; }
+
+	/// Return a brief string summary of the instance (for debugging purposes)
+	QString toString() const;
+
+	EClassType getClassType() const { return EInstance; }
+protected:
+	Mesh *m_mesh;
+	Transform m_toWorld;
+	Transform m_toLocal;
+};
+
+/**
+ * \brief Two-level accelerator for scenes containing instances
+ *
+ * Every shared mesh receives its own bottom-level kd-tree, which is
+ * built once regardless of how many instances reference the mesh. A
+ * bounding volume hierarchy over the world-space bounds of all
+ * instances forms the top level. Rays that reach an instance are
+ * transformed into its object space (without normalizing the direction,
+ * so that distances along the ray remain valid) and traced against the
+ * bottom-level tree. The intersection record is then transformed back
+ * into world space.
+ *
+ * Meshes that are not instanced are handled by the accelerator that was
+ * specified in the scene description, which is queried first.
+ *
+ * This class is used by the \ref Scene and cannot be selected using
+ * an <tt>&lt;accel&gt;</tt> tag.
+ */
+class InstanceAccel : public Accel {
+public:
+	/**
+	 * \brief Create a new top-level accelerator
+	 *
+	 * \param world
+	 *    Accelerator containing all meshes that are not instanced. It
+	 *    must not have been built yet and is owned by the new instance.
+	 */
+	InstanceAccel(Accel *world);
+
+	/// Release all memory
+	virtual ~InstanceAccel();
+
+	/// Register an instance. This function can only be used before \ref build()
+	void addInstance(const Instance *instance);
+
+	/// Build the bottom-level accelerators and the top-level hierarchy
+	void build();
+
+	/**
+	 * \brief Update the accelerators containing the given meshes and
+	 * rebuild the top-level hierarchy (see \ref Accel::update())
+	 */
+	void update(const std::vector<const Mesh *> &changed);
+
+	/// Intersect a ray against the scene (see \ref Accel::rayIntersect())
+	bool rayIntersect(const Ray3f &ray, Intersection &its,
+		bool shadowRay = false) const;
+
+	//// Return an axis-aligned bounding box containing all geometry
+	inline const BoundingBox3f &getBoundingBox() const {
+		return m_bbox;
+	}
+
+	/// Return the number of instances
+	inline uint32_t getInstanceCount() const { return (uint32_t) m_entries.size(); }
+
+	/// Return a brief string summary of the instance (for debugging purposes)
+	QString toString() const;
+protected:
+	/**
+	 * \brief Check the world and all instances for occluders (see
+	 * \ref Accel::findOccluder())
+	 *
+	 * Keeps its own per-thread cache of the last occluder, see instance.cpp.
+	 */
+	bool findOccluder(const Ray3f &ray, float mint, float maxt, IndexType &entry) const;
+
+	/// An instance together with its bottom-level accelerator
+	struct InstanceEntry {
+		const Instance *instance;
+		const Accel *accel;
+		/// World-space bounds of the instance
+		BoundingBox3f bbox;
+	};
+
+	/// Node of the top-level hierarchy in depth-first order
+	struct InstanceNode {
+		BoundingBox3f bbox;
+		/// Index of the right child (inner) or first entry (leaf)
+		uint32_t offset;
+		/// Number of instances, zero for inner nodes
+		uint16_t count;
+		/// Split axis of inner nodes
+		uint16_t axis;
+
+		inline bool isLeaf() const { return count > 0; }
+	};
+
+	/// Compute the world-space bounds of all instances and build the top-level hierarchy
+	void buildTopLevel();
+
+	/// Recursively build the top-level hierarchy (median splits)
+	void buildRecursive(uint32_t start, uint32_t end, uint32_t depth);
+protected:
+	Accel *m_world;
+	std::map<const Mesh *, Accel *> m_blas;
+	std::vector<InstanceEntry> m_entries;
+	std::vector<InstanceNode> m_nodes;
+	BoundingBox3f m_bbox;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __INSTANCE_H */
@@ -53,6 +53,29 @@ public:
 	 */
 	virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+	/**
+	 * \brief Sample the incident radiance along a camera ray whose
+	 * closest intersection has already been determined
+	 *
+	 * The renderer only calls this function for integrators that return
+	 * \c true from \ref usesPrimaryHits(); it then traces camera rays
+	 * in packets and passes the results here. Such integrators should
+	 * override it, since the default implementation discards the
+	 * precomputed intersection and simply calls \ref Li().
+	 *
+	 * \param hit
+	 *    Specifies whether the ray intersected the scene
+	 * \param its
+	 *    The intersection record (only valid when \c hit is \c true)
+	 */
+	virtual Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+			bool /* hit */, const Intersection & /* its */) const {
+		return Li(scene, sampler, ray);
+	}
+
+	/// Should camera rays be traced in packets before invoking the integrator?
+	virtual bool usesPrimaryHits() const { return false; }
+
 	/**
 	 * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
 	 * provided by this instance
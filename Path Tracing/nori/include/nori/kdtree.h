@@ -22,10 +22,49 @@
 #define __KDTREE_H
 
 #include <nori/gkdtree.h>
-#include <nori/mesh.h>
+#include <nori/accel.h>
+#include <nori/atomic.h>
+#include <QFile>
+
+/* Set to 0 to disable software prefetching of far children during
+   traversal, e.g. using "DEFINES += NORI_KD_PREFETCH=0" */
+#if !defined(NORI_KD_PREFETCH)
+#define NORI_KD_PREFETCH 1
+#endif
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Header of a kd-tree cache file
+ *
+ * The header is followed by the node array (preceded by one unused
+ * node, see \ref GenericKDTree), the index list, the leaf-ordered
+ * triangle buffer, the SIMD triangle packets and the packet offsets.
+ * Each section starts at a 64 byte aligned file offset, so that the
+ * arrays can be used directly from a read-only memory mapping.
+ */
+struct KDCacheHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t key;
+	uint64_t fileSize;
+	uint64_t nodeCount, indexCount;
+	uint64_t packetCount, packetOffsetCount;
+	float bbox[2][3], tightBBox[2][3];
+	uint64_t nodeOffset, indexOffset, triangleOffset;
+	uint64_t packetOffset, packetOffsetsOffset;
+
+	/**
+	 * \brief Compute the section offsets and the file size from the
+	 * element counts
+	 *
+	 * The layout is computed in 64-bit arithmetic regardless of
+	 * \c NORI_INDEX_WIDTH. The leaf-ordered triangle buffer has one
+	 * entry per index.
+	 */
+	void computeLayout();
+};
+
 /**
  * \brief Specializes \ref GenericKDTree to a three-dimensional
  * tree that can be used to intersect rays against triangles meshes.
@@ -37,65 +76,97 @@ NORI_NAMESPACE_BEGIN
  * ray traversal algorithm (TA^B_{rec}), which is explained in Vlastimil 
  * Havran's PhD thesis "Heuristic Ray Shooting Algorithms". 
  *
+ * This is the default accelerator (<tt>&lt;accel type="kdtree"/&gt;</tt>).
+ * The construction parameters of \ref GenericKDTree can be specified
+ * as properties of the same name (e.g. <tt>traversalCost</tt>).
+ *
+ * When the <tt>cache</tt> property is set, the finished tree is written
+ * to a binary file in <tt>cacheDir</tt> (<tt>~/.nori/cache</tt> by
+ * default). The file name is derived from the triangle data and the
+ * construction parameters, and later runs (or concurrent render
+ * processes) map the file into memory instead of building the tree
+ * again. Cache files are validated before use, and the tree is rebuilt
+ * when a file is corrupt.
+ *
+ * The tree is built by one thread per core unless <tt>buildThreads</tt>
+ * specifies otherwise. Setting <tt>buildScaling</tt> first builds the
+ * tree with 1, 2, 4, .. threads and prints the construction time and
+ * parallel efficiency of each run.
+ *
+ * <tt>memoryBudget</tt> limits the temporary memory of the builder
+ * (in MiB, unlimited by default), see \ref setMemoryBudget(). The
+ * peak usage and the peak resident set size of the process are
+ * printed after the build, which helps to decide how many render
+ * jobs fit on one machine.
+ *
+ * The nodes are stored so that the more probable child's subtree follows
+ * right after its parent (see \ref setProbabilityLayout(), property
+ * <tt>probabilityLayout</tt>). When a far child is pushed onto the
+ * traversal stack, its children or triangles are prefetched, hence they
+ * are usually in the cache by the time that the child is popped.
+ *
+ * When <tt>autotune</tt> is set, the cost parameters (traversalCost,
+ * queryCost, emptySpaceBonus and stopPrims) are taken from a profile of
+ * the current machine in <tt>profileDir</tt> (<tt>~/.nori</tt> by
+ * default) and override the corresponding properties. If there is no
+ * profile yet, the cost of a traversal step and of a triangle test are
+ * measured first, and the parameters are then searched by building
+ * trees for a sample of the scene and timing random rays. The result is
+ * saved, so that tuning happens only once per machine. Delete the
+ * profile to tune again, e.g. after changing the SIMD kernels.
+ *
+ * Setting <tt>statsFile</tt> enables a statistics report in JSON format,
+ * which is written to the given file when the tree is destroyed (i.e.
+ * after rendering). Besides the structure of the tree (see
+ * \ref writeStatistics()), it contains the average number of nodes
+ * visited and triangles tested per ray during the render, which allows
+ * to track the quality of the tree across versions of a scene. Counting
+ * is only done when the property is set.
+ *
  * \author Wenzel Jakob
  */
-class KDTree : public GenericKDTree<BoundingBox3f, SurfaceAreaHeuristic3, KDTree> {
+class KDTree : public Accel, public GenericKDTree<BoundingBox3f, SurfaceAreaHeuristic3, KDTree, IndexType> {
 protected:
-	typedef GenericKDTree<BoundingBox3f, SurfaceAreaHeuristic3, KDTree>  Parent;
-	typedef Parent::SizeType                                             SizeType;
-	typedef Parent::IndexType                                            IndexType;
-	typedef Parent::KDNode                                               KDNode;
+	typedef GenericKDTree<BoundingBox3f, SurfaceAreaHeuristic3, KDTree, IndexType> Parent;
+	typedef Parent::SizeType                                                       SizeType;
+	typedef Parent::KDNode                                                         KDNode;
 
 	using Parent::m_nodes;
 	using Parent::m_bbox;
 	using Parent::m_indices;
+	using Parent::m_indexCount;
+	using Parent::m_nodeCount;
 
 public:
 	/// Create a new and empty kd-tree
-	KDTree();
+	KDTree(const PropertyList &propList);
 
 	/// Release all memory
 	virtual ~KDTree();
 
-	/**
-	 * \brief Register a triangle mesh for inclusion in the kd-tree.
-	 *
-	 * This function can only be used before \ref build() is called
-	 */
-	void addMesh(Mesh *mesh);
-
 	/// Build the kd-tree
 	void build();
 
+	/// Intersect a ray against the kd-tree (see \ref Accel::rayIntersect())
+	bool rayIntersect(const Ray3f &ray, Intersection &its, 
+		bool shadowRay = false) const;
+
 	/**
-	 * \brief Intersect a ray against all triangle meshes registered
-	 * with the kd-tree
-	 *
-	 * Detailed information about the intersection, if any, will be
-	 * stored in the provided \ref Intersection data record. 
+	 * \brief Intersect a packet of coherent rays against the kd-tree
 	 *
-	 * The <tt>shadowRay</tt> parameter specifies whether this detailed
-	 * information is really needed. When set to \c true, the 
-	 * function just checks whether or not there is occlusion, but without
-	 * providing any more detail (i.e. \c its will not be filled with
-	 * contents). This is usually much faster.
+	 * Implements the packet traversal from Ingo Wald's PhD thesis
+	 * "Realtime Ray Tracing and Interactive Global Illumination": all
+	 * rays of the packet descend the tree together, while each of them
+	 * keeps track of its own parametric interval. Before looking at the
+	 * individual rays, the distance to the split plane is bounded for
+	 * the whole packet using interval arithmetic; when the bound lies
+	 * entirely in front of or behind all ray segments, the far or near
+	 * child is culled without further work.
 	 *
-	 * \return \c true If an intersection was found
+	 * Packets whose rays do not share the same direction signs are
+	 * traced one ray at a time.
 	 */
-	bool rayIntersect(const Ray3f &ray, Intersection &its, 
-		bool shadowRay = false) const;
-
-	/// Return the total number of internally represented triangles 
-	inline SizeType getPrimitiveCount() const { return m_primitiveCount; }
-
-	/// Return the total number of meshes registered with the kd-tree
-	inline SizeType getMeshCount() const { return (SizeType) m_meshes.size(); }
-
-	/// Return one of the registered meshes
-	inline Mesh *getMesh(IndexType idx) { return m_meshes[idx]; }
-	
-	/// Return one of the registered meshes (const version)
-	inline const Mesh *getMesh(IndexType idx) const { return m_meshes[idx]; }
+	void rayIntersectPacket(RayPacketN &packet) const;
 
 	//// Return an axis-aligned bounding box containing the entire tree
 	inline const BoundingBox3f &getBoundingBox() const {
@@ -118,21 +189,121 @@ public:
 		IndexType meshIdx = findMesh(index);
 		return m_meshes[meshIdx]->getClippedBoundingBox(index, clip);
 	}
+
+	/// Return a brief string summary of the instance (for debugging purposes)
+	QString toString() const;
 protected:
 	/**
-	 * \brief Compute the mesh and triangle indices corresponding to 
-	 * a primitive index used by the underlying generic kd-tree implementation. 
+	 * \brief Any-hit traversal for shadow rays (see \ref Accel::findOccluder())
+	 *
+	 * Unlike \ref rayIntersect(), this only keeps track of the
+	 * parametric interval of the ray within each node and stops at
+	 * the first intersection.
+	 */
+	bool findOccluder(const Ray3f &ray, float mint, float maxt, IndexType &entry) const;
+
+	/// Prefetch the data that is accessed first when a node is visited later on
+	inline void prefetch(const KDNode *node) const {
+	#if NORI_KD_PREFETCH == 1
+		if (node->isLeaf())
+			NORI_PREFETCH(m_triangles + node->getPrimStart());
+		else
+			NORI_PREFETCH(node->getLeft());
+	#endif
+	}
+
+	/**
+	 * \brief Release the tree so that it can be built again
+	 *
+	 * The split planes of a kd-tree cannot be adapted to moving
+	 * geometry, hence \ref update() always rebuilds the tree.
 	 */
-	IndexType findMesh(IndexType &idx) const {
-		std::vector<IndexType>::const_iterator it = std::lower_bound(
-				m_sizeMap.begin(), m_sizeMap.end(), idx+1) - 1;
-		idx -= *it;
-		return (IndexType) (it - m_sizeMap.begin());
+	void clear();
+
+	/// Compute the key of the tree in the cache from the geometry and build parameters
+	uint64_t getCacheKey() const;
+
+	/**
+	 * \brief Map a previously cached tree into memory
+	 *
+	 * \return \c false if the file does not exist or is not a valid
+	 *     cache file for the current geometry and parameters
+	 */
+	bool loadCache(const QString &filename, uint64_t key);
+
+	/**
+	 * \brief Check that all node, index and packet references of a
+	 * tree loaded from a cache file are in range
+	 *
+	 * The traversal uses these references without further checks.
+	 */
+	bool validateCache() const;
+
+	/// Write the tree and its triangle buffers to a cache file
+	void saveCache(const QString &filename, uint64_t key) const;
+
+	/// Build the tree with an increasing number of threads and print the timings
+	void reportBuildScaling();
+
+	/**
+	 * \brief Set the cost parameters from the profile of the current machine
+	 *
+	 * Runs \ref tuneParameters() and saves the result first if there is
+	 * no profile yet.
+	 */
+	void autotune();
+
+	/**
+	 * \brief Search the cost parameters on a sample of the scene
+	 *
+	 * \param stepTime
+	 *     Receives the measured time of a traversal step in nanoseconds
+	 * \param testTime
+	 *     Receives the measured time of a triangle test in nanoseconds
+	 */
+	void tuneParameters(double &stepTime, double &testTime);
+
+	/// Build a tree with the given cost parameters and return the time to trace \c rays
+	qint64 measureParameters(const std::vector<Mesh *> &meshes, const std::vector<Ray3f> &rays,
+		float traversalCost, float emptySpaceBonus, SizeType stopPrims) const;
+
+	/// Measure the time of a traversal step and of a triangle test in nanoseconds
+	void measureKernels(const std::vector<Ray3f> &rays, double &stepTime, double &testTime) const;
+
+	/// Accumulate the traversal statistics of one or more rays
+	inline void recordTraversal(uint32_t rays, uint32_t steps, uint32_t tests) const {
+		atomicAdd(&m_statRays, rays);
+		atomicAdd(&m_statSteps, steps);
+		atomicAdd(&m_statTests, tests);
 	}
-private:
-	std::vector<Mesh *> m_meshes;
-	std::vector<SizeType> m_sizeMap;
-	SizeType m_primitiveCount;
+
+	/**
+	 * \brief Write a statistics report in JSON format
+	 *
+	 * The report contains the construction parameters, the SAH cost of
+	 * the final tree, the number of inner nodes, (empty) leaves, a
+	 * histogram of the leaf depths, the duplication factor (references
+	 * per triangle), the memory usage of the different arrays, and the
+	 * traversal statistics that were recorded so far.
+	 */
+	void writeStatistics(const QString &filename) const;
+protected:
+	bool m_cache;
+	bool m_buildScaling;
+	bool m_autotune;
+	QString m_cacheDir;
+	QString m_profileDir;
+	QString m_statsFile;
+	bool m_statistics;
+	/// Traversal statistics (only recorded when \c m_statistics is set)
+	mutable volatile int64_t m_statRays, m_statSteps, m_statTests;
+	/// The memory-mapped cache file (if the tree was loaded from one)
+	QFile *m_cacheFile;
+#if NORI_MAILBOX_STATS == 1
+protected:
+	/// Mailboxing statistics (printed when the tree is destroyed)
+	mutable volatile int64_t m_mailboxReferences, m_mailboxSkipped;
+#endif
 };
 
 NORI_NAMESPACE_END
@@ -0,0 +1,130 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__LAZYBVH_H)
+#define __LAZYBVH_H
+
+#include <nori/bvh.h>
+#include <QAtomicPointer>
+#include <QAtomicInt>
+#include <QMutex>
+
+/// Number of locks shared by the subtrees that are built on demand
+#define NORI_LAZYBVH_LOCKS 64
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Bounding volume hierarchy that builds its subtrees on demand
+ *
+ * Only the top levels of the hierarchy are constructed by \ref build().
+ * Nodes containing at most <tt>lazyThreshold</tt> triangles (4096 by
+ * default) are left unexpanded, and their subtrees are built the first
+ * time that a ray reaches them. In views of large scenes with heavy
+ * occlusion, much of the geometry is never visited, and rendering
+ * starts almost immediately.
+ *
+ * Expanded subtrees are published using an atomic pointer, hence rays
+ * traversing them do not take any locks. A thread that finds a subtree
+ * unexpanded acquires one of \c NORI_LAZYBVH_LOCKS locks, which ensures
+ * that each subtree is only built once while other threads wait for it.
+ *
+ * Apart from that, the hierarchy is built like a \ref BVH and supports
+ * the same properties, except for the compressed representation. Since
+ * the leaves of a subtree are not known in advance, the triangles are
+ * always tested one at a time. Can be selected using
+ * <tt>&lt;accel type="lazybvh"/&gt;</tt>.
+ */
+class LazyBVH : public BVH {
+public:
+	/// Create a new and empty hierarchy
+	LazyBVH(const PropertyList &propList);
+
+	/// Release all memory
+	virtual ~LazyBVH();
+
+	/// Build the top levels of the hierarchy
+	void build();
+
+	/// Rebuild the hierarchy after meshes have moved (see \ref Accel::update())
+	void update(const std::vector<const Mesh *> &changed);
+
+	/// Intersect a ray against the BVH (see \ref Accel::rayIntersect())
+	bool rayIntersect(const Ray3f &ray, Intersection &its,
+		bool shadowRay = false) const;
+
+	/// Return the number of subtrees that have been built so far
+	inline uint32_t getExpandedCount() const { return (uint32_t) (int) m_expandedCount; }
+
+	/// Return a brief string summary of the instance (for debugging purposes)
+	QString toString() const;
+protected:
+	/// Any-hit traversal for shadow rays (see \ref Accel::findOccluder())
+	bool findOccluder(const Ray3f &ray, float mint, float maxt, IndexType &entry) const;
+
+	/// Release the hierarchy including all expanded subtrees
+	void clear();
+
+	/// Leave nodes with few enough triangles unexpanded
+	bool deferSubtree(uint32_t nodeIdx, BuildPrimitive *prims,
+		uint32_t start, uint32_t end, uint32_t depth);
+
+	/// Return the root of a subtree, building it first if necessary
+	const BVHNode *expand(uint32_t index) const;
+
+	enum {
+		/// Marks nodes whose subtree has not been built yet
+		EUnexpanded = 1
+	};
+
+	/// A subtree whose construction was deferred
+	struct LazySubtree {
+		/// Range of the triangle buffer that is referenced by the subtree
+		uint32_t offset, count;
+		/// Depth of the subtree's root
+		uint32_t depth;
+		/// Nodes of the subtree, or \c NULL if it has not been built yet
+		mutable QAtomicPointer<BVHNode> nodes;
+	};
+
+	/// Binned SAH builder used to construct a single subtree
+	class SubtreeBuilder : public BVH {
+	public:
+		inline SubtreeBuilder(const PropertyList &propList) : BVH(propList) { }
+
+		/// Build the hierarchy starting at the given depth
+		inline void buildSubtree(BuildPrimitive *prims, uint32_t primCount, uint32_t depth) {
+			m_nodes.reserve(2 * primCount);
+			m_indices.reserve(primCount);
+			buildRecursive(prims, 0, primCount, depth);
+		}
+
+		inline const std::vector<BVHNode> &getNodes() const { return m_nodes; }
+		inline const std::vector<IndexType> &getIndices() const { return m_indices; }
+	};
+protected:
+	PropertyList m_propList;
+	uint32_t m_lazyThreshold;
+	std::vector<LazySubtree> m_subtrees;
+	mutable QMutex m_locks[NORI_LAZYBVH_LOCKS];
+	mutable QAtomicInt m_expandedCount;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __LAZYBVH_H */
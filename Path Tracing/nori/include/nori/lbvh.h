@@ -0,0 +1,114 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__LBVH_H)
+#define __LBVH_H
+
+#include <nori/bvh.h>
+
+/// Maximum number of leaves of a treelet that is reorganized by \ref LBVH
+#define NORI_LBVH_TREELET_SIZE 7
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Bounding volume hierarchy built from Morton codes
+ *
+ * Linear BVH construction ("Fast BVH Construction on GPUs" by Lauterbach
+ * et al.) trades tree quality for build speed, which is useful for
+ * preview renders and scenes that are rebuilt frequently. The centroids
+ * of all triangles are quantized to 10 bits per axis and interleaved
+ * into 30-bit Morton codes, which are sorted using a parallel radix
+ * sort. Sorting arranges the triangles along a space-filling curve, so
+ * that every range of triangles sharing a code prefix forms a node of
+ * the hierarchy. A node is split where the first bit after the common
+ * prefix changes, which is found by a binary search.
+ *
+ * Ranges of at most <tt>leafSize</tt> triangles (4 by default) become
+ * leaves. When <tt>treeletOptimization</tt> is set, the hierarchy is
+ * improved afterwards by reorganizing small treelets of up to seven
+ * subtrees to minimize their SAH cost ("Fast Parallel Construction of
+ * High-Quality Bounding Volume Hierarchies" by Karras and Aila), which
+ * recovers much of the quality lost by splitting at Morton code bits.
+ * The radix sort uses one thread per core unless <tt>buildThreads</tt>
+ * specifies otherwise.
+ *
+ * The finished hierarchy is traversed exactly like a \ref BVH and
+ * supports the same properties. Can be selected using
+ * <tt>&lt;accel type="lbvh"/&gt;</tt>.
+ */
+class LBVH : public BVH {
+public:
+	/// Create a new and empty LBVH
+	LBVH(const PropertyList &propList);
+
+	/// Return a brief string summary of the instance (for debugging purposes)
+	QString toString() const;
+protected:
+	/// Build the hierarchy from the sorted Morton codes
+	void buildHierarchy(BuildPrimitive *prims, uint32_t primCount);
+
+	/// Morton code of a triangle centroid
+	struct MortonPrimitive {
+		uint32_t code;
+		uint32_t index;
+	};
+
+	/// Node of the intermediate (pointer-based) hierarchy
+	struct TempNode {
+		BoundingBox3f bbox;
+		/// Children (inner nodes) or the first sorted primitive (leaves)
+		uint32_t left, right;
+		/// Number of primitives in the subtree
+		uint32_t primCount;
+		/// SAH cost of the subtree
+		float cost;
+		uint8_t axis;
+		bool leaf;
+	};
+
+	/// Sort the primitives by their Morton codes (least significant digit first)
+	void radixSort(std::vector<MortonPrimitive> &prims) const;
+
+	/// Recursively create the nodes for a range of sorted primitives
+	uint32_t emitRecursive(const MortonPrimitive *codes, const BuildPrimitive *prims,
+		uint32_t start, uint32_t end, uint32_t depth);
+
+	/// Reorganize all treelets in a subtree (bottom-up)
+	void optimizeRecursive(uint32_t nodeIdx);
+
+	/// Find the optimal topology of the treelet rooted at a node
+	bool optimizeTreelet(uint32_t nodeIdx);
+
+	/// Convert the intermediate hierarchy into \ref m_nodes
+	void flattenRecursive(uint32_t tempIdx, BuildPrimitive *prims, uint32_t depth);
+
+	/// Collect the primitives of a subtree of the intermediate hierarchy
+	void collectRecursive(uint32_t tempIdx, const BuildPrimitive *prims,
+		std::vector<BuildPrimitive> &result) const;
+protected:
+	int m_leafSize;
+	int m_threadCount;
+	bool m_treeletOptimization;
+	std::vector<TempNode> m_tempNodes;
+	uint32_t m_treeletCount;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __LBVH_H */
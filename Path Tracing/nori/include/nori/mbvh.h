@@ -0,0 +1,366 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__MBVH_H)
+#define __MBVH_H
+
+#include <nori/bvh.h>
+#include <nori/simd.h>
+#include <QElapsedTimer>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Multi bounding volume hierarchy with \c Width children per node
+ *
+ * The binary binned SAH hierarchy of \ref BVH is built first and then
+ * collapsed into a tree, where each node stores the bounding boxes of
+ * up to \c Width children in structure-of-arrays form. A ray is tested
+ * against all children of a node with a single SIMD slab test (see
+ * "Shallow Bounding Volume Hierarchies for Fast SIMD Ray Tracing of
+ * Incoherent Rays" by Dammertz et al.). This does not require any
+ * coherence between rays, which makes it well suited for the secondary
+ * rays of a path tracer.
+ *
+ * The width is a compile-time parameter: <tt>&lt;accel type="qbvh"/&gt;</tt>
+ * selects 4-wide (SSE) nodes and <tt>&lt;accel type="obvh"/&gt;</tt> 8-wide
+ * nodes, which use AVX when the compiler targets it.
+ */
+template <int Width> class MBVH : public BVH {
+public:
+	/// Create a new and empty hierarchy
+	MBVH(const PropertyList &propList) : BVH(propList), m_wideNodes(NULL), m_wideNodeCount(0) {
+		if (m_compressed)
+			throw NoriException("MBVH: the compressed representation is only "
+				"supported by the binary BVH!");
+	}
+
+	/// Release all memory
+	virtual ~MBVH() {
+		if (m_wideNodes)
+			freeAligned(m_wideNodes);
+	}
+
+	/// Build the binary hierarchy and collapse it
+	void build() {
+		BVH::build();
+		if (m_nodes.empty())
+			return;
+
+		QElapsedTimer timer;
+		timer.start();
+
+		/* There is at most one wide node per inner binary node */
+		size_t innerCount = std::max((size_t) 1, m_nodes.size() - m_leafCount);
+		m_wideNodes = static_cast<WideNode *>(allocAligned(sizeof(WideNode) * innerCount));
+		m_wideNodeCount = 0;
+
+		if (m_nodes[0].isLeaf()) {
+			WideNode &root = m_wideNodes[m_wideNodeCount++];
+			root.clear();
+			root.setChild(0, m_nodes[0]);
+			root.child[0] = ELeafFlag | m_nodes[0].offset;
+			root.primCount[0] = m_nodes[0].primCount;
+		} else {
+			collapse(0);
+		}
+
+		/* The binary nodes are no longer needed */
+		std::vector<BVHNode>().swap(m_nodes);
+
+		size_t memory = m_wideNodeCount * sizeof(WideNode)
+			+ m_indices.size() * sizeof(IndexType) + getTriangleBufferSize();
+		cout << "Collapsed into " << m_wideNodeCount << " " << Width << "-wide nodes after "
+			<< timer.elapsed() << " ms (" << memory / 1024 << " KiB, "
+			<< qPrintable(QString::number(memory / (double) getPrimitiveCount(), 'f', 1))
+			<< " bytes per triangle)" << endl;
+	}
+
+	/// Intersect a ray against the hierarchy (see \ref Accel::rayIntersect())
+	bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay = false) const {
+		typedef SIMDFloat<Width> Packet;
+		its.t = std::numeric_limits<float>::infinity();
+
+		if (m_wideNodeCount == 0)
+			return false;
+
+		/* Use an adaptive ray epsilon */
+		float mint = ray.mint, maxt = ray.maxt;
+		if (mint == Epsilon)
+			mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
+
+		if (maxt < mint)
+			return false;
+
+		/* Per-ray constants of the slab test. The near plane of each
+		   axis is determined by the sign of the direction component */
+		const Packet origin[3] = { Packet(ray.o.x()), Packet(ray.o.y()), Packet(ray.o.z()) };
+		const Packet dRcp[3] = { Packet(ray.dRcp.x()), Packet(ray.dRcp.y()), Packet(ray.dRcp.z()) };
+		const int nearIdx[3] = { ray.dRcp.x() < 0 ? 1 : 0, ray.dRcp.y() < 0 ? 1 : 0, ray.dRcp.z() < 0 ? 1 : 0 };
+		const Packet farScale(1 + 4 * std::numeric_limits<float>::epsilon());
+		const Packet minT(mint);
+
+		struct StackEntry {
+			uint32_t child;
+			uint32_t primCount;
+			float t;
+		} stack[NORI_BVH_MAXDEPTH * Width];
+		uint32_t stackPos = 0;
+
+		Packet tNearPacket;
+		const float *tNear = reinterpret_cast<const float *>(&tNearPacket);
+		bool foundIntersection = false;
+		IndexType foundPrimIndex = 0;
+		uint32_t current = 0, currentPrimCount = 0;
+
+		while (true) {
+			if (!(current & ELeafFlag)) {
+				const WideNode &node = m_wideNodes[current];
+
+				/* Intersect all children at once. NaNs (0*inf) in the
+				   per-axis distances leave the interval unchanged, since
+				   min/max return their second operand in this case */
+				Packet t0 = minT, t1 = Packet(maxt);
+				for (int axis=0; axis<3; ++axis) {
+					Packet n = (Packet::load(node.bounds[nearIdx[axis]][axis]) - origin[axis]) * dRcp[axis];
+					Packet f = (Packet::load(node.bounds[1-nearIdx[axis]][axis]) - origin[axis]) * dRcp[axis];
+					t0 = Packet::max(n, t0);
+					t1 = Packet::min(f * farScale, t1);
+				}
+				int mask = (t0 <= t1).movemask();
+
+				if (mask != 0) {
+					tNearPacket = t0;
+
+					/* Push the hit children so that the closest one is visited first */
+					uint32_t first = stackPos;
+					for (int i=0; i<Width; ++i) {
+						if (!(mask & (1 << i)))
+							continue;
+						StackEntry entry;
+						entry.child = node.child[i];
+						entry.primCount = node.primCount[i];
+						entry.t = tNear[i];
+						/* Insertion sort by decreasing distance */
+						uint32_t j = stackPos++;
+						while (j > first && stack[j-1].t < entry.t) {
+							stack[j] = stack[j-1];
+							--j;
+						}
+						stack[j] = entry;
+					}
+					--stackPos;
+					current = stack[stackPos].child;
+					currentPrimCount = stack[stackPos].primCount;
+					continue;
+				}
+			} else {
+				uint32_t offset = current & ~ELeafFlag;
+				if (intersectLeaf(offset, offset + currentPrimCount,
+						ray, mint, maxt, shadowRay, its, foundPrimIndex)) {
+					if (shadowRay)
+						return true;
+					foundIntersection = true;
+				}
+			}
+
+			/* Pop the next child, skipping entries that lie beyond
+			   the closest intersection found so far */
+			while (stackPos > 0 && stack[stackPos-1].t > maxt)
+				--stackPos;
+			if (stackPos == 0)
+				break;
+			--stackPos;
+			current = stack[stackPos].child;
+			currentPrimCount = stack[stackPos].primCount;
+		}
+
+		if (foundIntersection && !shadowRay)
+			fillIntersection(foundPrimIndex, its);
+
+		return foundIntersection;
+	}
+
+	/// Return a brief string summary of the instance (for debugging purposes)
+	QString toString() const {
+		return QString("MBVH[width=%1, traversalCost=%2, queryCost=%3, binCount=%4, maxLeafSize=%5]")
+			.arg(Width)
+			.arg(m_traversalCost)
+			.arg(m_queryCost)
+			.arg(m_binCount)
+			.arg(m_maxLeafSize);
+	}
+protected:
+	/// Release the wide nodes so that the hierarchy can be built again
+	void clear() {
+		if (m_wideNodes)
+			freeAligned(m_wideNodes);
+		m_wideNodes = NULL;
+		m_wideNodeCount = 0;
+		BVH::clear();
+	}
+
+	/// Any-hit traversal for shadow rays (see \ref Accel::findOccluder())
+	bool findOccluder(const Ray3f &ray, float mint, float maxt, IndexType &entry) const {
+		typedef SIMDFloat<Width> Packet;
+
+		if (m_wideNodeCount == 0)
+			return false;
+
+		const Packet origin[3] = { Packet(ray.o.x()), Packet(ray.o.y()), Packet(ray.o.z()) };
+		const Packet dRcp[3] = { Packet(ray.dRcp.x()), Packet(ray.dRcp.y()), Packet(ray.dRcp.z()) };
+		const int nearIdx[3] = { ray.dRcp.x() < 0 ? 1 : 0, ray.dRcp.y() < 0 ? 1 : 0, ray.dRcp.z() < 0 ? 1 : 0 };
+		const Packet farScale(1 + 4 * std::numeric_limits<float>::epsilon());
+		const Packet minT(mint), maxT(maxt);
+
+		/* Any hit will do -- the hit children are pushed without sorting */
+		uint32_t stack[NORI_BVH_MAXDEPTH * Width][2];
+		uint32_t stackPos = 0;
+		uint32_t current = 0, currentPrimCount = 0;
+
+		while (true) {
+			if (!(current & ELeafFlag)) {
+				const WideNode &node = m_wideNodes[current];
+
+				Packet t0 = minT, t1 = maxT;
+				for (int axis=0; axis<3; ++axis) {
+					Packet n = (Packet::load(node.bounds[nearIdx[axis]][axis]) - origin[axis]) * dRcp[axis];
+					Packet f = (Packet::load(node.bounds[1-nearIdx[axis]][axis]) - origin[axis]) * dRcp[axis];
+					t0 = Packet::max(n, t0);
+					t1 = Packet::min(f * farScale, t1);
+				}
+				int mask = (t0 <= t1).movemask();
+
+				for (int i=0; i<Width; ++i) {
+					if (mask & (1 << i)) {
+						stack[stackPos][0] = node.child[i];
+						stack[stackPos][1] = node.primCount[i];
+						++stackPos;
+					}
+				}
+			} else {
+				uint32_t offset = current & ~ELeafFlag;
+				if (occludedLeaf(offset, offset + currentPrimCount, ray, mint, maxt, entry))
+					return true;
+			}
+
+			if (stackPos == 0)
+				break;
+			--stackPos;
+			current = stack[stackPos][0];
+			currentPrimCount = stack[stackPos][1];
+		}
+
+		return false;
+	}
+
+	/**
+	 * Child references are 32 bit integers. Leaves are marked using the
+	 * highest bit and store their offset into the index list.
+	 */
+	static const uint32_t ELeafFlag = 0x80000000u;
+
+	/// Node with \c Width children in structure-of-arrays layout
+	struct WideNode {
+		/// Child bounds indexed by [min/max][axis][child]
+		float bounds[2][3][Width];
+		/// Child node indices (inner) or index list offsets (leaves)
+		uint32_t child[Width];
+		/// Number of primitives of leaf children
+		uint32_t primCount[Width];
+
+		/// Initialize all slots with empty boxes, which can never be hit
+		inline void clear() {
+			for (int i=0; i<Width; ++i) {
+				for (int axis=0; axis<3; ++axis) {
+					bounds[0][axis][i] = std::numeric_limits<float>::infinity();
+					bounds[1][axis][i] = -std::numeric_limits<float>::infinity();
+				}
+				child[i] = ELeafFlag;
+				primCount[i] = 0;
+			}
+		}
+
+		/// Copy the bounds of a binary node into the given slot
+		inline void setChild(int i, const BVHNode &node) {
+			for (int axis=0; axis<3; ++axis) {
+				bounds[0][axis][i] = node.bbox.min[axis];
+				bounds[1][axis][i] = node.bbox.max[axis];
+			}
+		}
+	};
+
+	/**
+	 * \brief Recursively create a wide node from the given inner binary node
+	 *
+	 * The largest inner node among the current children (by surface area)
+	 * is repeatedly replaced by its two children until \c Width children
+	 * have been collected.
+	 */
+	uint32_t collapse(uint32_t binIdx) {
+		uint32_t children[Width], childCount = 2;
+		children[0] = binIdx + 1;
+		children[1] = m_nodes[binIdx].offset;
+
+		while (childCount < Width) {
+			int best = -1;
+			float bestArea = -1;
+			for (uint32_t i=0; i<childCount; ++i) {
+				const BVHNode &node = m_nodes[children[i]];
+				if (node.isLeaf())
+					continue;
+				float area = node.bbox.getSurfaceArea();
+				if (area > bestArea) {
+					bestArea = area;
+					best = (int) i;
+				}
+			}
+			if (best < 0)
+				break;
+			uint32_t opened = children[best];
+			children[best] = opened + 1;
+			children[childCount++] = m_nodes[opened].offset;
+		}
+
+		uint32_t nodeIdx = m_wideNodeCount++;
+		m_wideNodes[nodeIdx].clear();
+		for (uint32_t i=0; i<childCount; ++i) {
+			const BVHNode &node = m_nodes[children[i]];
+			m_wideNodes[nodeIdx].setChild(i, node);
+			if (node.isLeaf()) {
+				if (node.offset & ELeafFlag)
+					throw NoriException("MBVH::build(): leaf cannot be represented "
+						"-- too many primitives?");
+				m_wideNodes[nodeIdx].child[i] = ELeafFlag | node.offset;
+				m_wideNodes[nodeIdx].primCount[i] = node.primCount;
+			} else {
+				uint32_t childIdx = collapse(children[i]);
+				m_wideNodes[nodeIdx].child[i] = childIdx;
+				m_wideNodes[nodeIdx].primCount[i] = 0;
+			}
+		}
+		return nodeIdx;
+	}
+protected:
+	WideNode *m_wideNodes;
+	size_t m_wideNodeCount;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __MBVH_H */
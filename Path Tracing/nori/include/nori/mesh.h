@@ -22,9 +22,48 @@
 #include <nori/object.h>
 #include <nori/dpdf.h>
 #include <nori/frame.h>
+#include <half.h>
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Encode a unit vector using an octahedral mapping
+ *
+ * The direction is projected onto the octahedron |x|+|y|+|z|=1, whose
+ * lower half is folded over the upper one. The two remaining coordinates
+ * are stored as 16-bit signed normalized integers, which keeps the
+ * angular error well below 0.01 degrees.
+ */
+inline uint32_t encodeOctahedral(const Normal3f &n) {
+	float norm = std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z());
+	if (norm == 0)
+		return 0; /* Degenerate -- decodes to +Z */
+
+	float x = n.x() / norm, y = n.y() / norm;
+	if (n.z() < 0) {
+		float fx = (1.0f - std::abs(y)) * (x >= 0 ? 1.0f : -1.0f),
+		      fy = (1.0f - std::abs(x)) * (y >= 0 ? 1.0f : -1.0f);
+		x = fx; y = fy;
+	}
+
+	int16_t qx = (int16_t) std::floor(clamp(x, -1.0f, 1.0f) * 32767.0f + 0.5f),
+	        qy = (int16_t) std::floor(clamp(y, -1.0f, 1.0f) * 32767.0f + 0.5f);
+	return (uint32_t) (uint16_t) qx | ((uint32_t) (uint16_t) qy << 16);
+}
+
+/// Decode a unit vector that was encoded by \ref encodeOctahedral()
+inline Normal3f decodeOctahedral(uint32_t value) {
+	float x = (int16_t) (value & 0xFFFF) * (1.0f / 32767.0f),
+	      y = (int16_t) (value >> 16) * (1.0f / 32767.0f),
+	      z = 1.0f - std::abs(x) - std::abs(y);
+	if (z < 0) {
+		float fx = (1.0f - std::abs(y)) * (x >= 0 ? 1.0f : -1.0f),
+		      fy = (1.0f - std::abs(x)) * (y >= 0 ? 1.0f : -1.0f);
+		x = fx; y = fy;
+	}
+	return Normal3f(x, y, z).normalized();
+}
+
 /**
  * \brief Intersection data structure
  *
@@ -81,10 +120,10 @@ public:
 	virtual void activate();
 
 	/// Return the total number of triangles in this hsape
-	inline uint32_t getTriangleCount() const { return m_triangleCount; }
+	inline IndexType getTriangleCount() const { return m_triangleCount; }
 	
 	/// Return the total number of vertices in this hsape
-	inline uint32_t getVertexCount() const { return m_vertexCount; }
+	inline IndexType getVertexCount() const { return m_vertexCount; }
 
 	/**
 	 * \brief Uniformly sample a position on the mesh with 
@@ -93,10 +132,10 @@ public:
 	void samplePosition(const Point2f &sample, Point3f &p, Normal3f &n) const;
 
 	/// Return the surface area of the given triangle
-	float surfaceArea(uint32_t index) const;
+	float surfaceArea(IndexType index) const;
 
 	//// Return an axis-aligned bounding box containing the given triangle
-	BoundingBox3f getBoundingBox(uint32_t index) const;
+	BoundingBox3f getBoundingBox(IndexType index) const;
 
 	/**
 	 * \brief Returns the axis-aligned bounding box of a triangle after it has 
@@ -110,7 +149,7 @@ public:
 	 * see "On building fast kd-Trees for Ray Tracing, and on doing 
 	 * that in O(N log N)" by Ingo Wald and Vlastimil Havran
 	 */
-	BoundingBox3f getClippedBoundingBox(uint32_t index, const BoundingBox3f &clip) const;
+	BoundingBox3f getClippedBoundingBox(IndexType index, const BoundingBox3f &clip) const;
 
 	/** \brief Ray-triangle intersection test
 	 * 
@@ -133,7 +172,7 @@ public:
 	 * \return
 	 *   \c true if an intersection has been detected
 	 */
-	bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const;
+	bool rayIntersect(IndexType index, const Ray3f &ray, float &u, float &v, float &t) const;
 
 	/// Return the surface area of the entire mesh
 	inline float surfaceArea() const { return m_distr.getSum(); }
@@ -144,14 +183,67 @@ public:
 	/// Return a pointer to the vertex positions
 	inline const Point3f *getVertexPositions() const { return m_vertexPositions; }
 
-	/// Return a pointer to the vertex normals (or \c NULL if there are none)
+	/**
+	 * \brief Return a pointer to the vertex normals
+	 *
+	 * Returns \c NULL if there are none, or if the mesh is compressed
+	 * (use \ref getVertexNormal() in that case).
+	 */
 	inline const Normal3f *getVertexNormals() const { return m_vertexNormals; }
 
-	/// Return a pointer to the texture coordinates (or \c NULL if there are none)
+	/**
+	 * \brief Return a pointer to the texture coordinates
+	 *
+	 * Returns \c NULL if there are none, or if the mesh is compressed
+	 * (use \ref getVertexTexCoord() in that case).
+	 */
 	inline const Point2f *getVertexTexCoords() const { return m_vertexTexCoords; }
 
-	/// Return a pointer to the triangle vertex index list
-	inline const uint32_t *getIndices() const { return m_indices; }
+	/**
+	 * \brief Return a pointer to the triangle vertex index list
+	 *
+	 * Returns \c NULL if the mesh is compressed and its indices fit
+	 * into 16 bits (use \ref getIndex() in that case).
+	 */
+	inline const IndexType *getIndices() const { return m_indices; }
+
+	/// Return the 16-bit triangle vertex index list of a compressed mesh (or \c NULL)
+	inline const uint16_t *getShortIndices() const { return m_shortIndices; }
+
+	/// Return an entry of the triangle vertex index list
+	inline IndexType getIndex(size_t i) const {
+		return m_shortIndices ? (IndexType) m_shortIndices[i] : m_indices[i];
+	}
+
+	/// Does the mesh provide vertex normals?
+	inline bool hasVertexNormals() const { return m_vertexNormals || m_packedNormals; }
+
+	/// Does the mesh provide texture coordinates?
+	inline bool hasVertexTexCoords() const { return m_vertexTexCoords || m_packedTexCoords; }
+
+	/// Return the normal of a vertex (decoded if the mesh is compressed)
+	inline Normal3f getVertexNormal(IndexType i) const {
+		return m_packedNormals ? decodeOctahedral(m_packedNormals[i]) : m_vertexNormals[i];
+	}
+
+	/// Return the texture coordinates of a vertex (decoded if the mesh is compressed)
+	inline Point2f getVertexTexCoord(IndexType i) const {
+		if (m_packedTexCoords)
+			return Point2f(m_packedTexCoords[2*i], m_packedTexCoords[2*i+1]);
+		return m_vertexTexCoords[i];
+	}
+
+	/**
+	 * \brief Is the mesh stored in compressed form?
+	 *
+	 * When the <tt>compressed</tt> property is set, \ref activate() replaces
+	 * the normals by octahedral 32-bit encodings, the texture coordinates
+	 * by half floats, and the indices by 16-bit integers if there are at
+	 * most 65536 vertices. The vertex positions stay in full precision,
+	 * hence intersections are unaffected; the attributes are only decoded
+	 * when an intersection record is filled in.
+	 */
+	inline bool isCompressed() const { return m_compressed; }
 
 	/// Is this mesh an area luminaire?
 	inline bool isLuminaire() const { return m_luminaire != NULL; }
@@ -171,11 +263,30 @@ public:
 	/// Return the name of this mesh
 	inline const QString &getName() const { return m_name; }
 
+	/**
+	 * \brief Return the identifier of a shared mesh
+	 *
+	 * Meshes with a non-empty identifier are only rendered through
+	 * instances that reference them (see \ref Instance).
+	 */
+	inline const QString &getId() const { return m_id; }
+
 	/// Return a human-readable summary of this instance
 	QString toString() const;
         
         /// Return the original transform used on this mesh
         inline const Transform &getOriginalTransform() const { return m_originalTransform; }
+
+	/**
+	 * \brief Move the mesh by changing its object-to-world transformation
+	 *
+	 * Since the vertices are stored in world space, they are transformed
+	 * by the difference between the new and the current transformation,
+	 * which then becomes the one returned by \ref getOriginalTransform().
+	 * Accelerators containing the mesh must be updated afterwards (see
+	 * \ref Scene::updateMeshes()).
+	 */
+	void setTransform(const Transform &toWorld);
         
         /// Return main representative color
         Color3f getMainColor() const;
@@ -188,18 +299,52 @@ public:
 protected:
 	/// Create an empty mesh
 	Mesh(const PropertyList& propList);
+
+	/**
+	 * \brief Copy the vertex and index arrays out of \ref m_mappedFile
+	 *
+	 * The memory mapping is read-only, hence this is done before
+	 * the vertices are modified.
+	 */
+	void releaseMapping();
+
+	/// Convert the vertex attributes and indices to the compressed representation
+	void compress();
+
+	/**
+	 * \brief Sort the triangles and vertices by their location
+	 *
+	 * Triangles are sorted along a Morton curve through their centroids,
+	 * and the vertices are renumbered in the order in which the sorted
+	 * triangles first reference them. Neighboring triangles then share
+	 * cache lines in the index and vertex arrays, which helps the
+	 * accelerator builders and the hit point reconstruction. Enabled
+	 * by the <tt>reorder</tt> property and run by \ref activate(), which
+	 * prints locality metrics before and after the pass.
+	 */
+	void reorder();
 protected:
 	Point3f    *m_vertexPositions;
 	Normal3f   *m_vertexNormals;
 	Point2f    *m_vertexTexCoords;
-	uint32_t   *m_indices;
-	uint32_t    m_vertexCount;
-	uint32_t    m_triangleCount;
+	IndexType  *m_indices;
+	IndexType   m_vertexCount;
+	IndexType   m_triangleCount;
 	DiscretePDF m_distr;
 	BSDF       *m_bsdf;
 	Luminaire  *m_luminaire;
 	QString     m_name;
+	QString     m_id;
         Transform   m_originalTransform;
+	/// Memory-mapped file containing the arrays (e.g. a mesh cache), or \c NULL
+	QFile      *m_mappedFile;
+	/// Sort the triangles and vertices by location (see \ref reorder())
+	bool        m_reorder;
+	/// Compressed attributes (see \ref isCompressed())
+	bool        m_compressed;
+	uint32_t   *m_packedNormals;
+	half       *m_packedTexCoords;
+	uint16_t   *m_shortIndices;
 };
 
 NORI_NAMESPACE_END
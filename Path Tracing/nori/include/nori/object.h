@@ -47,6 +47,8 @@ public:
 		ETest,
 		EReconstructionFilter,
                 EEvaluator,
+		EAccel,
+		EInstance,
 		EClassTypeCount
 	};
 
@@ -109,6 +111,8 @@ public:
 			case ESampler:    return "sampler";
 			case ETest:       return "test";
                         case EEvaluator:  return "evaluator";         
+			case EAccel:      return "accel";
+			case EInstance:   return "instance";
 			default:          return "<unknown>";
 		}
 	}
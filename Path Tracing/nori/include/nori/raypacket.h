@@ -0,0 +1,77 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__RAYPACKET_H)
+#define __RAYPACKET_H
+
+#include <nori/mesh.h>
+
+/// Number of rays per packet (4x4 pixels of an image block)
+#define NORI_PACKET_SIZE 16
+/// Side length of the pixel tile covered by one packet
+#define NORI_PACKET_TILE 4
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Group of up to \c Size rays that are traced together
+ *
+ * Packets are used for coherent rays (e.g. camera rays through
+ * neighboring pixels), which tend to visit the same nodes of an
+ * acceleration data structure. Only the first \c count entries
+ * are valid. After \ref Accel::rayIntersectPacket() returns,
+ * <tt>hit[i]</tt> specifies whether ray \c i intersected the scene,
+ * in which case <tt>its[i]</tt> contains the intersection record.
+ */
+template <int Size> struct RayPacket {
+	/// The rays in question
+	Ray3f rays[Size];
+	/// Intersection records
+	Intersection its[Size];
+	/// Specifies which rays hit the scene
+	bool hit[Size];
+	/// Number of valid rays
+	uint32_t count;
+
+	/// Create an empty packet
+	inline RayPacket() : count(0) { }
+
+	/**
+	 * \brief Check whether the direction components of all rays
+	 * have the same signs
+	 *
+	 * Packet traversal visits the children of a node in the same
+	 * order for all rays, which is only possible in this case.
+	 */
+	inline bool isCoherent() const {
+		for (uint32_t i=1; i<count; ++i) {
+			for (int axis=0; axis<3; ++axis) {
+				if ((rays[i].dRcp[axis] < 0) != (rays[0].dRcp[axis] < 0))
+					return false;
+			}
+		}
+		return true;
+	}
+};
+
+/// Packet type used by the renderer
+typedef RayPacket<NORI_PACKET_SIZE> RayPacketN;
+
+NORI_NAMESPACE_END
+
+#endif /* __RAYPACKET_H */
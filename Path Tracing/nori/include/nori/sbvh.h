@@ -0,0 +1,106 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__SBVH_H)
+#define __SBVH_H
+
+#include <nori/bvh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Bounding volume hierarchy with spatial splits
+ *
+ * Implements the construction algorithm from "Spatial Splits in Bounding
+ * Volume Hierarchies" by Stich et al. Besides the binned object splits of
+ * \ref BVH, the builder considers splitting the node's bounds at one of
+ * several candidate planes, in which case triangles that straddle the
+ * plane are referenced by both children. The bounds of the two parts
+ * are computed by clipping the triangle against each side of the plane
+ * (see \ref Mesh::getClippedBoundingBox()), which avoids the large and
+ * heavily overlapping nodes that long and thin triangles otherwise
+ * produce.
+ *
+ * To limit the number of duplicated references, spatial splits are only
+ * evaluated when the children of the best object split overlap by more
+ * than <tt>splitAlpha</tt> times the surface area of the scene bounds.
+ * A value of 0 considers spatial splits in every node, and a value of 1
+ * effectively disables them. References whose split would not pay off
+ * are assigned to one side only ("reference unsplitting").
+ *
+ * The finished hierarchy is traversed exactly like a \ref BVH and
+ * supports the same properties. Can be selected using
+ * <tt>&lt;accel type="sbvh"/&gt;</tt>.
+ */
+class SBVH : public BVH {
+public:
+	/// Create a new and empty SBVH
+	SBVH(const PropertyList &propList);
+
+	/// Return a brief string summary of the instance (for debugging purposes)
+	QString toString() const;
+protected:
+	/// Build the hierarchy using object and spatial splits
+	void buildHierarchy(BuildPrimitive *prims, uint32_t primCount);
+
+	/// Best object split of a node (binned SAH on the reference centroids)
+	struct ObjectSplit {
+		float cost;
+		int axis, bin;
+		BoundingBox3f leftBBox, rightBBox;
+	};
+
+	/// Best spatial split of a node
+	struct SpatialSplit {
+		float cost, pos;
+		int axis;
+		uint32_t leftCount, rightCount;
+		BoundingBox3f leftBBox, rightBBox;
+	};
+
+	/// Recursively build the subtree for a list of references
+	void buildNode(std::vector<BuildPrimitive> &refs, uint32_t depth);
+
+	/// Find the best object split of a node
+	void findObjectSplit(const std::vector<BuildPrimitive> &refs,
+		const BoundingBox3f &bbox, const BoundingBox3f &centroidBBox,
+		ObjectSplit &split) const;
+
+	/// Find the best spatial split of a node
+	void findSpatialSplit(const std::vector<BuildPrimitive> &refs,
+		const BoundingBox3f &bbox, SpatialSplit &split) const;
+
+	/// Distribute the references according to a spatial split
+	void performSpatialSplit(const std::vector<BuildPrimitive> &refs,
+		const SpatialSplit &split, std::vector<BuildPrimitive> &left,
+		std::vector<BuildPrimitive> &right) const;
+
+	/// Return the bounds of a triangle clipped to a box (global primitive index)
+	inline BoundingBox3f getClippedBoundingBox(IndexType index, const BoundingBox3f &clip) const {
+		uint32_t meshIdx = findMesh(index);
+		return m_meshes[meshIdx]->getClippedBoundingBox(index, clip);
+	}
+protected:
+	float m_splitAlpha;
+	float m_minOverlap;
+	uint32_t m_spatialSplitCount;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __SBVH_H */
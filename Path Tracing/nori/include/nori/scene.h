@@ -20,7 +20,7 @@
 #define __SCENE_H
 
 #include <nori/evaluator.h>
-#include <nori/kdtree.h>
+#include <nori/instance.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -39,8 +39,8 @@ public:
 	/// Release all memory
 	virtual ~Scene();
 
-	/// Return a pointer to the scene's kd-tree
-	inline const KDTree *getKDTree() const { return m_kdtree; }
+	/// Return a pointer to the scene's acceleration data structure
+	inline const Accel *getAccel() const { return m_accel; }
 
 	/// Return a pointer to the scene's integrator
 	inline const Integrator *getIntegrator() const { return m_integrator; }
@@ -68,6 +68,9 @@ public:
 
 	/// Return a reference to an array containing all meshes
 	inline const std::vector<Mesh *> &getMeshes() const { return m_meshes; }
+
+	/// Return a reference to an array containing all instances of shared meshes
+	inline const std::vector<Instance *> &getInstances() const { return m_instances; }
         
         /// Return a reference to an array containing all luminaires
         inline const std::vector<Luminaire *> &getLuminaires() const { return m_luminaires; }
@@ -87,7 +90,7 @@ public:
 	 * \return \c true if an intersection was found
 	 */
 	inline bool rayIntersect(const Ray3f &ray, Intersection &its) const {
-		return m_kdtree->rayIntersect(ray, its, false);
+		return m_accel->rayIntersect(ray, its, false);
 	}
 
 	/**
@@ -107,7 +110,35 @@ public:
 	 */
 	inline bool rayIntersect(const Ray3f &ray) const {
 		Intersection its; /* Unused */
-		return m_kdtree->rayIntersect(ray, its, true);
+		return m_accel->rayIntersect(ray, its, true);
+	}
+
+	/**
+	 * \brief Check whether a shadow ray is blocked by any triangle
+	 *
+	 * This is equivalent to the shadow ray variant of \ref rayIntersect(),
+	 * but uses an any-hit traversal of the accelerator that stops at the
+	 * first intersection and caches the most recent occluder of each
+	 * thread (see \ref Accel::occluded()).
+	 *
+	 * \param ray
+	 *    A 3-dimensional ray data structure with minimum/maximum
+	 *    extent information
+	 *
+	 * \return \c true if the ray segment is occluded
+	 */
+	inline bool occluded(const Ray3f &ray) const {
+		return m_accel->occluded(ray);
+	}
+
+	/**
+	 * \brief Find the closest intersection of every ray in a packet
+	 *
+	 * This is most efficient for coherent rays, such as camera rays
+	 * through neighboring pixels. See \ref RayPacket for details.
+	 */
+	inline void rayIntersectPacket(RayPacketN &packet) const {
+		m_accel->rayIntersectPacket(packet);
 	}
 
 	/// Uniformly pick a luminaire and invoke its direct illumination sampling method
@@ -162,13 +193,24 @@ public:
 	 * \brief Return an axis-aligned box that bounds the scene
 	 */
 	inline const BoundingBox3f &getBoundingBox() const {
-		return m_kdtree->getBoundingBox();
+		return m_accel->getBoundingBox();
+	}
+
+	/**
+	 * \brief Notify the scene that some of its meshes have moved
+	 *
+	 * Must be called after changing the transformation of meshes using
+	 * \ref Mesh::setTransform(). Depending on the accelerator, this
+	 * refits or rebuilds the affected parts of the hierarchy.
+	 */
+	inline void updateMeshes(const std::vector<const Mesh *> &changed) {
+		m_accel->update(changed);
 	}
 
 	/**
 	 * \brief Inherited from \ref NoriObject::activate()
 	 *
-	 * Initializes the internal data structures (kd-tree,
+	 * Initializes the internal data structures (accelerator,
 	 * luminaire sampling data structures, etc.)
 	 */
 	void activate();
@@ -182,12 +224,14 @@ public:
 	EClassType getClassType() const { return EScene; }
 private:
 	std::vector<Mesh *> m_meshes;
+	std::vector<Mesh *> m_sharedMeshes;
+	std::vector<Instance *> m_instances;
 	std::vector<Luminaire *> m_luminaires;
 	Integrator *m_integrator;
 	Sampler *m_sampler;
 	Camera *m_camera;
 	Medium *m_medium;
-	KDTree *m_kdtree;
+	Accel *m_accel;
 	Luminaire *m_envLuminaire;
         Evaluator *m_evaluator;
 };
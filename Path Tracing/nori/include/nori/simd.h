@@ -0,0 +1,156 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__SIMD_H)
+#define __SIMD_H
+
+#include <nori/common.h>
+#include <xmmintrin.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+/// Natural SIMD width of the target (8 with AVX, 4 with SSE)
+#if defined(__AVX__)
+#define NORI_SIMD_WIDTH 8
+#else
+#define NORI_SIMD_WIDTH 4
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Packet of \c Width single precision values that are processed
+ * in lock-step using SIMD instructions
+ *
+ * Only widths 4 (SSE) and 8 are supported. When the compiler does not
+ * target AVX, 8-wide packets are emulated using two SSE registers.
+ * Comparisons return packets whose lanes are either all ones (true) or
+ * all zeros (false), which can be combined using the bitwise operators
+ * and converted into a bit mask using \ref movemask().
+ *
+ * Loads and stores require 16 (SSE) or 32 byte (AVX) aligned memory.
+ */
+template <int Width> struct SIMDFloat;
+
+/// 4-wide SSE packet
+template <> struct SIMDFloat<4> {
+	__m128 v;
+
+	inline SIMDFloat() { }
+	inline SIMDFloat(__m128 v) : v(v) { }
+	inline SIMDFloat(float f) : v(_mm_set1_ps(f)) { }
+
+	static inline SIMDFloat load(const float *ptr) { return _mm_load_ps(ptr); }
+	inline void store(float *ptr) const { _mm_store_ps(ptr, v); }
+
+	inline SIMDFloat operator+(const SIMDFloat &o) const { return _mm_add_ps(v, o.v); }
+	inline SIMDFloat operator-(const SIMDFloat &o) const { return _mm_sub_ps(v, o.v); }
+	inline SIMDFloat operator*(const SIMDFloat &o) const { return _mm_mul_ps(v, o.v); }
+	inline SIMDFloat operator/(const SIMDFloat &o) const { return _mm_div_ps(v, o.v); }
+	inline SIMDFloat operator&(const SIMDFloat &o) const { return _mm_and_ps(v, o.v); }
+	inline SIMDFloat operator|(const SIMDFloat &o) const { return _mm_or_ps(v, o.v); }
+	inline SIMDFloat operator<(const SIMDFloat &o) const { return _mm_cmplt_ps(v, o.v); }
+	inline SIMDFloat operator<=(const SIMDFloat &o) const { return _mm_cmple_ps(v, o.v); }
+	inline SIMDFloat operator>(const SIMDFloat &o) const { return _mm_cmpgt_ps(v, o.v); }
+	inline SIMDFloat operator>=(const SIMDFloat &o) const { return _mm_cmpge_ps(v, o.v); }
+
+	/// Lane-wise minimum -- returns \c b for lanes where either argument is NaN
+	static inline SIMDFloat min(const SIMDFloat &a, const SIMDFloat &b) { return _mm_min_ps(a.v, b.v); }
+	/// Lane-wise maximum -- returns \c b for lanes where either argument is NaN
+	static inline SIMDFloat max(const SIMDFloat &a, const SIMDFloat &b) { return _mm_max_ps(a.v, b.v); }
+	/// Return \c a where \c mask is set and \c b elsewhere
+	static inline SIMDFloat select(const SIMDFloat &mask, const SIMDFloat &a, const SIMDFloat &b) {
+		return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+	}
+
+	/// Return the sign bits of all lanes as an integer bit mask
+	inline int movemask() const { return _mm_movemask_ps(v); }
+};
+
+/// 8-wide packet (AVX, or a pair of SSE registers)
+template <> struct SIMDFloat<8> {
+#if defined(__AVX__)
+	__m256 v;
+
+	inline SIMDFloat() { }
+	inline SIMDFloat(__m256 v) : v(v) { }
+	inline SIMDFloat(float f) : v(_mm256_set1_ps(f)) { }
+
+	static inline SIMDFloat load(const float *ptr) { return _mm256_load_ps(ptr); }
+	inline void store(float *ptr) const { _mm256_store_ps(ptr, v); }
+
+	inline SIMDFloat operator+(const SIMDFloat &o) const { return _mm256_add_ps(v, o.v); }
+	inline SIMDFloat operator-(const SIMDFloat &o) const { return _mm256_sub_ps(v, o.v); }
+	inline SIMDFloat operator*(const SIMDFloat &o) const { return _mm256_mul_ps(v, o.v); }
+	inline SIMDFloat operator/(const SIMDFloat &o) const { return _mm256_div_ps(v, o.v); }
+	inline SIMDFloat operator&(const SIMDFloat &o) const { return _mm256_and_ps(v, o.v); }
+	inline SIMDFloat operator|(const SIMDFloat &o) const { return _mm256_or_ps(v, o.v); }
+	inline SIMDFloat operator<(const SIMDFloat &o) const { return _mm256_cmp_ps(v, o.v, _CMP_LT_OQ); }
+	inline SIMDFloat operator<=(const SIMDFloat &o) const { return _mm256_cmp_ps(v, o.v, _CMP_LE_OQ); }
+	inline SIMDFloat operator>(const SIMDFloat &o) const { return _mm256_cmp_ps(v, o.v, _CMP_GT_OQ); }
+	inline SIMDFloat operator>=(const SIMDFloat &o) const { return _mm256_cmp_ps(v, o.v, _CMP_GE_OQ); }
+
+	static inline SIMDFloat min(const SIMDFloat &a, const SIMDFloat &b) { return _mm256_min_ps(a.v, b.v); }
+	static inline SIMDFloat max(const SIMDFloat &a, const SIMDFloat &b) { return _mm256_max_ps(a.v, b.v); }
+	static inline SIMDFloat select(const SIMDFloat &mask, const SIMDFloat &a, const SIMDFloat &b) {
+		return _mm256_blendv_ps(b.v, a.v, mask.v);
+	}
+
+	inline int movemask() const { return _mm256_movemask_ps(v); }
+#else
+	SIMDFloat<4> lo, hi;
+
+	inline SIMDFloat() { }
+	inline SIMDFloat(const SIMDFloat<4> &lo, const SIMDFloat<4> &hi) : lo(lo), hi(hi) { }
+	inline SIMDFloat(float f) : lo(f), hi(f) { }
+
+	static inline SIMDFloat load(const float *ptr) {
+		return SIMDFloat(SIMDFloat<4>::load(ptr), SIMDFloat<4>::load(ptr + 4));
+	}
+	inline void store(float *ptr) const { lo.store(ptr); hi.store(ptr + 4); }
+
+	inline SIMDFloat operator+(const SIMDFloat &o) const { return SIMDFloat(lo + o.lo, hi + o.hi); }
+	inline SIMDFloat operator-(const SIMDFloat &o) const { return SIMDFloat(lo - o.lo, hi - o.hi); }
+	inline SIMDFloat operator*(const SIMDFloat &o) const { return SIMDFloat(lo * o.lo, hi * o.hi); }
+	inline SIMDFloat operator/(const SIMDFloat &o) const { return SIMDFloat(lo / o.lo, hi / o.hi); }
+	inline SIMDFloat operator&(const SIMDFloat &o) const { return SIMDFloat(lo & o.lo, hi & o.hi); }
+	inline SIMDFloat operator|(const SIMDFloat &o) const { return SIMDFloat(lo | o.lo, hi | o.hi); }
+	inline SIMDFloat operator<(const SIMDFloat &o) const { return SIMDFloat(lo < o.lo, hi < o.hi); }
+	inline SIMDFloat operator<=(const SIMDFloat &o) const { return SIMDFloat(lo <= o.lo, hi <= o.hi); }
+	inline SIMDFloat operator>(const SIMDFloat &o) const { return SIMDFloat(lo > o.lo, hi > o.hi); }
+	inline SIMDFloat operator>=(const SIMDFloat &o) const { return SIMDFloat(lo >= o.lo, hi >= o.hi); }
+
+	static inline SIMDFloat min(const SIMDFloat &a, const SIMDFloat &b) {
+		return SIMDFloat(SIMDFloat<4>::min(a.lo, b.lo), SIMDFloat<4>::min(a.hi, b.hi));
+	}
+	static inline SIMDFloat max(const SIMDFloat &a, const SIMDFloat &b) {
+		return SIMDFloat(SIMDFloat<4>::max(a.lo, b.lo), SIMDFloat<4>::max(a.hi, b.hi));
+	}
+	static inline SIMDFloat select(const SIMDFloat &mask, const SIMDFloat &a, const SIMDFloat &b) {
+		return SIMDFloat(SIMDFloat<4>::select(mask.lo, a.lo, b.lo),
+			SIMDFloat<4>::select(mask.hi, a.hi, b.hi));
+	}
+
+	inline int movemask() const { return lo.movemask() | (hi.movemask() << 4); }
+#endif
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __SIMD_H */
@@ -0,0 +1,209 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__TRIACCEL_H)
+#define __TRIACCEL_H
+
+#include <nori/ray.h>
+#include <nori/simd.h>
+#include <Eigen/Geometry>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Self-contained triangle record used by the leaves of the
+ * acceleration data structures (48 bytes)
+ *
+ * Stores the first vertex and the two edge vectors of a triangle along
+ * with the index of its mesh and its index within that mesh. The
+ * accelerators place these records in the order in which their leaves
+ * reference the triangles, so that a leaf can be intersected by
+ * streaming through a contiguous block of memory -- without having to
+ * look up the mesh, its index buffer and then its vertex positions.
+ */
+struct TriAccel {
+	/// First vertex
+	Point3f p0;
+	/// Edge from the first to the second vertex
+	Vector3f e1;
+	/// Edge from the first to the third vertex
+	Vector3f e2;
+	/// Index of the mesh in the accelerator's mesh list
+	uint32_t meshIndex;
+	/// Index of the triangle within the mesh
+	IndexType primIndex;
+	/// Global primitive index (see \ref Accel)
+	IndexType index;
+
+	/**
+	 * \brief Ray-triangle intersection test
+	 *
+	 * Implements the same Moeller-Trumbore test as \ref Mesh::rayIntersect()
+	 * using the precomputed edge vectors.
+	 */
+	inline bool rayIntersect(const Ray3f &ray, float &u, float &v, float &t) const {
+		/* begin calculating determinant - also used to calculate U parameter */
+		Vector3f pvec = ray.d.cross(e2);
+
+		/* if determinant is near zero, ray lies in plane of triangle */
+		float det = e1.dot(pvec);
+
+		if (det > -1e-8f && det < 1e-8f)
+			return false;
+		float inv_det = 1.0f / det;
+
+		/* calculate distance from v[0] to ray origin */
+		Vector3f tvec = ray.o - p0;
+
+		/* calculate U parameter and test bounds */
+		u = tvec.dot(pvec) * inv_det;
+		if (u < 0.0 || u > 1.0)
+			return false;
+
+		/* prepare to test V parameter */
+		Vector3f qvec = tvec.cross(e1);
+
+		/* calculate V parameter and test bounds */
+		v = ray.d.dot(qvec) * inv_det;
+		if (v < 0.0 || u + v > 1.0)
+			return false;
+
+		/* ray intersects triangle -> compute t */
+		t = e2.dot(qvec) * inv_det;
+
+		return true;
+	}
+};
+
+/**
+ * \brief Group of \c Width triangles in structure-of-arrays layout that
+ * are intersected simultaneously using SIMD instructions
+ *
+ * The accelerators pack the triangles of each leaf into consecutive
+ * packets. Unused lanes of the last packet contain degenerate triangles,
+ * which are never reported as hits.
+ */
+template <int Width> struct TriAccelPacket {
+	typedef SIMDFloat<Width> Packet;
+
+	/// First vertices, indexed by [axis][lane]
+	float p0[3][Width];
+	/// Edges from the first to the second vertex
+	float e1[3][Width];
+	/// Edges from the first to the third vertex
+	float e2[3][Width];
+	/// Index of the mesh in the accelerator's mesh list
+	uint32_t meshIndex[Width];
+	/// Index of the triangle within the mesh
+	IndexType primIndex[Width];
+	/// Global primitive index, or <tt>(IndexType) -1</tt> for unused lanes
+	IndexType index[Width];
+
+	/// Mark all lanes as unused
+	inline void clear() {
+		for (int axis=0; axis<3; ++axis) {
+			for (int i=0; i<Width; ++i) {
+				p0[axis][i] = e1[axis][i] = e2[axis][i] = 0.0f;
+			}
+		}
+		for (int i=0; i<Width; ++i) {
+			meshIndex[i] = primIndex[i] = 0;
+			index[i] = (IndexType) -1;
+		}
+	}
+
+	/// Store a triangle in the given lane
+	inline void set(int lane, const TriAccel &tri) {
+		for (int axis=0; axis<3; ++axis) {
+			p0[axis][lane] = tri.p0[axis];
+			e1[axis][lane] = tri.e1[axis];
+			e2[axis][lane] = tri.e2[axis];
+		}
+		meshIndex[lane] = tri.meshIndex;
+		primIndex[lane] = tri.primIndex;
+		index[lane] = tri.index;
+	}
+
+	/**
+	 * \brief Intersect a ray against all triangles of the packet
+	 *
+	 * Evaluates the Moeller-Trumbore test of \ref TriAccel::rayIntersect()
+	 * in all lanes and reduces the result to the closest hit within the
+	 * interval <tt>[mint, maxt]</tt>.
+	 *
+	 * \return The lane of the closest hit, or -1 if there is none
+	 */
+	inline int rayIntersect(const Ray3f &ray, float mint, float maxt,
+			float &u, float &v, float &t) const {
+		const Packet dx(ray.d.x()), dy(ray.d.y()), dz(ray.d.z());
+		const Packet e1x = Packet::load(e1[0]), e1y = Packet::load(e1[1]), e1z = Packet::load(e1[2]);
+		const Packet e2x = Packet::load(e2[0]), e2y = Packet::load(e2[1]), e2z = Packet::load(e2[2]);
+
+		/* pvec = d x e2 */
+		Packet px = dy * e2z - dz * e2y,
+		       py = dz * e2x - dx * e2z,
+		       pz = dx * e2y - dy * e2x;
+
+		Packet det = e1x * px + e1y * py + e1z * pz;
+		Packet valid = (det <= Packet(-1e-8f)) | (det >= Packet(1e-8f));
+		Packet invDet = Packet(1.0f) / det;
+
+		/* tvec = o - p0 */
+		Packet tx = Packet(ray.o.x()) - Packet::load(p0[0]),
+		       ty = Packet(ray.o.y()) - Packet::load(p0[1]),
+		       tz = Packet(ray.o.z()) - Packet::load(p0[2]);
+
+		Packet uu = (tx * px + ty * py + tz * pz) * invDet;
+		valid = valid & (uu >= Packet(0.0f)) & (uu <= Packet(1.0f));
+
+		/* qvec = tvec x e1 */
+		Packet qx = ty * e1z - tz * e1y,
+		       qy = tz * e1x - tx * e1z,
+		       qz = tx * e1y - ty * e1x;
+
+		Packet vv = (dx * qx + dy * qy + dz * qz) * invDet;
+		valid = valid & (vv >= Packet(0.0f)) & (uu + vv <= Packet(1.0f));
+
+		Packet tt = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+		valid = valid & (tt >= Packet(mint)) & (tt <= Packet(maxt));
+
+		int mask = valid.movemask();
+		if (mask == 0)
+			return -1;
+
+		/* Masked reduction to the closest hit */
+		Packet tmp[3] = { tt, uu, vv };
+		const float *values = reinterpret_cast<const float *>(tmp);
+		int best = -1;
+		for (int i=0; i<Width; ++i) {
+			if ((mask & (1 << i)) && (best < 0 || values[i] < values[best]))
+				best = i;
+		}
+		t = values[best];
+		u = values[Width + best];
+		v = values[2*Width + best];
+		return best;
+	}
+};
+
+/// Triangle packet matching the natural SIMD width of the target
+typedef TriAccelPacket<NORI_SIMD_WIDTH> TriAccelN;
+
+NORI_NAMESPACE_END
+
+#endif /* __TRIACCEL_H */
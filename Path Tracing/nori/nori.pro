@@ -1,11 +1,17 @@
 SOURCES += src/common.cpp \
+	src/accel.cpp \
 	src/ao.cpp \
 	src/bitmap.cpp \
 	src/block.cpp \
+	src/bvh.cpp \
+	src/mbvh.cpp \
 	src/gui.cpp \
 	src/independent.cpp \
+	src/instance.cpp \
         src/isotropic.cpp \
 	src/kdtree.cpp \
+	src/lazybvh.cpp \
+	src/lbvh.cpp \
 	src/main.cpp \
 	src/medium.cpp \
 	src/mesh.cpp \
@@ -14,9 +20,11 @@ SOURCES += src/common.cpp \
 	src/object.cpp \
 	src/parser.cpp \
 	src/perspective.cpp \
+	src/ply.cpp \
 	src/proplist.cpp \
 	src/random.cpp \
 	src/rfilter.cpp \
+	src/sbvh.cpp \
 	src/scene.cpp
 
 # EX1
@@ -107,7 +115,7 @@ win32 {
         QMAKE_LDFLAGS += /LTCG
         SOURCES += src/support_win32.cpp
 
-        LIBS += IlmImf.lib Iex.lib IlmThread.lib Imath.lib Half.lib
+        LIBS += IlmImf.lib Iex.lib IlmThread.lib Imath.lib Half.lib psapi.lib
 }
 
 TARGET = nori
@@ -0,0 +1,222 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <Eigen/Geometry>
+#include <cstring>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Triangle buffer entry of the occluder found by the most recent
+ * successful shadow ray query of the current thread
+ */
+static NORI_THREAD_LOCAL const Accel *lastOccluderAccel = NULL;
+static NORI_THREAD_LOCAL IndexType lastOccluderEntry = 0;
+
+Accel::Accel() : m_primitiveCount(0), m_triangles(NULL),
+		m_triangleCount(0), m_packets(NULL), m_packetCount(0),
+		m_packetOffsets(NULL), m_packetOffsetCount(0) {
+	m_sizeMap.push_back(0);
+}
+
+Accel::~Accel() {
+	if (m_triangles)
+		freeAligned(m_triangles);
+	if (m_packets)
+		freeAligned(m_packets);
+	if (m_packetOffsets)
+		delete[] m_packetOffsets;
+}
+
+void Accel::addMesh(Mesh *mesh) {
+	m_primitiveCount += mesh->getTriangleCount();
+	m_meshes.push_back(mesh);
+	m_sizeMap.push_back(m_sizeMap.back() + mesh->getTriangleCount());
+}
+
+bool Accel::occluded(const Ray3f &ray) const {
+	/* Use an adaptive ray epsilon */
+	float mint = ray.mint, maxt = ray.maxt;
+	if (mint == Epsilon)
+		mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
+
+	if (maxt < mint)
+		return false;
+
+	/* Try the previous occluder first */
+	if (lastOccluderAccel == this && occludedBy(lastOccluderEntry, ray, mint, maxt))
+		return true;
+
+	IndexType entry = (IndexType) -1;
+	if (!findOccluder(ray, mint, maxt, entry))
+		return false;
+
+	if (entry != (IndexType) -1) {
+		lastOccluderAccel = this;
+		lastOccluderEntry = entry;
+	}
+	return true;
+}
+
+bool Accel::findOccluder(const Ray3f &ray, float mint, float maxt, IndexType &) const {
+	Intersection its; /* Unused */
+	return rayIntersect(Ray3f(ray, mint, maxt), its, true);
+}
+
+void Accel::rayIntersectPacket(RayPacketN &packet) const {
+	for (uint32_t i=0; i<packet.count; ++i)
+		packet.hit[i] = rayIntersect(packet.rays[i], packet.its[i], false);
+}
+
+void Accel::createTriangleBuffer(const IndexType *indices, size_t count) {
+	if (m_triangles)
+		freeAligned(m_triangles);
+	m_triangles = static_cast<TriAccel *>(allocAligned(
+		sizeof(TriAccel) * std::max(count, (size_t) 1)));
+	m_triangleCount = count;
+
+	for (size_t i=0; i<count; ++i) {
+		IndexType primIndex = indices[i];
+		uint32_t meshIndex = findMesh(primIndex);
+		fillTriAccel(m_triangles[i], meshIndex, primIndex);
+	}
+}
+
+void Accel::updateTriangleBuffer(const std::vector<bool> &changed) {
+	for (size_t i=0; i<m_triangleCount; ++i) {
+		TriAccel &tri = m_triangles[i];
+		if (changed[tri.meshIndex])
+			fillTriAccel(tri, tri.meshIndex, tri.primIndex);
+	}
+
+	for (size_t i=0; i<m_packetCount; ++i) {
+		TriAccelN &packet = m_packets[i];
+		for (int lane=0; lane<NORI_SIMD_WIDTH; ++lane) {
+			if (packet.index[lane] == (IndexType) -1 || !changed[packet.meshIndex[lane]])
+				continue;
+			TriAccel tri;
+			fillTriAccel(tri, packet.meshIndex[lane], packet.primIndex[lane]);
+			packet.set(lane, tri);
+		}
+	}
+}
+
+void Accel::update(const std::vector<const Mesh *> &) {
+	clear();
+	build();
+}
+
+void Accel::clear() {
+	if (m_triangles)
+		freeAligned(m_triangles);
+	if (m_packets)
+		freeAligned(m_packets);
+	if (m_packetOffsets)
+		delete[] m_packetOffsets;
+	m_triangles = NULL;
+	m_packets = NULL;
+	m_packetOffsets = NULL;
+	m_triangleCount = m_packetCount = m_packetOffsetCount = 0;
+}
+
+void Accel::createPacketBuffer(const std::vector<std::pair<IndexType, IndexType> > &leaves) {
+	if (m_packets)
+		freeAligned(m_packets);
+
+	/* Assign packet ranges to all leaves with more than one triangle */
+	size_t packetCount = 0, maxEnd = 0;
+	for (size_t i=0; i<leaves.size(); ++i) {
+		IndexType size = leaves[i].second - leaves[i].first;
+		if (size > 1)
+			packetCount += (size + NORI_SIMD_WIDTH - 1) / NORI_SIMD_WIDTH;
+		maxEnd = std::max(maxEnd, (size_t) leaves[i].second);
+	}
+
+	if (m_packetOffsets)
+		delete[] m_packetOffsets;
+	m_packetOffsetCount = maxEnd;
+	m_packetOffsets = new IndexType[std::max(maxEnd, (size_t) 1)];
+	memset(m_packetOffsets, 0, sizeof(IndexType) * m_packetOffsetCount);
+	m_packetCount = packetCount;
+	m_packets = static_cast<TriAccelN *>(allocAligned(
+		sizeof(TriAccelN) * std::max(packetCount, (size_t) 1)));
+
+	IndexType packetIdx = 0;
+	for (size_t i=0; i<leaves.size(); ++i) {
+		IndexType start = leaves[i].first, end = leaves[i].second;
+		if (end - start <= 1)
+			continue;
+		m_packetOffsets[start] = packetIdx;
+		for (IndexType entry=start; entry<end; entry += NORI_SIMD_WIDTH) {
+			TriAccelN &packet = m_packets[packetIdx++];
+			packet.clear();
+			for (uint32_t lane=0; lane<NORI_SIMD_WIDTH && entry+lane<end; ++lane)
+				packet.set(lane, m_triangles[entry+lane]);
+		}
+	}
+}
+
+void Accel::fillIntersection(IndexType primIndex, Intersection &its) const {
+	/* Find the barycentric coordinates */
+	Vector3f bary;
+	bary << 1-its.uv.sum(), its.uv;
+
+	/* Look up the vertex indices */
+	const Mesh *mesh = its.mesh;
+	const IndexType idx0 = mesh->getIndex(3*(size_t) primIndex+0),
+			  idx1 = mesh->getIndex(3*(size_t) primIndex+1),
+			  idx2 = mesh->getIndex(3*(size_t) primIndex+2);
+
+	const Point3f  *positions = mesh->getVertexPositions();
+
+	Point3f p0 = positions[idx0],
+		p1 = positions[idx1],
+		p2 = positions[idx2];
+
+	/* Compute the intersection positon accurately
+	   using barycentric coordinates */
+	its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+	/* Compute proper texture coordinates if provided by the mesh
+	   (compressed attributes are decoded here, and only here) */
+	if (mesh->hasVertexTexCoords())
+		its.uv = bary.x() * mesh->getVertexTexCoord(idx0) +
+			bary.y() * mesh->getVertexTexCoord(idx1) +
+			bary.z() * mesh->getVertexTexCoord(idx2);
+
+	/* Compute the geometry frame */
+	its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
+
+	if (mesh->hasVertexNormals()) {
+		/* Compute the shading frame. Note that for simplicity,
+		   the current implementation doesn't attempt to provide
+		   tangents that are continuous across the surface. That
+		   means that this code will need to be modified to be able
+		   use anisotropic BRDFs, which need tangent continuity */
+
+		its.shFrame = Frame(
+			(bary.x() * mesh->getVertexNormal(idx0) +
+			 bary.y() * mesh->getVertexNormal(idx1) +
+			 bary.z() * mesh->getVertexNormal(idx2)).normalized());
+	} else {
+		its.shFrame = its.geoFrame;
+	}
+}
+
+NORI_NAMESPACE_END
@@ -50,6 +50,26 @@ public:
 		if (!scene->rayIntersect(ray, its))
 			return Color3f(0.0f);
 
+		return occlusion(scene, sampler, its);
+	}
+
+	Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &,
+			bool hit, const Intersection &its) const {
+		if (!hit)
+			return Color3f(0.0f);
+
+		return occlusion(scene, sampler, its);
+	}
+
+	/// The visible surface is found using packets of camera rays
+	bool usesPrimaryHits() const { return true; }
+
+	QString toString() const {
+		return QString("AmbientOcclusion[length=%1]").arg(m_length);
+	}
+private:
+	/// Estimate the ambient occlusion at a surface position
+	Color3f occlusion(const Scene *scene, Sampler *sampler, const Intersection &its) const {
 		/* Sample (naively) from the hemisphere (local coordinates) */
 		Vector3f d = hemisphereSampling(sampler->next2D());
 
@@ -64,13 +84,9 @@ public:
 		Ray3f shadowRay(its.p, d, Epsilon, length);
 
 		/* Perform an occlusion test and return one or zero depending on the result */
-		return Color3f(scene->rayIntersect(shadowRay) ? 0.0f : 1.0f);
+		return Color3f(scene->occluded(shadowRay) ? 0.0f : 1.0f);
 	}
 
-	QString toString() const {
-		return QString("AmbientOcclusion[length=%1]").arg(m_length);
-	}
-private:
 	float m_length;
 };
 
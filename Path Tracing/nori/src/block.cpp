@@ -199,6 +199,44 @@ void BlockRenderThread::run() {
 			/* Clear its contents */
 			block.clear();
 	
+			if (integrator->usesPrimaryHits()) {
+				/* Trace the camera rays of small pixel tiles in packets
+				   and hand the resulting intersections to the integrator */
+				RayPacketN packet;
+				Point2f pixelSamples[NORI_PACKET_SIZE], apertureSamples[NORI_PACKET_SIZE];
+				Color3f weights[NORI_PACKET_SIZE];
+
+				for (int ty=0; ty<size.y(); ty += NORI_PACKET_TILE) {
+					for (int tx=0; tx<size.x(); tx += NORI_PACKET_TILE) {
+						int tileEndX = std::min(tx + NORI_PACKET_TILE, size.x()),
+						    tileEndY = std::min(ty + NORI_PACKET_TILE, size.y());
+
+						for (uint32_t i=0; i<m_sampler->getSampleCount(); ++i) {
+							packet.count = 0;
+							for (int y=ty; y<tileEndY; ++y) {
+								for (int x=tx; x<tileEndX; ++x) {
+									pixelSamples[packet.count] = Point2f(x + offset.x(), y + offset.y()) + m_sampler->next2D();
+									apertureSamples[packet.count] = m_sampler->next2D();
+									++packet.count;
+								}
+							}
+
+							camera->sampleRayPacket(packet, weights, pixelSamples, apertureSamples);
+							m_scene->rayIntersectPacket(packet);
+
+							for (uint32_t j=0; j<packet.count; ++j) {
+								Color3f value = weights[j] * integrator->LiPrimary(m_scene,
+									m_sampler, packet.rays[j], packet.hit[j], packet.its[j]);
+								block.put(pixelSamples[j], value);
+							}
+						}
+					}
+				}
+
+				m_output->put(block);
+				continue;
+			}
+
 			/* For each pixel and pixel sample sample */
 			for (int y=0; y<size.y(); ++y) {
 				for (int x=0; x<size.x(); ++x) {
@@ -0,0 +1,669 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <QElapsedTimer>
+
+NORI_NAMESPACE_BEGIN
+
+/// Predicate used to partition the primitives of a node by centroid bin
+struct BinPredicate {
+	int axis, splitBin, binCount;
+	float min, scale;
+
+	template <typename Primitive> inline bool operator()(const Primitive &prim) const {
+		int bin = (int) ((prim.centroid[axis] - min) * scale);
+		return std::min(bin, binCount - 1) < splitBin;
+	}
+};
+
+/// Predicate used to split the primitives of a node at the median centroid
+struct CentroidPredicate {
+	int axis;
+
+	template <typename Primitive> inline bool operator()(const Primitive &a,
+			const Primitive &b) const {
+		return a.centroid[axis] < b.centroid[axis];
+	}
+};
+
+BVH::BVH(const PropertyList &propList) : m_packetBuffer(true), m_maxDepth(0), m_leafCount(0) {
+	/* Cost of a ray-box test, relative to the cost of a ray-triangle test */
+	m_traversalCost = propList.getFloat("traversalCost", 15);
+	m_queryCost = propList.getFloat("queryCost", 20);
+
+	/* Number of candidate split planes per axis */
+	m_binCount = propList.getInteger("binCount", 16);
+
+	/* Nodes with more primitives than this are always split */
+	m_maxLeafSize = propList.getInteger("maxLeafSize", 8);
+
+	/* Quantize the node bounds and drop the leaf-ordered triangle buffer? */
+	m_compressed = propList.getBoolean("compressed", false);
+
+	/* Rebuild instead of refitting once the SAH cost grows by this factor */
+	m_rebuildThreshold = propList.getFloat("rebuildThreshold", 1.5f);
+
+	if (m_traversalCost <= 0)
+		throw NoriException("The traveral cost must be > 0");
+	if (m_queryCost <= 0)
+		throw NoriException("The query cost must be > 0");
+	if (m_binCount < 2 || m_binCount > NORI_BVH_MAXBINS)
+		throw NoriException(QString("The number of bins must be in [2, %1]")
+			.arg(NORI_BVH_MAXBINS));
+	if (m_maxLeafSize < 1 || m_maxLeafSize > 0xFFFF)
+		throw NoriException("The maximum leaf size must be in [1, 65535]");
+	if (m_rebuildThreshold < 1)
+		throw NoriException("The rebuild threshold must be >= 1");
+}
+
+BVH::~BVH() {
+}
+
+void BVH::build() {
+	/* The nodes address the triangles using 32-bit offsets */
+	if (getPrimitiveCount() > (IndexType) 0xFFFFFFFFu)
+		throw NoriException("BVH::build(): the scene contains more than 2^32-1 triangles, "
+			"which is only supported by the kd-tree!");
+
+	uint32_t primCount = (uint32_t) getPrimitiveCount();
+	cout << "Constructing a binned SAH BVH (" << primCount << " triangles, "
+		 << m_binCount << " bins) .." << endl;
+
+	if (!m_nodes.empty())
+		throw NoriException("The BVH has already been built!");
+
+	m_bbox.reset();
+	if (primCount == 0) {
+		cout << "Warning: BVH contains no geometry!" << endl;
+		return;
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+
+	BuildPrimitive *prims = new BuildPrimitive[primCount];
+	for (uint32_t i=0; i<primCount; ++i) {
+		IndexType primIndex = i;
+		uint32_t meshIdx = findMesh(primIndex);
+		BuildPrimitive &prim = prims[i];
+		prim.bbox = m_meshes[meshIdx]->getBoundingBox(primIndex);
+		prim.centroid = prim.bbox.getCenter();
+		prim.index = i;
+		m_bbox.expandBy(prim.bbox);
+	}
+
+	m_nodes.reserve(2 * primCount);
+	m_indices.reserve(primCount);
+	buildHierarchy(prims, primCount);
+	delete[] prims;
+
+	/* Release the excess capacity */
+	std::vector<BVHNode>(m_nodes).swap(m_nodes);
+	size_t nodeCount = m_nodes.size(), memory;
+	m_buildCost = computeCost();
+
+	if (m_compressed) {
+		if (m_nodes.size() > QuantizedBVHNode::EOffsetMask ||
+			m_indices.size() > QuantizedBVHNode::EOffsetMask)
+			throw NoriException("BVH::build(): the scene is too large for the compressed representation!");
+
+		m_quantizedNodes.resize(m_nodes.size());
+		compressRecursive(0, m_bbox);
+
+		/* The uncompressed nodes are no longer needed */
+		std::vector<BVHNode>().swap(m_nodes);
+		memory = nodeCount * sizeof(QuantizedBVHNode) + m_indices.size() * sizeof(IndexType);
+	} else {
+		/* Copy the triangles into leaf order and pack them for SIMD tests */
+		createTriangleBuffer(&m_indices[0], m_indices.size());
+		if (m_packetBuffer) {
+			std::vector<std::pair<IndexType, IndexType> > leaves;
+			for (size_t i=0; i<m_nodes.size(); ++i) {
+				if (m_nodes[i].isLeaf())
+					leaves.push_back(std::make_pair(m_nodes[i].offset,
+						m_nodes[i].offset + m_nodes[i].primCount));
+			}
+			createPacketBuffer(leaves);
+		}
+		memory = nodeCount * sizeof(BVHNode) + m_indices.size() * sizeof(IndexType)
+			+ getTriangleBufferSize();
+	}
+
+	cout << "Finished after " << timer.elapsed() << " ms (" << nodeCount
+		<< " nodes, " << m_leafCount << " leaves, max. depth " << m_maxDepth << ")" << endl
+		<< "The final " << (m_compressed ? "compressed " : "") << "BVH requires "
+		<< memory / 1024 << " KiB of memory ("
+		<< qPrintable(QString::number(memory / (double) primCount, 'f', 1)) << " bytes per triangle)" << endl;
+}
+
+void BVH::compressRecursive(uint32_t nodeIdx, const BoundingBox3f &bbox) {
+	const BVHNode &node = m_nodes[nodeIdx];
+	QuantizedBVHNode &qnode = m_quantizedNodes[nodeIdx];
+
+	if (node.isLeaf()) {
+		qnode.primCount = node.primCount;
+		qnode.data = ((uint32_t) QuantizedBVHNode::ELeaf << 30) | node.offset;
+		return;
+	}
+
+	uint32_t children[2] = { nodeIdx + 1, node.offset };
+	BoundingBox3f childBBox[2];
+
+	for (int c=0; c<2; ++c) {
+		const BoundingBox3f &exact = m_nodes[children[c]].bbox;
+		QuantizedBounds &q = qnode.child[c];
+
+		for (int i=0; i<3; ++i) {
+			float scale = (bbox.max[i] - bbox.min[i]) * (1.0f / 255.0f);
+			int lo = 0, hi = 255;
+			if (scale > 0) {
+				lo = std::max(0, std::min(255, (int) std::floor((exact.min[i] - bbox.min[i]) / scale)));
+				hi = std::max(0, std::min(255, 255 - (int) std::floor((bbox.max[i] - exact.max[i]) / scale)));
+			}
+			q.min[i] = (uint8_t) lo;
+			q.max[i] = (uint8_t) hi;
+		}
+
+		/* Widen the quantized bounds until they conservatively contain
+		   the exact ones (using the same arithmetic as the traversal) */
+		while (true) {
+			childBBox[c] = dequantize(bbox, q);
+			bool done = true;
+			for (int i=0; i<3; ++i) {
+				if (childBBox[c].min[i] > exact.min[i] && q.min[i] > 0) {
+					q.min[i]--; done = false;
+				}
+				if (childBBox[c].max[i] < exact.max[i] && q.max[i] < 255) {
+					q.max[i]++; done = false;
+				}
+			}
+			if (done)
+				break;
+		}
+	}
+
+	qnode.data = ((uint32_t) node.axis << 30) | node.offset;
+	compressRecursive(children[0], childBBox[0]);
+	compressRecursive(children[1], childBBox[1]);
+}
+
+void BVH::clear() {
+	std::vector<BVHNode>().swap(m_nodes);
+	std::vector<QuantizedBVHNode>().swap(m_quantizedNodes);
+	std::vector<IndexType>().swap(m_indices);
+	m_maxDepth = m_leafCount = 0;
+	Accel::clear();
+}
+
+float BVH::computeCost() const {
+	if (m_nodes.empty())
+		return 0.0f;
+
+	float invRootArea = 1.0f / std::max(m_nodes[0].bbox.getSurfaceArea(),
+		std::numeric_limits<float>::min());
+	float cost = 0.0f;
+	for (size_t i=0; i<m_nodes.size(); ++i) {
+		const BVHNode &node = m_nodes[i];
+		float weight = node.bbox.getSurfaceArea() * invRootArea;
+		cost += weight * (node.isLeaf() ? m_queryCost * node.primCount : m_traversalCost);
+	}
+	return cost;
+}
+
+void BVH::update(const std::vector<const Mesh *> &changed) {
+	if (m_nodes.empty()) {
+		/* Compressed, collapsed (see \ref MBVH) or empty hierarchy */
+		Accel::update(changed);
+		return;
+	}
+
+	QElapsedTimer timer;
+	timer.start();
+
+	std::vector<bool> changedMeshes(m_meshes.size(), false);
+	bool any = false;
+	for (size_t i=0; i<changed.size(); ++i) {
+		std::vector<Mesh *>::const_iterator it =
+			std::find(m_meshes.begin(), m_meshes.end(), changed[i]);
+		if (it != m_meshes.end()) {
+			changedMeshes[it - m_meshes.begin()] = true;
+			any = true;
+		}
+	}
+	if (!any)
+		return;
+
+	/* Refit bottom-up -- the children of a node are always stored after it */
+	std::vector<bool> refitted(m_nodes.size(), false);
+	uint32_t refitCount = 0;
+	for (size_t i=m_nodes.size(); i-- > 0; ) {
+		BVHNode &node = m_nodes[i];
+
+		if (node.isLeaf()) {
+			bool affected = false;
+			for (uint32_t j=node.offset; j<node.offset + node.primCount && !affected; ++j) {
+				IndexType primIndex = m_indices[j];
+				affected = changedMeshes[findMesh(primIndex)];
+			}
+			if (!affected)
+				continue;
+
+			node.bbox.reset();
+			for (uint32_t j=node.offset; j<node.offset + node.primCount; ++j) {
+				IndexType primIndex = m_indices[j];
+				uint32_t meshIdx = findMesh(primIndex);
+				node.bbox.expandBy(m_meshes[meshIdx]->getBoundingBox(primIndex));
+			}
+		} else {
+			if (!refitted[i+1] && !refitted[node.offset])
+				continue;
+			node.bbox = m_nodes[i+1].bbox;
+			node.bbox.expandBy(m_nodes[node.offset].bbox);
+		}
+		refitted[i] = true;
+		refitCount++;
+	}
+	m_bbox = m_nodes[0].bbox;
+
+	float cost = computeCost();
+	if (cost > m_rebuildThreshold * m_buildCost) {
+		cout << "Refitting increased the SAH cost of the BVH from " << m_buildCost
+			<< " to " << cost << " -- rebuilding .." << endl;
+		Accel::update(changed);
+		return;
+	}
+
+	updateTriangleBuffer(changedMeshes);
+
+	cout << "Refitted " << refitCount << " of " << m_nodes.size() << " BVH nodes after "
+		<< timer.elapsed() << " ms (SAH cost " << m_buildCost << " -> " << cost << ")" << endl;
+}
+
+void BVH::buildHierarchy(BuildPrimitive *prims, uint32_t primCount) {
+	buildRecursive(prims, 0, primCount, 0);
+}
+
+void BVH::createLeaf(uint32_t nodeIdx, BuildPrimitive *prims,
+		uint32_t start, uint32_t end) {
+	if (end - start > 0xFFFF)
+		throw NoriException("BVH::build(): leaf node is too large -- "
+			"exceeded the maximum tree depth?");
+
+	BVHNode &node = m_nodes[nodeIdx];
+	node.offset = (uint32_t) m_indices.size();
+	node.primCount = (uint16_t) (end - start);
+	node.axis = 0;
+	for (uint32_t i=start; i<end; ++i)
+		m_indices.push_back(prims[i].index);
+	m_leafCount++;
+}
+
+void BVH::buildRecursive(BuildPrimitive *prims, uint32_t start,
+		uint32_t end, uint32_t depth) {
+	uint32_t nodeIdx = (uint32_t) m_nodes.size();
+	m_nodes.push_back(BVHNode());
+	m_maxDepth = std::max(m_maxDepth, depth);
+
+	BoundingBox3f bbox, centroidBBox;
+	for (uint32_t i=start; i<end; ++i) {
+		bbox.expandBy(prims[i].bbox);
+		centroidBBox.expandBy(prims[i].centroid);
+	}
+	m_nodes[nodeIdx].bbox = bbox;
+
+	uint32_t primCount = end - start;
+	if (primCount == 1 || depth + 1 >= NORI_BVH_MAXDEPTH) {
+		createLeaf(nodeIdx, prims, start, end);
+		return;
+	}
+
+	if (deferSubtree(nodeIdx, prims, start, end, depth))
+		return;
+
+	/* Evaluate the SAH at the boundaries between bins along each axis */
+	struct Bin {
+		BoundingBox3f bbox;
+		uint32_t count;
+	} bins[NORI_BVH_MAXBINS];
+
+	float rightArea[NORI_BVH_MAXBINS];
+	uint32_t rightCount[NORI_BVH_MAXBINS];
+	float nodeArea = bbox.getSurfaceArea(),
+	      invNodeArea = nodeArea > 0 ? 1.0f / nodeArea : 0.0f;
+	float bestCost = std::numeric_limits<float>::infinity();
+	int bestAxis = -1, bestBin = -1;
+
+	for (int axis=0; axis<3; ++axis) {
+		float min = centroidBBox.min[axis],
+		      extent = centroidBBox.max[axis] - min;
+		if (extent <= 0)
+			continue;
+		float scale = m_binCount / extent;
+
+		for (int i=0; i<m_binCount; ++i) {
+			bins[i].bbox.reset();
+			bins[i].count = 0;
+		}
+
+		for (uint32_t i=start; i<end; ++i) {
+			int bin = std::min((int) ((prims[i].centroid[axis] - min) * scale), m_binCount - 1);
+			bins[bin].bbox.expandBy(prims[i].bbox);
+			bins[bin].count++;
+		}
+
+		/* Sweep from the right to compute the right-side quantities */
+		BoundingBox3f accum;
+		uint32_t count = 0;
+		for (int i=m_binCount-1; i>0; --i) {
+			accum.expandBy(bins[i].bbox);
+			count += bins[i].count;
+			rightArea[i] = count > 0 ? accum.getSurfaceArea() : 0.0f;
+			rightCount[i] = count;
+		}
+
+		/* Sweep from the left and evaluate the cost of each plane */
+		accum.reset();
+		count = 0;
+		for (int i=1; i<m_binCount; ++i) {
+			accum.expandBy(bins[i-1].bbox);
+			count += bins[i-1].count;
+			if (count == 0 || rightCount[i] == 0)
+				continue;
+			float cost = m_traversalCost + m_queryCost * invNodeArea *
+				(accum.getSurfaceArea() * count + rightArea[i] * rightCount[i]);
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = i;
+			}
+		}
+	}
+
+	uint32_t mid;
+	if (bestAxis == -1) {
+		/* All centroids coincide -- no SAH split is possible */
+		if (primCount <= (uint32_t) m_maxLeafSize) {
+			createLeaf(nodeIdx, prims, start, end);
+			return;
+		}
+		mid = start + primCount / 2;
+	} else {
+		if (bestCost >= m_queryCost * primCount && primCount <= (uint32_t) m_maxLeafSize) {
+			createLeaf(nodeIdx, prims, start, end);
+			return;
+		}
+
+		BinPredicate pred;
+		pred.axis = bestAxis;
+		pred.splitBin = bestBin;
+		pred.binCount = m_binCount;
+		pred.min = centroidBBox.min[bestAxis];
+		pred.scale = m_binCount / (centroidBBox.max[bestAxis] - pred.min);
+		mid = (uint32_t) (std::partition(prims + start, prims + end, pred) - prims);
+
+		if (mid == start || mid == end) {
+			/* Numerical corner case -- fall back to a median split */
+			CentroidPredicate cpred;
+			cpred.axis = bestAxis;
+			mid = start + primCount / 2;
+			std::nth_element(prims + start, prims + mid, prims + end, cpred);
+		}
+	}
+
+	m_nodes[nodeIdx].primCount = 0;
+	m_nodes[nodeIdx].axis = (uint8_t) std::max(bestAxis, 0);
+	buildRecursive(prims, start, mid, depth + 1);
+	m_nodes[nodeIdx].offset = (uint32_t) m_nodes.size();
+	buildRecursive(prims, mid, end, depth + 1);
+}
+
+bool BVH::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const {
+	if (m_compressed)
+		return rayIntersectCompressed(ray, its, shadowRay);
+
+	its.t = std::numeric_limits<float>::infinity();
+
+	if (m_nodes.empty())
+		return false;
+
+	/* Use an adaptive ray epsilon */
+	float mint = ray.mint, maxt = ray.maxt;
+	if (mint == Epsilon)
+		mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
+
+	if (maxt < mint)
+		return false;
+
+	/* Traversal stack holding the far children */
+	uint32_t stack[NORI_BVH_MAXDEPTH];
+	uint32_t stackPos = 0, nodeIdx = 0;
+
+	bool foundIntersection = false;
+	IndexType foundPrimIndex = 0;
+
+	while (true) {
+		const BVHNode &node = m_nodes[nodeIdx];
+
+		if (intersectBox(node.bbox, ray, mint, maxt)) {
+			if (EXPECT_TAKEN(!node.isLeaf())) {
+				/* Visit the near child first */
+				if (ray.d[node.axis] < 0) {
+					stack[stackPos++] = nodeIdx + 1;
+					nodeIdx = node.offset;
+				} else {
+					stack[stackPos++] = node.offset;
+					nodeIdx = nodeIdx + 1;
+				}
+				continue;
+			}
+
+			if (intersectLeaf(node.offset, node.offset + node.primCount,
+					ray, mint, maxt, shadowRay, its, foundPrimIndex)) {
+				if (shadowRay)
+					return true;
+				foundIntersection = true;
+			}
+		}
+
+		if (stackPos == 0)
+			break;
+		nodeIdx = stack[--stackPos];
+	}
+
+	if (foundIntersection && !shadowRay)
+		fillIntersection(foundPrimIndex, its);
+
+	return foundIntersection;
+}
+
+bool BVH::findOccluder(const Ray3f &ray, float mint, float maxt, IndexType &entry) const {
+	if (m_compressed)
+		return findOccluderCompressed(ray, mint, maxt);
+
+	if (m_nodes.empty())
+		return false;
+
+	/* Any hit will do -- the children are visited in memory order */
+	uint32_t stack[NORI_BVH_MAXDEPTH];
+	uint32_t stackPos = 0, nodeIdx = 0;
+
+	while (true) {
+		const BVHNode &node = m_nodes[nodeIdx];
+
+		if (intersectBox(node.bbox, ray, mint, maxt)) {
+			if (EXPECT_TAKEN(!node.isLeaf())) {
+				stack[stackPos++] = node.offset;
+				nodeIdx = nodeIdx + 1;
+				continue;
+			}
+
+			if (occludedLeaf(node.offset, node.offset + node.primCount,
+					ray, mint, maxt, entry))
+				return true;
+		}
+
+		if (stackPos == 0)
+			break;
+		nodeIdx = stack[--stackPos];
+	}
+
+	return false;
+}
+
+bool BVH::rayIntersectCompressed(const Ray3f &ray, Intersection &its, bool shadowRay) const {
+	its.t = std::numeric_limits<float>::infinity();
+
+	if (m_quantizedNodes.empty())
+		return false;
+
+	/* Use an adaptive ray epsilon */
+	float mint = ray.mint, maxt = ray.maxt;
+	if (mint == Epsilon)
+		mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
+
+	if (maxt < mint || !intersectBox(m_bbox, ray, mint, maxt))
+		return false;
+
+	/* Traversal stack holding the far children along with their bounds */
+	struct StackEntry {
+		uint32_t nodeIdx;
+		BoundingBox3f bbox;
+	} stack[NORI_BVH_MAXDEPTH];
+	uint32_t stackPos = 0, nodeIdx = 0;
+	BoundingBox3f bbox = m_bbox;
+
+	bool foundIntersection = false;
+	IndexType foundPrimIndex = 0;
+
+	while (true) {
+		const QuantizedBVHNode &node = m_quantizedNodes[nodeIdx];
+
+		if (EXPECT_TAKEN(!node.isLeaf())) {
+			/* Both children are tested here, since their bounds are
+			   only known relative to those of the current node */
+			BoundingBox3f left = dequantize(bbox, node.child[0]),
+			              right = dequantize(bbox, node.child[1]);
+			bool hitLeft = intersectBox(left, ray, mint, maxt),
+			     hitRight = intersectBox(right, ray, mint, maxt);
+
+			if (hitLeft && hitRight) {
+				/* Visit the near child first */
+				StackEntry &entry = stack[stackPos++];
+				if (ray.d[node.getAxis()] < 0) {
+					entry.nodeIdx = nodeIdx + 1; entry.bbox = left;
+					nodeIdx = node.getOffset(); bbox = right;
+				} else {
+					entry.nodeIdx = node.getOffset(); entry.bbox = right;
+					nodeIdx = nodeIdx + 1; bbox = left;
+				}
+				continue;
+			} else if (hitLeft) {
+				nodeIdx = nodeIdx + 1; bbox = left;
+				continue;
+			} else if (hitRight) {
+				nodeIdx = node.getOffset(); bbox = right;
+				continue;
+			}
+		} else {
+			uint32_t start = node.getOffset();
+			if (intersectCompactLeaf(start, start + node.primCount, ray,
+					mint, maxt, shadowRay, its, foundPrimIndex)) {
+				if (shadowRay)
+					return true;
+				foundIntersection = true;
+			}
+		}
+
+		/* Skip far children that lie beyond the closest hit found so far */
+		bool found = false;
+		while (stackPos > 0 && !found)
+			found = intersectBox(stack[--stackPos].bbox, ray, mint, maxt);
+		if (!found)
+			break;
+		nodeIdx = stack[stackPos].nodeIdx;
+		bbox = stack[stackPos].bbox;
+	}
+
+	if (foundIntersection)
+		fillIntersection(foundPrimIndex, its);
+
+	return foundIntersection;
+}
+
+bool BVH::findOccluderCompressed(const Ray3f &ray, float mint, float maxt) const {
+	if (m_quantizedNodes.empty() || !intersectBox(m_bbox, ray, mint, maxt))
+		return false;
+
+	struct StackEntry {
+		uint32_t nodeIdx;
+		BoundingBox3f bbox;
+	} stack[NORI_BVH_MAXDEPTH];
+	uint32_t stackPos = 0, nodeIdx = 0;
+	BoundingBox3f bbox = m_bbox;
+	Intersection its; /* Unused */
+	IndexType primIndex;
+
+	while (true) {
+		const QuantizedBVHNode &node = m_quantizedNodes[nodeIdx];
+
+		if (EXPECT_TAKEN(!node.isLeaf())) {
+			BoundingBox3f left = dequantize(bbox, node.child[0]),
+			              right = dequantize(bbox, node.child[1]);
+			bool hitLeft = intersectBox(left, ray, mint, maxt),
+			     hitRight = intersectBox(right, ray, mint, maxt);
+
+			if (hitLeft) {
+				if (hitRight) {
+					stack[stackPos].nodeIdx = node.getOffset();
+					stack[stackPos++].bbox = right;
+				}
+				nodeIdx = nodeIdx + 1; bbox = left;
+				continue;
+			} else if (hitRight) {
+				nodeIdx = node.getOffset(); bbox = right;
+				continue;
+			}
+		} else {
+			uint32_t start = node.getOffset();
+			if (intersectCompactLeaf(start, start + node.primCount, ray,
+					mint, maxt, true, its, primIndex))
+				return true;
+		}
+
+		if (stackPos == 0)
+			break;
+		--stackPos;
+		nodeIdx = stack[stackPos].nodeIdx;
+		bbox = stack[stackPos].bbox;
+	}
+
+	return false;
+}
+
+QString BVH::toString() const {
+	return QString("BVH[traversalCost=%1, queryCost=%2, binCount=%3, maxLeafSize=%4, compressed=%5]")
+		.arg(m_traversalCost)
+		.arg(m_queryCost)
+		.arg(m_binCount)
+		.arg(m_maxLeafSize)
+		.arg(m_compressed ? "true" : "false");
+}
+
+NORI_REGISTER_CLASS(BVH, "bvh");
+NORI_NAMESPACE_END
@@ -2,6 +2,7 @@
 #include <Eigen/Geometry>
 #include <Eigen/LU>
 #include <boost/math/special_functions/fpclassify.hpp>
+#include <QFile>
 
 #if defined(PLATFORM_LINUX)
 #include <malloc.h>
@@ -9,6 +10,10 @@
 
 #if defined(PLATFORM_WINDOWS)
 #include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
 #endif
 
 #if defined(PLATFORM_MACOS)
@@ -71,6 +76,11 @@ float Color3f::getLuminance() const {
 Transform::Transform(const Eigen::Matrix4f &trafo) 
 	: m_transform(trafo), m_inverse(trafo.inverse()) { }
 
+Transform Transform::operator*(const Transform &t) const {
+	return Transform(m_transform * t.m_transform,
+		t.m_inverse * m_inverse);
+}
+
 QString Transform::toString() const {
 	std::ostringstream oss;
 	oss << m_transform.format(Eigen::IOFormat(4, 0, ", ", ";\n", "", "", "[", "]"));
@@ -242,6 +252,49 @@ int getCoreCount() {
 #endif
 }
 
+size_t getPeakMemoryUsage() {
+#if defined(PLATFORM_WINDOWS)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return (size_t) counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#if defined(PLATFORM_MACOS)
+	return (size_t) usage.ru_maxrss; /* bytes */
+#else
+	return (size_t) usage.ru_maxrss * 1024; /* KiB */
+#endif
+#endif
+}
+
+QString getHostName() {
+#if defined(PLATFORM_WINDOWS)
+	char name[MAX_COMPUTERNAME_LENGTH + 1];
+	DWORD size = sizeof(name);
+	if (!GetComputerNameA(name, &size))
+		return QString("localhost");
+#else
+	char name[256];
+	if (gethostname(name, sizeof(name)) != 0)
+		return QString("localhost");
+	name[sizeof(name) - 1] = '\0';
+#endif
+	return QString(name);
+}
+
+bool writeCacheSection(QFile &file, uint64_t offset, const void *data, size_t size) {
+	static const char zeros[64] = { 0 };
+	if ((uint64_t) file.pos() > offset)
+		return false;
+	size_t padding = (size_t) (offset - file.pos());
+	if (padding > 0 && file.write(zeros, padding) != (qint64) padding)
+		return false;
+	return size == 0 || file.write(static_cast<const char *>(data), size) == (qint64) size;
+}
+
 QString indent(const QString &string, int amount) {
 	QString result = string;
 	result.replace("\n", QString("\n") + QString(" ").repeated(amount));
@@ -33,7 +33,27 @@ public:
 		Intersection its;
 		if (!scene->rayIntersect(ray, its))
 			return Color3f(0.0f);
-                
+
+		return shade(its);
+	}
+
+	Color3f LiPrimary(const Scene *, Sampler *, const Ray3f &,
+			bool hit, const Intersection &its) const {
+		if (!hit)
+			return Color3f(0.0f);
+
+		return shade(its);
+	}
+
+	/// The visible surface is found using packets of camera rays
+	bool usesPrimaryHits() const { return true; }
+
+	QString toString() const {
+		return QString("Depth[near=%1, far=%2, Ka=%3]").arg(m_near).arg(m_far).arg(m_Ka);
+	}
+private:
+	/// Map the distance to the visible surface to an intensity
+	Color3f shade(const Intersection &its) const {
                 // Computation of the distance
                 float depth = its.t;
 
@@ -42,10 +62,6 @@ public:
 		return Color3f(m_Ka + (1.0f - m_Ka) * std::pow(Kd, m_gamma));
 	}
 
-	QString toString() const {
-		return QString("Depth[near=%1, far=%2, Ka=%3]").arg(m_near).arg(m_far).arg(m_Ka);
-	}
-private:
 	float m_near, m_far, m_Ka, m_gamma; // m_length;
 };
 
@@ -51,12 +51,12 @@ parent(p), meshName(mesh->getName()), valid(true), item(item_) {
         // i => linear access to indices
         // idx(i) => linear access to vertices (full)
         // idx(i) * 3 => linear access to vertex::x of [x0, y0, z0, x1, y1, z1 ... xk, yk, zk]
-        indexBuffer[i] = mesh->getIndices()[i] * 3;
+        indexBuffer[i] = mesh->getIndex(i) * 3;
     }
     // normals
-    if (mesh->getVertexNormals() != NULL) {
+    if (mesh->hasVertexNormals()) {
         for (GLuint v = 0, i = 0; v < dataCount; ++v, i += 3) {
-            const Normal3f n = (transform.inverse() * mesh->getVertexNormals()[v]).normalized();
+            const Normal3f n = (transform.inverse() * mesh->getVertexNormal(v)).normalized();
             normalBuffer[i + 0] = n(0);
             normalBuffer[i + 1] = n(1);
             normalBuffer[i + 2] = n(2);
@@ -66,9 +66,9 @@ parent(p), meshName(mesh->getName()), valid(true), item(item_) {
         Normal3f *vn = new Normal3f[dataCount];
         GLuint *c = new GLuint[dataCount];
         for (GLuint i = 0; i < indexCount; i += 3) {
-            GLuint i0 = mesh->getIndices()[i],
-                    i1 = mesh->getIndices()[i + 1],
-                    i2 = mesh->getIndices()[i + 2];
+            GLuint i0 = mesh->getIndex(i),
+                    i1 = mesh->getIndex(i + 1),
+                    i2 = mesh->getIndex(i + 2);
             const Point3f &p0 = mesh->getVertexPositions()[i0];
             const Point3f &p1 = mesh->getVertexPositions()[i1];
             const Point3f &p2 = mesh->getVertexPositions()[i2];
@@ -0,0 +1,399 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/instance.h>
+#include <QElapsedTimer>
+
+NORI_NAMESPACE_BEGIN
+
+Instance::Instance(const PropertyList &propList) : m_mesh(NULL) {
+	m_toWorld = propList.getTransform("toWorld", Transform());
+	m_toLocal = m_toWorld.inverse();
+}
+
+void Instance::addChild(NoriObject *obj) {
+	switch (obj->getClassType()) {
+		case EMesh:
+			if (m_mesh)
+				throw NoriException("Instance: tried to register multiple meshes!");
+			m_mesh = static_cast<Mesh *>(obj);
+			if (m_mesh->getId().isEmpty())
+				throw NoriException("Instance: only meshes with an \"id\" attribute can be instanced!");
+			break;
+
+		default:
+			throw NoriException(QString("Instance::addChild(<%1>) is not supported!").arg(
+				classTypeName(obj->getClassType())));
+	}
+}
+
+void Instance::activate() {
+	if (!m_mesh)
+		throw NoriException("Instance: no mesh was specified (use <ref id=\"..\"/>)!");
+}
+
+QString Instance::toString() const {
+	return QString(
+		"Instance[\n"
+		"  mesh = \"%1\",\n"
+		"  toWorld = %2\n"
+		"]")
+	.arg(m_mesh ? m_mesh->getId() : QString("null"))
+	.arg(indent(m_toWorld.toString()));
+}
+
+InstanceAccel::InstanceAccel(Accel *world) : m_world(world) { }
+
+InstanceAccel::~InstanceAccel() {
+	delete m_world;
+	for (std::map<const Mesh *, Accel *>::iterator it = m_blas.begin();
+			it != m_blas.end(); ++it)
+		delete it->second;
+}
+
+void InstanceAccel::addInstance(const Instance *instance) {
+	InstanceEntry entry;
+	entry.instance = instance;
+	entry.accel = NULL;
+	m_entries.push_back(entry);
+}
+
+void InstanceAccel::build() {
+	QElapsedTimer timer;
+	timer.start();
+
+	/* Meshes that are not instanced */
+	m_bbox.reset();
+	if (m_world->getPrimitiveCount() > 0) {
+		m_world->build();
+		m_bbox.expandBy(m_world->getBoundingBox());
+	}
+
+	/* One bottom-level accelerator per shared mesh */
+	for (size_t i=0; i<m_entries.size(); ++i) {
+		const Mesh *mesh = m_entries[i].instance->getMesh();
+		if (m_blas.find(mesh) != m_blas.end())
+			continue;
+		Accel *accel = static_cast<Accel *>(
+			NoriObjectFactory::createInstance("kdtree", PropertyList()));
+		accel->addMesh(const_cast<Mesh *>(mesh));
+		cout << "Building the bottom-level accelerator of \""
+			<< qPrintable(mesh->getId()) << "\" .." << endl;
+		accel->build();
+		m_blas[mesh] = accel;
+	}
+
+	m_primitiveCount = m_world->getPrimitiveCount();
+	for (size_t i=0; i<m_entries.size(); ++i) {
+		InstanceEntry &entry = m_entries[i];
+		entry.accel = m_blas[entry.instance->getMesh()];
+		m_primitiveCount += entry.accel->getPrimitiveCount();
+	}
+
+	buildTopLevel();
+
+	cout << "Built the top-level hierarchy over " << m_entries.size() << " instances of "
+		<< m_blas.size() << " meshes after " << timer.elapsed() << " ms ("
+		<< m_primitiveCount << " triangles in total)" << endl;
+}
+
+void InstanceAccel::update(const std::vector<const Mesh *> &changed) {
+	/* Meshes that are not instanced */
+	std::vector<const Mesh *> worldChanged;
+	for (size_t i=0; i<changed.size(); ++i) {
+		for (uint32_t j=0; j<m_world->getMeshCount(); ++j) {
+			if (m_world->getMesh(j) == changed[i]) {
+				worldChanged.push_back(changed[i]);
+				break;
+			}
+		}
+	}
+	if (!worldChanged.empty())
+		m_world->update(worldChanged);
+
+	/* Shared meshes */
+	bool blasChanged = false;
+	for (size_t i=0; i<changed.size(); ++i) {
+		std::map<const Mesh *, Accel *>::iterator it = m_blas.find(changed[i]);
+		if (it == m_blas.end())
+			continue;
+		it->second->update(std::vector<const Mesh *>(1, changed[i]));
+		blasChanged = true;
+	}
+
+	if (worldChanged.empty() && !blasChanged)
+		return;
+
+	m_bbox.reset();
+	if (m_world->getPrimitiveCount() > 0)
+		m_bbox.expandBy(m_world->getBoundingBox());
+	buildTopLevel();
+}
+
+void InstanceAccel::buildTopLevel() {
+	for (size_t i=0; i<m_entries.size(); ++i) {
+		InstanceEntry &entry = m_entries[i];
+
+		/* World-space bounds of the transformed object-space bounds */
+		const BoundingBox3f &bbox = entry.accel->getBoundingBox();
+		const Transform &trafo = entry.instance->getTransform();
+		entry.bbox.reset();
+		if (bbox.isValid()) {
+			for (int j=0; j<8; ++j)
+				entry.bbox.expandBy(trafo * bbox.getCorner(j));
+		}
+		m_bbox.expandBy(entry.bbox);
+	}
+
+	m_nodes.clear();
+	if (!m_entries.empty()) {
+		m_nodes.reserve(2 * m_entries.size());
+		buildRecursive(0, (uint32_t) m_entries.size(), 0);
+	}
+}
+
+namespace {
+	/// Sort instances by the center of their bounds along an axis
+	struct InstanceCenterOrder {
+		int axis;
+		inline InstanceCenterOrder(int axis) : axis(axis) { }
+		template <typename T> inline bool operator()(const T &a, const T &b) const {
+			return a.bbox.min[axis] + a.bbox.max[axis]
+				 < b.bbox.min[axis] + b.bbox.max[axis];
+		}
+	};
+}
+
+void InstanceAccel::buildRecursive(uint32_t start, uint32_t end, uint32_t depth) {
+	uint32_t nodeIdx = (uint32_t) m_nodes.size();
+	m_nodes.push_back(InstanceNode());
+
+	BoundingBox3f bbox, centroids;
+	for (uint32_t i=start; i<end; ++i) {
+		bbox.expandBy(m_entries[i].bbox);
+		centroids.expandBy(m_entries[i].bbox.getCenter());
+	}
+	m_nodes[nodeIdx].bbox = bbox;
+
+	if (end - start <= 2 || depth + 1 >= NORI_INSTANCE_MAXDEPTH) {
+		m_nodes[nodeIdx].offset = start;
+		m_nodes[nodeIdx].count = (uint16_t) (end - start);
+		m_nodes[nodeIdx].axis = 0;
+		return;
+	}
+
+	/* Object median split along the axis of largest centroid extent */
+	int axis = centroids.getMajorAxis();
+	uint32_t mid = start + (end - start) / 2;
+	std::nth_element(m_entries.begin() + start, m_entries.begin() + mid,
+		m_entries.begin() + end, InstanceCenterOrder(axis));
+
+	buildRecursive(start, mid, depth + 1);
+	m_nodes[nodeIdx].offset = (uint32_t) m_nodes.size();
+	m_nodes[nodeIdx].count = 0;
+	m_nodes[nodeIdx].axis = (uint16_t) axis;
+	buildRecursive(mid, end, depth + 1);
+}
+
+/// Ray-box slab test restricted to the segment <tt>[mint, maxt]</tt>
+static inline bool intersectInstanceBox(const BoundingBox3f &bbox,
+		const Ray3f &ray, float mint, float maxt) {
+	float nearT, farT;
+	if (!bbox.rayIntersect(ray, nearT, farT))
+		return false;
+	return nearT <= maxt && farT >= mint;
+}
+
+bool InstanceAccel::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const {
+	its.t = std::numeric_limits<float>::infinity();
+
+	/* Use an adaptive ray epsilon */
+	float mint = ray.mint, maxt = ray.maxt;
+	if (mint == Epsilon)
+		mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
+
+	if (maxt < mint)
+		return false;
+
+	bool foundIntersection = false;
+	const Instance *hitInstance = NULL;
+
+	if (m_world->getPrimitiveCount() > 0 &&
+		m_world->rayIntersect(Ray3f(ray, mint, maxt), its, shadowRay)) {
+		if (shadowRay)
+			return true;
+		maxt = its.t;
+		foundIntersection = true;
+	}
+
+	if (m_nodes.empty())
+		return foundIntersection;
+
+	uint32_t stack[NORI_INSTANCE_MAXDEPTH];
+	uint32_t stackPos = 0, nodeIdx = 0;
+
+	while (true) {
+		const InstanceNode &node = m_nodes[nodeIdx];
+
+		if (intersectInstanceBox(node.bbox, ray, mint, maxt)) {
+			if (!node.isLeaf()) {
+				/* Visit the near child first */
+				if (ray.d[node.axis] < 0) {
+					stack[stackPos++] = nodeIdx + 1;
+					nodeIdx = node.offset;
+				} else {
+					stack[stackPos++] = node.offset;
+					nodeIdx = nodeIdx + 1;
+				}
+				continue;
+			}
+
+			for (uint32_t i=node.offset; i<node.offset + node.count; ++i) {
+				const InstanceEntry &entry = m_entries[i];
+				/* The direction is not normalized, hence distances are preserved */
+				Ray3f localRay = entry.instance->getInverseTransform() * Ray3f(ray, mint, maxt);
+				Intersection localIts;
+				if (!entry.accel->rayIntersect(localRay, localIts, shadowRay))
+					continue;
+				if (shadowRay)
+					return true;
+				maxt = localIts.t;
+				its = localIts;
+				hitInstance = entry.instance;
+				foundIntersection = true;
+			}
+		}
+
+		if (stackPos == 0)
+			break;
+		nodeIdx = stack[--stackPos];
+	}
+
+	if (hitInstance) {
+		/* Move the intersection record into world space */
+		const Transform &trafo = hitInstance->getTransform();
+		its.p = trafo * its.p;
+		its.geoFrame = Frame((trafo * Normal3f(its.geoFrame.n)).normalized());
+		its.shFrame = Frame((trafo * Normal3f(its.shFrame.n)).normalized());
+	}
+
+	return foundIntersection;
+}
+
+/**
+ * Occluder found by the most recent successful shadow ray query of the
+ * current thread that went through an instance accelerator: the index
+ * of the instance entry (\c WorldOccluder for the non-instanced meshes)
+ * and the position of the triangle in that accelerator's triangle buffer
+ */
+static const uint32_t WorldOccluder = (uint32_t) -1;
+static NORI_THREAD_LOCAL const InstanceAccel *lastOccluderAccel = NULL;
+static NORI_THREAD_LOCAL uint32_t lastOccluderInstance = 0;
+static NORI_THREAD_LOCAL IndexType lastOccluderEntry = 0;
+
+/* The per-thread occluder cache of Accel::occluded() only refers to the
+   triangle buffer of a single accelerator. Going through occluded() for
+   the world and every bottom-level accelerator would let each nested
+   query overwrite it, so that it hardly ever hits. Instead, the nested
+   accelerators are traversed using findOccluder(), and the instance
+   level records which of them contained the occluder. That triangle is
+   tested first by the next query (in object space for instances). The
+   entry reported to Accel::occluded() stays unknown, which leaves its
+   cache untouched. */
+bool InstanceAccel::findOccluder(const Ray3f &ray_, float mint, float maxt, IndexType &) const {
+	Ray3f ray(ray_, mint, maxt);
+
+	if (lastOccluderAccel == this) {
+		if (lastOccluderInstance == WorldOccluder) {
+			if (m_world->occludedBy(lastOccluderEntry, ray, mint, maxt))
+				return true;
+		} else if (lastOccluderInstance < m_entries.size()) {
+			const InstanceEntry &entry = m_entries[lastOccluderInstance];
+			if (entry.accel->occludedBy(lastOccluderEntry,
+					entry.instance->getInverseTransform() * ray, mint, maxt))
+				return true;
+		}
+	}
+
+	IndexType occluder = (IndexType) -1;
+	if (m_world->getPrimitiveCount() > 0 && m_world->findOccluder(ray, mint, maxt, occluder)) {
+		if (occluder != (IndexType) -1) {
+			lastOccluderAccel = this;
+			lastOccluderInstance = WorldOccluder;
+			lastOccluderEntry = occluder;
+		}
+		return true;
+	}
+
+	if (m_nodes.empty())
+		return false;
+
+	/* Any hit will do -- the children are visited in memory order */
+	uint32_t stack[NORI_INSTANCE_MAXDEPTH];
+	uint32_t stackPos = 0, nodeIdx = 0;
+
+	while (true) {
+		const InstanceNode &node = m_nodes[nodeIdx];
+
+		if (intersectInstanceBox(node.bbox, ray, mint, maxt)) {
+			if (!node.isLeaf()) {
+				stack[stackPos++] = node.offset;
+				nodeIdx = nodeIdx + 1;
+				continue;
+			}
+
+			for (uint32_t i=node.offset; i<node.offset + node.count; ++i) {
+				const InstanceEntry &entry = m_entries[i];
+				/* The direction is not normalized, hence mint/maxt remain valid */
+				occluder = (IndexType) -1;
+				if (!entry.accel->findOccluder(entry.instance->getInverseTransform() * ray,
+						mint, maxt, occluder))
+					continue;
+				if (occluder != (IndexType) -1) {
+					lastOccluderAccel = this;
+					lastOccluderInstance = i;
+					lastOccluderEntry = occluder;
+				}
+				return true;
+			}
+		}
+
+		if (stackPos == 0)
+			break;
+		nodeIdx = stack[--stackPos];
+	}
+
+	return false;
+}
+
+QString InstanceAccel::toString() const {
+	return QString(
+		"InstanceAccel[\n"
+		"  world = %1,\n"
+		"  instanceCount = %2,\n"
+		"  meshCount = %3,\n"
+		"  primitiveCount = %4\n"
+		"]")
+	.arg(indent(m_world->toString()))
+	.arg(m_entries.size())
+	.arg(m_blas.size())
+	.arg(m_primitiveCount);
+}
+
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
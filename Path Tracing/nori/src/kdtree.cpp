@@ -17,30 +17,690 @@
 */
 
 #include <nori/kdtree.h>
-#include <Eigen/Geometry>
+#include <nori/hash.h>
+#include <nori/random.h>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QSettings>
+#include <QTextStream>
+#include <QDir>
+
+/// Version of the kd-tree cache file format (increase when changing the layout)
+#define NORI_KD_CACHE_VERSION 2
+
+/// Autotuning: approximate number of triangles in the sample of the scene
+#define NORI_KD_AUTOTUNE_SAMPLES 100000
+
+/// Autotuning: number of random rays used to compare the parameters
+#define NORI_KD_AUTOTUNE_RAYS 100000
 
 NORI_NAMESPACE_BEGIN
 
-KDTree::KDTree() : m_primitiveCount(0) {
-	m_sizeMap.push_back(0);
+void KDCacheHeader::computeLayout() {
+	typedef KDTreeBase<BoundingBox3f, IndexType>::KDNode KDNode;
+
+	uint64_t offset = alignCacheOffset(sizeof(KDCacheHeader));
+	nodeOffset = offset;
+	offset = alignCacheOffset(offset + sizeof(KDNode) * (nodeCount + 1));
+	indexOffset = offset;
+	offset = alignCacheOffset(offset + sizeof(IndexType) * indexCount);
+	triangleOffset = offset;
+	offset = alignCacheOffset(offset + sizeof(TriAccel) * indexCount);
+	packetOffset = offset;
+	offset = alignCacheOffset(offset + sizeof(TriAccelN) * packetCount);
+	packetOffsetsOffset = offset;
+	fileSize = offset + sizeof(IndexType) * packetOffsetCount;
+}
+
+/// Return the number of rays in a packet mask
+static inline uint32_t countRays(uint32_t mask) {
+	uint32_t count = 0;
+	for (; mask != 0; mask &= mask - 1)
+		++count;
+	return count;
+}
+
+/// Mesh containing every n-th triangle of another mesh (used for autotuning)
+class SampleMesh : public Mesh {
+public:
+	SampleMesh(const Mesh *mesh, IndexType stride) : Mesh(PropertyList()) {
+		const Point3f *positions = mesh->getVertexPositions();
+
+		/* Only keep the vertices that are referenced by the sample */
+		std::vector<IndexType> vertexMap(mesh->getVertexCount(), (IndexType) -1);
+		std::vector<Point3f> vertices;
+		std::vector<IndexType> sampled;
+		for (IndexType i=0; i<mesh->getTriangleCount(); i += stride) {
+			for (int j=0; j<3; ++j) {
+				IndexType vertex = mesh->getIndex(3*(size_t) i+j);
+				IndexType &idx = vertexMap[vertex];
+				if (idx == (IndexType) -1) {
+					idx = (IndexType) vertices.size();
+					vertices.push_back(positions[vertex]);
+				}
+				sampled.push_back(idx);
+			}
+		}
+
+		m_triangleCount = (IndexType) (sampled.size() / 3);
+		m_vertexCount = (IndexType) vertices.size();
+		m_vertexPositions = new Point3f[vertices.size()];
+		m_indices = new IndexType[sampled.size()];
+		std::copy(vertices.begin(), vertices.end(), m_vertexPositions);
+		std::copy(sampled.begin(), sampled.end(), m_indices);
+	}
+};
+
+KDTree::KDTree(const PropertyList &propList) {
+	setTraversalCost(propList.getFloat("traversalCost", getTraversalCost()));
+	setQueryCost(propList.getFloat("queryCost", getQueryCost()));
+	setEmptySpaceBonus(propList.getFloat("emptySpaceBonus", getEmptySpaceBonus()));
+	setStopPrims((SizeType) propList.getInteger("stopPrims", (int) getStopPrims()));
+	setMaxBadRefines((SizeType) propList.getInteger("maxBadRefines", (int) getMaxBadRefines()));
+	setMinMaxBins((SizeType) propList.getInteger("minMaxBins", (int) getMinMaxBins()));
+	setExactPrimitiveThreshold((SizeType) propList.getInteger("exactPrimThreshold",
+		(int) getExactPrimitiveThreshold()));
+	setClip(propList.getBoolean("clip", getClip()));
+	setRetract(propList.getBoolean("retract", getRetract()));
+	setParallelBuild(propList.getBoolean("parallelBuild", getParallelBuild()));
+	setThreadCount((SizeType) propList.getInteger("buildThreads", (int) getThreadCount()));
+	setProbabilityLayout(propList.getBoolean("probabilityLayout", getProbabilityLayout()));
+
+	/* Temporary memory budget of the builder in MiB (0 = unlimited) */
+	int memoryBudget = propList.getInteger("memoryBudget", 0);
+	if (memoryBudget < 0)
+		throw NoriException("The kd-tree memory budget must be >= 0");
+	setMemoryBudget((size_t) memoryBudget * 1024 * 1024);
+	m_buildScaling = propList.getBoolean("buildScaling", false);
+
+	/* Persistent cache of finished trees */
+	m_cache = propList.getBoolean("cache", false);
+	m_cacheDir = propList.getString("cacheDir", QDir::home().filePath(".nori/cache"));
+
+	/* Cost parameters tuned for the current machine */
+	m_autotune = propList.getBoolean("autotune", false);
+	m_profileDir = propList.getString("profileDir", QDir::home().filePath(".nori"));
+
+	/* Statistics report in JSON format (written when the tree is destroyed) */
+	m_statsFile = propList.getString("statsFile", "");
+	m_statistics = !m_statsFile.isEmpty();
+	m_statRays = m_statSteps = m_statTests = 0;
+	m_cacheFile = NULL;
+#if NORI_MAILBOX_STATS == 1
+	m_mailboxReferences = m_mailboxSkipped = 0;
+#endif
 }
 
 KDTree::~KDTree() {
-	for (size_t i=0; i<m_meshes.size(); ++i)
-		delete m_meshes[i];
+	if (m_statistics && m_indices)
+		writeStatistics(m_statsFile);
+
+	if (m_cacheFile) {
+		/* The arrays point into the memory mapping -- don't free them */
+		m_nodes = NULL;
+		m_indices = NULL;
+		m_triangles = NULL;
+		m_packets = NULL;
+		m_packetOffsets = NULL;
+		delete m_cacheFile;
+	}
+#if NORI_MAILBOX_STATS == 1
+	if (m_mailboxReferences > 0)
+		cout << "Mailboxing skipped " << m_mailboxSkipped << " of "
+			 << m_mailboxReferences << " triangle tests ("
+			 << (100.0 * m_mailboxSkipped / m_mailboxReferences) << "%)" << endl;
+#endif
+}
+
+void KDTree::clear() {
+	if (m_cacheFile) {
+		/* The arrays point into the memory mapping -- don't free them */
+		m_nodes = NULL;
+		m_indices = NULL;
+		m_triangles = NULL;
+		m_packets = NULL;
+		m_packetOffsets = NULL;
+		m_triangleCount = m_packetCount = m_packetOffsetCount = 0;
+		delete m_cacheFile;
+		m_cacheFile = NULL;
+	}
+	Parent::clear();
+	Accel::clear();
 }
 
 void KDTree::build() {
 	SizeType primCount = getPrimitiveCount();
+
+	if (m_autotune && primCount > 0)
+		autotune();
+
+	QString cacheFilename;
+	uint64_t key = 0;
+	if (m_cache && primCount > 0) {
+		key = getCacheKey();
+		cacheFilename = QDir(m_cacheDir).filePath(
+			QString("%1.kdtree").arg((qulonglong) key, 16, 16, QChar('0')));
+		if (loadCache(cacheFilename, key)) {
+			cout << "Loaded the kd-tree from \"" << qPrintable(cacheFilename) << "\" ("
+				 << m_cacheFile->size() / 1024 << " KiB)" << endl;
+			return;
+		}
+	}
+
+	if (m_buildScaling && primCount > 0)
+		reportBuildScaling();
+
+	SizeType threadCount = getParallelBuild() ? (getThreadCount() > 0 
+		? getThreadCount() : (SizeType) getCoreCount()) : 1;
 	cout << "Constructing a SAH kd-tree (" << primCount << " triangles, "
-		 << getCoreCount() << " threads) .." << endl;
+		 << threadCount << " threads) .." << endl;
 	Parent::buildInternal();
+	if (!m_indices)
+		return; /* Empty tree */
+
+	/* Copy the triangles into the order in which they are referenced
+	   by the leaves, so that leaf tests stream through memory */
+	createTriangleBuffer(m_indices, m_indexCount);
+
+	std::vector<std::pair<IndexType, IndexType> > leaves;
+	for (SizeType i=0; i<m_nodeCount; ++i) {
+		if (m_nodes[i].isLeaf())
+			leaves.push_back(std::make_pair(m_nodes[i].getPrimStart(), m_nodes[i].getPrimEnd()));
+	}
+	createPacketBuffer(leaves);
+
+	size_t memory = m_nodeCount * sizeof(KDNode) + m_indexCount * sizeof(IndexType)
+		+ getTriangleBufferSize();
+	cout << "The leaf-ordered triangle buffer requires "
+		 << getTriangleBufferSize() / 1024 << " KiB of memory ("
+		 << qPrintable(QString::number(memory / (double) primCount, 'f', 1))
+		 << " bytes per triangle in total)" << endl;
+
+	cout << "Peak temp. memory of the builder: " << getPeakTempMemory() / 1024
+		 << " KiB, peak resident set size of the process: "
+		 << getPeakMemoryUsage() / (1024 * 1024) << " MiB" << endl;
+
+	if (m_cache)
+		saveCache(cacheFilename, key);
+}
+
+void KDTree::reportBuildScaling() {
+	SizeType maxThreads = getThreadCount() > 0 ? getThreadCount() 
+		: (SizeType) getCoreCount();
+	SizeType threadCount = getThreadCount();
+	bool parallelBuild = getParallelBuild();
+	std::vector<std::pair<SizeType, qint64> > timings;
+
+	/* Thread counts 1, 2, 4, .. and the maximum */
+	setParallelBuild(true);
+	for (SizeType threads = 1; ; threads = std::min(2*threads, maxThreads)) {
+		cout << "Measuring the kd-tree construction time using " 
+			 << threads << " thread(s) .." << endl;
+		setThreadCount(threads);
+		QElapsedTimer timer;
+		timer.start();
+		Parent::buildInternal();
+		timings.push_back(std::make_pair(threads, timer.elapsed()));
+		Parent::clear();
+		if (threads == maxThreads)
+			break;
+	}
+	setThreadCount(threadCount);
+	setParallelBuild(parallelBuild);
+
+	cout << "kd-tree build scaling (" << getPrimitiveCount() << " triangles):" << endl
+		 << "  Threads    Time (ms)    Speedup    Efficiency" << endl;
+	float reference = (float) std::max(timings[0].second, (qint64) 1);
+	for (size_t i=0; i<timings.size(); ++i) {
+		float speedup = reference / std::max(timings[i].second, (qint64) 1);
+		cout << qPrintable(QString("  %1    %2    %3x    %4%")
+			.arg(timings[i].first, 7)
+			.arg(timings[i].second, 9)
+			.arg(speedup, 6, 'f', 2)
+			.arg(100 * speedup / timings[i].first, 9, 'f', 1)) << endl;
+	}
+}
+
+void KDTree::autotune() {
+	QString filename = QDir(m_profileDir).filePath(
+		QString("kdtree-%1.ini").arg(getHostName()));
+
+	/* Separate parameters for each configuration of the leaf kernels */
+	QSettings profile(filename, QSettings::IniFormat);
+	profile.beginGroup(QString("simd%1-index%2").arg(NORI_SIMD_WIDTH).arg(NORI_INDEX_WIDTH));
+
+	if (!profile.contains("traversalCost")) {
+		cout << "Tuning the kd-tree parameters for this machine .." << endl;
+		double stepTime, testTime;
+		tuneParameters(stepTime, testTime);
+
+		QDir().mkpath(m_profileDir);
+		profile.setValue("traversalCost", (double) getTraversalCost());
+		profile.setValue("queryCost", (double) getQueryCost());
+		profile.setValue("emptySpaceBonus", (double) getEmptySpaceBonus());
+		profile.setValue("stopPrims", (int) getStopPrims());
+		profile.setValue("stepTime", stepTime);
+		profile.setValue("testTime", testTime);
+		profile.sync();
+		if (profile.status() != QSettings::NoError)
+			cerr << "Warning: unable to write the kd-tree profile \""
+				 << qPrintable(filename) << "\"" << endl;
+		return;
+	}
+
+	setTraversalCost((float) profile.value("traversalCost").toDouble());
+	setQueryCost((float) profile.value("queryCost").toDouble());
+	setEmptySpaceBonus((float) profile.value("emptySpaceBonus").toDouble());
+	setStopPrims((SizeType) profile.value("stopPrims").toInt());
+	cout << "Using the kd-tree parameters from \"" << qPrintable(filename) << "\": "
+		 << "traversalCost=" << getTraversalCost() << ", queryCost=" << getQueryCost()
+		 << ", emptySpaceBonus=" << getEmptySpaceBonus() << ", stopPrims="
+		 << getStopPrims() << endl;
+}
+
+void KDTree::tuneParameters(double &stepTime, double &testTime) {
+	/* Sample every n-th triangle of each mesh */
+	IndexType stride = std::max((IndexType) 1,
+		getPrimitiveCount() / (IndexType) NORI_KD_AUTOTUNE_SAMPLES);
+	std::vector<Mesh *> sample;
+	BoundingBox3f bbox;
+	for (size_t i=0; i<m_meshes.size(); ++i) {
+		if (m_meshes[i]->getTriangleCount() == 0)
+			continue;
+		Mesh *mesh = new SampleMesh(m_meshes[i], stride);
+		for (IndexType j=0; j<mesh->getVertexCount(); ++j)
+			bbox.expandBy(mesh->getVertexPositions()[j]);
+		sample.push_back(mesh);
+	}
+
+	/* Rays starting at random positions within the scene, which
+	   resemble the secondary rays of a path tracer */
+	Random random;
+	random.seed(1);
+	std::vector<Ray3f> rays(NORI_KD_AUTOTUNE_RAYS);
+	for (size_t i=0; i<rays.size(); ++i) {
+		Point3f o;
+		for (int axis=0; axis<3; ++axis)
+			o[axis] = bbox.min[axis] + random.nextFloat() * (bbox.max[axis] - bbox.min[axis]);
+		Point2f dirSample(random.nextFloat(), random.nextFloat());
+		rays[i] = Ray3f(o, squareToUniformSphere(dirSample));
+	}
+
+	/* Estimate the traversal cost relative to the query cost from
+	   the measured time of a traversal step and a triangle test */
+	{
+		KDTree tree((PropertyList()));
+		for (size_t i=0; i<sample.size(); ++i)
+			tree.addMesh(sample[i]);
+		tree.build();
+		tree.measureKernels(rays, stepTime, testTime);
+	}
+	float ratio = std::min(std::max((float) (stepTime / testTime), 0.05f), 2.0f);
+	cout << "Measured " << stepTime << " ns per traversal step and "
+		 << testTime << " ns per triangle test" << endl;
+
+	/* Coordinate search, starting with the measured cost ratio */
+	float traversalCost = getQueryCost() * ratio, emptySpaceBonus = getEmptySpaceBonus();
+	SizeType stopPrims = getStopPrims();
+	qint64 bestTime = measureParameters(sample, rays, traversalCost, emptySpaceBonus, stopPrims);
+
+	const float traversalCosts[] = { traversalCost * 0.5f, traversalCost * 2, getTraversalCost() };
+	for (int i=0; i<3; ++i) {
+		qint64 time = measureParameters(sample, rays, traversalCosts[i], emptySpaceBonus, stopPrims);
+		if (time < bestTime) {
+			bestTime = time;
+			traversalCost = traversalCosts[i];
+		}
+	}
+
+	const SizeType stopPrimCounts[] = { 2, 4, 8, 12 };
+	for (int i=0; i<4; ++i) {
+		if (stopPrimCounts[i] == stopPrims)
+			continue;
+		qint64 time = measureParameters(sample, rays, traversalCost, emptySpaceBonus, stopPrimCounts[i]);
+		if (time < bestTime) {
+			bestTime = time;
+			stopPrims = stopPrimCounts[i];
+		}
+	}
+
+	const float emptySpaceBonuses[] = { 0.7f, 0.8f, 1.0f };
+	for (int i=0; i<3; ++i) {
+		qint64 time = measureParameters(sample, rays, traversalCost, emptySpaceBonuses[i], stopPrims);
+		if (time < bestTime) {
+			bestTime = time;
+			emptySpaceBonus = emptySpaceBonuses[i];
+		}
+	}
+
+	for (size_t i=0; i<sample.size(); ++i)
+		delete sample[i];
+
+	setTraversalCost(traversalCost);
+	setEmptySpaceBonus(emptySpaceBonus);
+	setStopPrims(stopPrims);
+	cout << "Tuned kd-tree parameters: traversalCost=" << traversalCost << ", queryCost="
+		 << getQueryCost() << ", emptySpaceBonus=" << emptySpaceBonus << ", stopPrims="
+		 << stopPrims << " (" << bestTime << " ms for " << rays.size() << " rays)" << endl;
+}
+
+qint64 KDTree::measureParameters(const std::vector<Mesh *> &meshes, const std::vector<Ray3f> &rays,
+		float traversalCost, float emptySpaceBonus, SizeType stopPrims) const {
+	KDTree tree((PropertyList()));
+	tree.setTraversalCost(traversalCost);
+	tree.setQueryCost(getQueryCost());
+	tree.setEmptySpaceBonus(emptySpaceBonus);
+	tree.setStopPrims(stopPrims);
+	tree.setMaxBadRefines(getMaxBadRefines());
+	tree.setMinMaxBins(getMinMaxBins());
+	tree.setExactPrimitiveThreshold(getExactPrimitiveThreshold());
+	tree.setClip(getClip());
+	tree.setRetract(getRetract());
+	tree.setParallelBuild(getParallelBuild());
+	tree.setThreadCount(getThreadCount());
+	tree.setProbabilityLayout(getProbabilityLayout());
+	for (size_t i=0; i<meshes.size(); ++i)
+		tree.addMesh(meshes[i]);
+	tree.build();
+
+	/* Take the best of three runs to reduce timing noise */
+	qint64 bestTime = std::numeric_limits<qint64>::max();
+	for (int run=0; run<3; ++run) {
+		QElapsedTimer timer;
+		timer.start();
+		for (size_t i=0; i<rays.size(); ++i) {
+			Intersection its;
+			tree.rayIntersect(rays[i], its);
+		}
+		bestTime = std::min(bestTime, timer.elapsed());
+	}
+
+	cout << "  traversalCost=" << traversalCost << ", emptySpaceBonus=" << emptySpaceBonus
+		 << ", stopPrims=" << stopPrims << ": " << bestTime << " ms" << endl;
+	return bestTime;
+}
+
+void KDTree::measureKernels(const std::vector<Ray3f> &rays, double &stepTime, double &testTime) const {
+	/* Traversal steps: locate the ray origins in the tree. The loops
+	   are repeated until the timer resolution no longer matters */
+	QElapsedTimer timer;
+	timer.start();
+	size_t steps = 0, leafSum = 0;
+	qint64 time;
+	do {
+		for (size_t i=0; i<rays.size(); ++i) {
+			const KDNode *node = m_nodes;
+			const Point3f &p = rays[i].o;
+			while (!node->isLeaf()) {
+				node = node->getLeft() + (p[node->getAxis()] > node->getSplit() ? 1 : 0);
+				++steps;
+			}
+			leafSum += node->getPrimStart();
+		}
+	} while ((time = timer.elapsed()) < 100);
+	stepTime = 1e6 * time / (double) std::max(steps, (size_t) 1);
+
+	/* Triangle tests: intersect the rays against the nonempty leaves
+	   using the same (SIMD) kernels as the traversal */
+	std::vector<const KDNode *> leaves;
+	for (SizeType i=0; i<m_nodeCount; ++i) {
+		if (m_nodes[i].isLeaf() && m_nodes[i].getPrimEnd() > m_nodes[i].getPrimStart())
+			leaves.push_back(&m_nodes[i]);
+	}
+
+	timer.start();
+	size_t tests = 0, hits = 0;
+	do {
+		for (size_t i=0; i<rays.size() && !leaves.empty(); ++i) {
+			const KDNode *leaf = leaves[i % leaves.size()];
+			Intersection its;
+			IndexType primIndex;
+			float maxt = rays[i].maxt;
+			if (intersectLeaf(leaf->getPrimStart(), leaf->getPrimEnd(), rays[i],
+					rays[i].mint, maxt, false, its, primIndex))
+				++hits;
+			tests += leaf->getPrimEnd() - leaf->getPrimStart();
+		}
+	} while ((time = timer.elapsed()) < 100);
+	testTime = 1e6 * time / (double) std::max(tests, (size_t) 1);
+
+	/* Keep the compiler from removing the loops */
+	volatile size_t sink = leafSum + hits;
+	(void) sink;
+}
+
+uint64_t KDTree::getCacheKey() const {
+	Hasher hasher;
+
+	/* File format and memory layout */
+	hasher.update((uint32_t) NORI_KD_CACHE_VERSION);
+	hasher.update((uint32_t) sizeof(KDNode));
+	hasher.update((uint32_t) sizeof(TriAccel));
+	hasher.update((uint32_t) sizeof(TriAccelN));
+
+	/* Construction parameters */
+	hasher.update(getTraversalCost());
+	hasher.update(getQueryCost());
+	hasher.update(getEmptySpaceBonus());
+	hasher.update((uint32_t) getStopPrims());
+	hasher.update((uint32_t) getMaxBadRefines());
+	hasher.update((uint32_t) getMinMaxBins());
+	hasher.update((uint32_t) getExactPrimitiveThreshold());
+	hasher.update((uint32_t) getMaxDepth());
+	hasher.update((uint8_t) getClip());
+	hasher.update((uint8_t) getRetract());
+	hasher.update((uint64_t) getMemoryBudget());
+	hasher.update((uint8_t) getProbabilityLayout());
+
+	/* Geometry */
+	for (size_t i=0; i<m_meshes.size(); ++i) {
+		const Mesh *mesh = m_meshes[i];
+		hasher.update(mesh->getVertexCount());
+		hasher.update(mesh->getTriangleCount());
+		hasher.update(mesh->getVertexPositions(), sizeof(Point3f) * mesh->getVertexCount());
+		if (mesh->getIndices())
+			hasher.update(mesh->getIndices(), sizeof(IndexType) * 3 * mesh->getTriangleCount());
+		else
+			hasher.update(mesh->getShortIndices(), sizeof(uint16_t) * 3 * mesh->getTriangleCount());
+	}
+
+	return hasher.get();
+}
+
+bool KDTree::loadCache(const QString &filename, uint64_t key) {
+	QFile *file = new QFile(filename);
+	if (!file->open(QIODevice::ReadOnly)) {
+		delete file;
+		return false;
+	}
+
+	KDCacheHeader header;
+	uchar *data = NULL;
+	if (file->size() >= (qint64) sizeof(KDCacheHeader))
+		data = file->map(0, file->size());
+
+	KDCacheHeader layout;
+	if (data) {
+		memcpy(&header, data, sizeof(KDCacheHeader));
+		layout = header;
+		layout.computeLayout();
+	}
+
+	if (!data || memcmp(header.magic, "NKDT", 4) != 0
+			|| header.version != NORI_KD_CACHE_VERSION
+			|| header.key != key
+			|| header.fileSize != (uint64_t) file->size()
+			|| header.indexCount == 0
+			|| memcmp(&header, &layout, sizeof(KDCacheHeader)) != 0) {
+		cerr << "Warning: ignoring invalid kd-tree cache file \""
+			 << qPrintable(filename) << "\"" << endl;
+		delete file;
+		return false;
+	}
+
+	m_cacheFile = file;
+	m_nodeCount = (SizeType) header.nodeCount;
+	m_indexCount = (SizeType) header.indexCount;
+	m_nodes = reinterpret_cast<KDNode *>(data + header.nodeOffset) + 1;
+	m_indices = reinterpret_cast<IndexType *>(data + header.indexOffset);
+	for (int axis=0; axis<3; ++axis) {
+		m_bbox.min[axis] = header.bbox[0][axis];
+		m_bbox.max[axis] = header.bbox[1][axis];
+		m_tightBBox.min[axis] = header.tightBBox[0][axis];
+		m_tightBBox.max[axis] = header.tightBBox[1][axis];
+	}
+
+	m_triangles = reinterpret_cast<TriAccel *>(data + header.triangleOffset);
+	m_triangleCount = header.indexCount;
+	m_packets = reinterpret_cast<TriAccelN *>(data + header.packetOffset);
+	m_packetCount = header.packetCount;
+	m_packetOffsets = reinterpret_cast<IndexType *>(data + header.packetOffsetsOffset);
+	m_packetOffsetCount = header.packetOffsetCount;
+
+	if (!validateCache()) {
+		cerr << "Warning: ignoring corrupt kd-tree cache file \""
+			 << qPrintable(filename) << "\"" << endl;
+		m_nodes = NULL;
+		m_indices = NULL;
+		m_triangles = NULL;
+		m_packets = NULL;
+		m_packetOffsets = NULL;
+		m_nodeCount = m_indexCount = 0;
+		m_triangleCount = m_packetCount = m_packetOffsetCount = 0;
+		m_cacheFile = NULL;
+		delete file;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Return the global primitive index of a cached triangle record, or
+ * <tt>(IndexType) -1</tt> if its mesh or triangle index is out of range
+ */
+static inline IndexType cachedIndex(const std::vector<Mesh *> &meshes,
+		const std::vector<IndexType> &sizeMap, uint32_t meshIndex, IndexType primIndex) {
+	if (meshIndex >= meshes.size() || primIndex >= meshes[meshIndex]->getTriangleCount())
+		return (IndexType) -1;
+	return sizeMap[meshIndex] + primIndex;
 }
 
-void KDTree::addMesh(Mesh *mesh) {
-	m_primitiveCount += mesh->getTriangleCount();
-	m_meshes.push_back(mesh);
-	m_sizeMap.push_back(m_sizeMap.back() + mesh->getTriangleCount());
+bool KDTree::validateCache() const {
+	const IndexType primCount = getPrimitiveCount();
+	if (m_nodeCount == 0)
+		return false;
+
+	for (SizeType i=0; i<m_indexCount; ++i) {
+		const TriAccel &tri = m_triangles[i];
+		if (m_indices[i] >= primCount
+			|| cachedIndex(m_meshes, m_sizeMap, tri.meshIndex, tri.primIndex) != m_indices[i]
+			|| tri.index != m_indices[i])
+			return false;
+	}
+
+	for (SizeType i=0; i<m_packetCount; ++i) {
+		const TriAccelN &packet = m_packets[i];
+		for (int lane=0; lane<NORI_SIMD_WIDTH; ++lane) {
+			if (packet.index[lane] == (IndexType) -1)
+				continue;
+			if (packet.index[lane] >= primCount || cachedIndex(m_meshes, m_sizeMap,
+					packet.meshIndex[lane], packet.primIndex[lane]) != packet.index[lane])
+				return false;
+		}
+	}
+
+	/* Children are always stored after their parent, hence a valid
+	   node array cannot contain cycles */
+	for (SizeType i=0; i<m_nodeCount; ++i) {
+		const KDNode &node = m_nodes[i];
+		if (node.isLeaf()) {
+			IndexType start = node.getPrimStart(), end = node.getPrimEnd();
+			if (start > end || end > m_indexCount)
+				return false;
+			if (end - start > 1 && (start >= m_packetOffsetCount
+					|| m_packetOffsets[start] > m_packetCount
+					|| m_packetCount - m_packetOffsets[start]
+						< (end - start + NORI_SIMD_WIDTH - 1) / NORI_SIMD_WIDTH))
+				return false;
+		} else {
+			if (node.isIndirection() || node.getAxis() > 2)
+				return false;
+			/* Decode the offset directly, since getLeft() could leave
+			   the address space */
+			IndexType relOffset = (node.inner.combined & KDNode::EInnerOffsetMask) >> 2;
+			if (relOffset == 0 || relOffset >= m_nodeCount - i - 1)
+				return false;
+		}
+	}
+	return true;
+}
+
+void KDTree::saveCache(const QString &filename, uint64_t key) const {
+	if (!QDir().mkpath(QFileInfo(filename).absolutePath())) {
+		cerr << "Warning: unable to create the kd-tree cache directory for \""
+			 << qPrintable(filename) << "\"" << endl;
+		return;
+	}
+
+	KDCacheHeader header;
+	memset(&header, 0, sizeof(KDCacheHeader));
+	memcpy(header.magic, "NKDT", 4);
+	header.version = NORI_KD_CACHE_VERSION;
+	header.key = key;
+	header.nodeCount = m_nodeCount;
+	header.indexCount = m_indexCount;
+	header.packetCount = m_packetCount;
+	header.packetOffsetCount = m_packetOffsetCount;
+	for (int axis=0; axis<3; ++axis) {
+		header.bbox[0][axis] = m_bbox.min[axis];
+		header.bbox[1][axis] = m_bbox.max[axis];
+		header.tightBBox[0][axis] = m_tightBBox.min[axis];
+		header.tightBBox[1][axis] = m_tightBBox.max[axis];
+	}
+
+	header.computeLayout();
+
+	/* Write to a temporary file first, so that concurrent render processes
+	   never map a partially written cache file */
+	QString tmpFilename = QString("%1.%2.tmp").arg(filename)
+		.arg(QCoreApplication::applicationPid());
+	QFile file(tmpFilename);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		cerr << "Warning: unable to write the kd-tree cache file \""
+			 << qPrintable(tmpFilename) << "\"" << endl;
+		return;
+	}
+
+	KDNode unused;
+	memset(&unused, 0, sizeof(KDNode));
+
+	bool success =
+		writeCacheSection(file, 0, &header, sizeof(KDCacheHeader)) &&
+		writeCacheSection(file, header.nodeOffset, &unused, sizeof(KDNode)) &&
+		writeCacheSection(file, header.nodeOffset + sizeof(KDNode), m_nodes, sizeof(KDNode) * m_nodeCount) &&
+		writeCacheSection(file, header.indexOffset, m_indices, sizeof(IndexType) * m_indexCount) &&
+		writeCacheSection(file, header.triangleOffset, m_triangles, sizeof(TriAccel) * m_triangleCount) &&
+		writeCacheSection(file, header.packetOffset, m_packets, sizeof(TriAccelN) * m_packetCount) &&
+		writeCacheSection(file, header.packetOffsetsOffset, m_packetOffsets, sizeof(IndexType) * m_packetOffsetCount);
+	file.close();
+
+	/* QFile::rename() does not overwrite existing files. Replace stale
+	   cache files -- processes that have mapped them are unaffected */
+	if (success && !QFile::rename(tmpFilename, filename)) {
+		QFile::remove(filename);
+		success = QFile::rename(tmpFilename, filename);
+	}
+
+	if (!success) {
+		QFile::remove(tmpFilename);
+		cerr << "Warning: unable to write the kd-tree cache file \""
+			 << qPrintable(filename) << "\"" << endl;
+		return;
+	}
+
+	cout << "Wrote the kd-tree to \"" << qPrintable(filename) << "\" ("
+		 << header.fileSize / 1024 << " KiB)" << endl;
 }
 
 bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const {
@@ -84,14 +744,21 @@ bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) c
 	stack[exPt].p = ray(maxt);
 	stack[exPt].node = NULL;
 
+	/* With primitive clipping, triangles can be referenced by many
+	   of the leaves along the ray -- avoid testing them repeatedly */
+	Mailbox mailbox;
+	Mailbox *mailboxPtr = getClip() ? &mailbox : NULL;
+
 	bool foundIntersection = false;
-	uint32_t foundPrimIndex = 0;
+	IndexType foundPrimIndex = 0;
+	uint32_t steps = 0, tests = 0;
 	const KDNode * __restrict currNode = m_nodes;
 	while (currNode != NULL) {
 		while (EXPECT_TAKEN(!currNode->isLeaf())) {
 			const float splitVal = (float) currNode->getSplit();
 			const int axis = currNode->getAxis();
 			const KDNode * __restrict farChild;
+			++steps;
 
 			if (stack[enPt].p[axis] <= splitVal) {
 				if (stack[exPt].p[axis] <= splitVal) {
@@ -134,30 +801,19 @@ bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) c
 			stack[exPt].prev = tmp;
 			stack[exPt].t = distToSplit;
 			stack[exPt].node = farChild;
+			prefetch(farChild);
 			stack[exPt].p = ray(distToSplit);
 			stack[exPt].p[axis] = splitVal;
 		}
 
 		/* Reached a leaf node */
-		for (IndexType entry=currNode->getPrimStart(),
-				last = currNode->getPrimEnd(); entry != last; entry++) {
-			IndexType primIndex = m_indices[entry];
-			IndexType meshIndex = findMesh(primIndex);
-			const Mesh *mesh = m_meshes[meshIndex];
-
-			float u, v, t;
-			bool success = mesh->rayIntersect(primIndex, ray, u, v, t);
-
-			if (success && t >= mint && t <= maxt) {
-				if (shadowRay)
-					return true;
-				maxt = t;
-				its.t = t;
-				its.uv = Point2f(u, v);
-				its.mesh = mesh;
-				foundPrimIndex = primIndex;
-				foundIntersection = true;
-			}
+		++steps;
+		tests += currNode->getPrimEnd() - currNode->getPrimStart();
+		if (intersectLeaf(currNode->getPrimStart(), currNode->getPrimEnd(),
+				ray, mint, maxt, shadowRay, its, foundPrimIndex, mailboxPtr)) {
+			foundIntersection = true;
+			if (shadowRay)
+				break;
 		}
 
 		if (stack[exPt].t > maxt) 
@@ -169,56 +825,444 @@ bool KDTree::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) c
 		exPt = stack[enPt].prev;
 	}
 
-	if (foundIntersection && !shadowRay) {
-		/* Find the barycentric coordinates */
-		Vector3f bary;
-		bary << 1-its.uv.sum(), its.uv;
-
-		/* Look up the vertex indices */
-		const Mesh *mesh = its.mesh;
-		const uint32_t *indices = mesh->getIndices(),
-				  idx0 = indices[3*foundPrimIndex+0],
-				  idx1 = indices[3*foundPrimIndex+1],
-				  idx2 = indices[3*foundPrimIndex+2];
-
-		const Point3f  *positions = mesh->getVertexPositions();
-		const Normal3f *normals   = mesh->getVertexNormals();
-		const Point2f  *texCoords = mesh->getVertexTexCoords();
-
-		Point3f p0 = positions[idx0],
-			p1 = positions[idx1],
-			p2 = positions[idx2];
-
-		/* Compute the intersection positon accurately 
-		   using barycentric coordinates */
-		its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-
-		/* Compute proper texture coordinates if provided by the mesh */
-		if (texCoords) 
-			its.uv = bary.x() * texCoords[idx0] +
-				bary.y() * texCoords[idx1] +
-				bary.z() * texCoords[idx2];
-
-		/* Compute the geometry frame */
-		its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
-
-		if (normals) {
-			/* Compute the shading frame. Note that for simplicity,
-			   the current implementation doesn't attempt to provide
-			   tangents that are continuous across the surface. That
-			   means that this code will need to be modified to be able
-			   use anisotropic BRDFs, which need tangent continuity */
-
-			its.shFrame = Frame(
-				(bary.x() * normals[idx0] +
-				 bary.y() * normals[idx1] +
-				 bary.z() * normals[idx2]).normalized());
-		} else {
-			its.shFrame = its.geoFrame;
+#if NORI_MAILBOX_STATS == 1
+	atomicAdd(&m_mailboxReferences, mailbox.references);
+	atomicAdd(&m_mailboxSkipped, mailbox.skipped);
+#endif
+
+	if (EXPECT_NOT_TAKEN(m_statistics))
+		recordTraversal(1, steps, tests);
+
+	if (foundIntersection && !shadowRay)
+		fillIntersection(foundPrimIndex, its);
+
+	return foundIntersection;
+}
+
+bool KDTree::findOccluder(const Ray3f &ray, float mint, float maxt, IndexType &entry) const {
+	/// Stack of far children along with their parametric intervals
+	struct {
+		const KDNode * __restrict node;
+		float mint, maxt;
+	} stack[NORI_KD_MAXDEPTH];
+	uint32_t stackPos = 0;
+
+	if (!m_indices)
+		return false;
+
+	float bboxMinT, bboxMaxT;
+	if (!m_bbox.rayIntersect(ray, bboxMinT, bboxMaxT))
+		return false;
+
+	mint = std::max(mint, bboxMinT);
+	maxt = std::min(maxt, bboxMaxT);
+
+	if (maxt < mint)
+		return false;
+
+	const KDNode * __restrict currNode = m_nodes;
+	float nodeMinT = mint, nodeMaxT = maxt;
+	uint32_t steps = 0, tests = 0;
+	bool found = false;
+
+	while (true) {
+		while (EXPECT_TAKEN(!currNode->isLeaf())) {
+			const float splitVal = (float) currNode->getSplit();
+			const int axis = currNode->getAxis();
+			const KDNode * __restrict nearChild = currNode->getLeft();
+			const KDNode * __restrict farChild = nearChild + 1;
+			++steps;
+
+			/* The near child contains the ray origin (or the part of the
+			   ray that starts on the split plane). This only matters for
+			   the interval bookkeeping, not for the order of leaf tests */
+			if (ray.o[axis] > splitVal || (ray.o[axis] == splitVal && ray.d[axis] > 0))
+				std::swap(nearChild, farChild);
+
+			float distToSplit = (splitVal - ray.o[axis]) * ray.dRcp[axis];
+
+			if (EXPECT_NOT_TAKEN(distToSplit != distToSplit)) {
+				/* The ray lies within the split plane (0*inf) */
+				stack[stackPos].node = farChild;
+				stack[stackPos].mint = nodeMinT;
+				stack[stackPos].maxt = nodeMaxT;
+				++stackPos;
+				prefetch(farChild);
+				currNode = nearChild;
+			} else if (distToSplit > nodeMaxT || distToSplit <= 0) {
+				currNode = nearChild;
+			} else if (distToSplit < nodeMinT) {
+				currNode = farChild;
+			} else {
+				stack[stackPos].node = farChild;
+				stack[stackPos].mint = distToSplit;
+				stack[stackPos].maxt = nodeMaxT;
+				++stackPos;
+				prefetch(farChild);
+				currNode = nearChild;
+				nodeMaxT = distToSplit;
+			}
 		}
+
+		++steps;
+		tests += currNode->getPrimEnd() - currNode->getPrimStart();
+		if (occludedLeaf(currNode->getPrimStart(), currNode->getPrimEnd(),
+				ray, mint, maxt, entry)) {
+			found = true;
+			break;
+		}
+
+		if (stackPos == 0)
+			break;
+
+		--stackPos;
+		currNode = stack[stackPos].node;
+		nodeMinT = stack[stackPos].mint;
+		nodeMaxT = stack[stackPos].maxt;
 	}
 
-	return foundIntersection;
+	if (EXPECT_NOT_TAKEN(m_statistics))
+		recordTraversal(1, steps, tests);
+
+	return found;
+}
+
+void KDTree::rayIntersectPacket(RayPacketN &packet) const {
+	typedef SIMDFloat<4> Packet;
+	const int groupCount = NORI_PACKET_SIZE / 4;
+	BOOST_STATIC_ASSERT(NORI_PACKET_SIZE % 4 == 0 && NORI_PACKET_SIZE <= 32);
+	const uint32_t count = packet.count;
+	if (!m_indices || count == 0 || !packet.isCoherent()) {
+		Accel::rayIntersectPacket(packet);
+		return;
+	}
+
+	/// Packet traversal stack
+	struct {
+		/* Per-ray intervals (four rays per SIMD group) */
+		Packet tNear[groupCount], tFar[groupCount];
+		/* Pointer to the far child */
+		const KDNode * __restrict node;
+		/* Rays that need to visit it */
+		uint32_t active;
+		/* Conservative bounds on the packet's interval */
+		float tMin, tMax;
+	} stack[NORI_KD_MAXDEPTH];
+	uint32_t stackPos = 0;
+
+	/* Ray origins, direction reciprocals and intervals in
+	   structure-of-arrays layout, indexed by [axis][ray] */
+	Packet origin[3][groupCount], dRcp[3][groupCount];
+	Packet tNear[groupCount], tFar[groupCount];
+	float *o = reinterpret_cast<float *>(origin),
+	      *r = reinterpret_cast<float *>(dRcp),
+	      *tn = reinterpret_cast<float *>(tNear),
+	      *tf = reinterpret_cast<float *>(tFar);
+	float mint[NORI_PACKET_SIZE], maxt[NORI_PACKET_SIZE];
+	IndexType primIndex[NORI_PACKET_SIZE];
+
+	/* Set up the per-ray intervals and bounds on the packet's
+	   origins and direction reciprocals for the frustum test */
+	uint32_t active = 0;
+	float tMin = std::numeric_limits<float>::infinity(), tMax = -tMin;
+	Point3f oMin = packet.rays[0].o, oMax = oMin;
+	Vector3f dRcpMin = packet.rays[0].dRcp, dRcpMax = dRcpMin;
+
+	for (uint32_t i=0; i<NORI_PACKET_SIZE; ++i) {
+		tn[i] = tf[i] = 0.0f;
+		for (int axis=0; axis<3; ++axis)
+			o[axis*NORI_PACKET_SIZE + i] = r[axis*NORI_PACKET_SIZE + i] = 0.0f;
+		if (i >= count)
+			continue;
+
+		const Ray3f &ray = packet.rays[i];
+		packet.its[i].t = std::numeric_limits<float>::infinity();
+		packet.hit[i] = false;
+
+		for (int axis=0; axis<3; ++axis) {
+			o[axis*NORI_PACKET_SIZE + i] = ray.o[axis];
+			r[axis*NORI_PACKET_SIZE + i] = ray.dRcp[axis];
+		}
+		oMin = oMin.cwiseMin(ray.o);
+		oMax = oMax.cwiseMax(ray.o);
+		dRcpMin = dRcpMin.cwiseMin(ray.dRcp);
+		dRcpMax = dRcpMax.cwiseMax(ray.dRcp);
+
+		/* Use an adaptive ray epsilon */
+		mint[i] = ray.mint; maxt[i] = ray.maxt;
+		if (mint[i] == Epsilon)
+			mint[i] = std::max(mint[i], mint[i] * ray.o.array().abs().maxCoeff());
+
+		float bboxMinT, bboxMaxT;
+		if (!m_bbox.rayIntersect(ray, bboxMinT, bboxMaxT))
+			continue;
+
+		mint[i] = std::max(mint[i], bboxMinT);
+		maxt[i] = std::min(maxt[i], bboxMaxT);
+		if (maxt[i] < mint[i])
+			continue;
+
+		tn[i] = mint[i];
+		tf[i] = maxt[i];
+		tMin = std::min(tMin, mint[i]);
+		tMax = std::max(tMax, maxt[i]);
+		active |= 1 << i;
+	}
+
+	/* All rays visit the children of a node in the same order */
+	bool nearIsRight[3];
+	for (int axis=0; axis<3; ++axis)
+		nearIsRight[axis] = packet.rays[0].dRcp[axis] < 0;
+
+	/* Rays that have not found their closest intersection yet */
+	uint32_t alive = active;
+	const KDNode * __restrict currNode = m_nodes;
+	uint32_t steps = 0, tests = 0;
+	if (EXPECT_NOT_TAKEN(m_statistics))
+		recordTraversal(countRays(active), 0, 0);
+
+	while (active != 0) {
+		while (EXPECT_TAKEN(!currNode->isLeaf())) {
+			const float splitVal = (float) currNode->getSplit();
+			const int axis = currNode->getAxis();
+			const KDNode * __restrict nearChild = currNode->getLeft();
+			const KDNode * __restrict farChild = nearChild + 1;
+			if (nearIsRight[axis])
+				std::swap(nearChild, farChild);
+			if (EXPECT_NOT_TAKEN(m_statistics))
+				steps += countRays(active);
+
+			/* Frustum test: bound the distance to the split plane for
+			   the whole packet using interval arithmetic */
+			float a = (splitVal - oMax[axis]) * dRcpMin[axis],
+			      b = (splitVal - oMax[axis]) * dRcpMax[axis],
+			      c = (splitVal - oMin[axis]) * dRcpMin[axis],
+			      d = (splitVal - oMin[axis]) * dRcpMax[axis];
+			float distMin = -std::numeric_limits<float>::infinity(),
+			      distMax =  std::numeric_limits<float>::infinity();
+			if (a == a && b == b && c == c && d == d) { /* No NaNs (0*inf) */
+				distMin = std::min(std::min(a, b), std::min(c, d));
+				distMax = std::max(std::max(a, b), std::max(c, d));
+			}
+
+			if (distMin > tMax) {
+				currNode = nearChild;
+				continue;
+			} else if (distMax < tMin) {
+				currNode = farChild;
+				continue;
+			}
+
+			/* Classify the individual rays. A ray visits the near child
+			   unless the split lies before its interval, and the far
+			   child unless the split lies after it (NaNs visit both) */
+			Packet dist[groupCount];
+			uint32_t before = 0, after = 0;
+			for (int g=0; g<groupCount; ++g) {
+				dist[g] = (Packet(splitVal) - origin[axis][g]) * dRcp[axis][g];
+				before |= (uint32_t) (dist[g] < tNear[g]).movemask() << (4*g);
+				after  |= (uint32_t) (dist[g] > tFar[g]).movemask() << (4*g);
+			}
+			uint32_t goNear = active & ~before, goFar = active & ~after;
+
+			if (goFar == 0) {
+				currNode = nearChild;
+				continue;
+			} else if (goNear == 0) {
+				currNode = farChild;
+				continue;
+			}
+
+			/* Both children need to be visited -- push the far one
+			   and clip the intervals at the split plane */
+			stack[stackPos].node = farChild;
+			stack[stackPos].active = goFar;
+			prefetch(farChild);
+			stack[stackPos].tMin = std::max(tMin, distMin);
+			stack[stackPos].tMax = tMax;
+			for (int g=0; g<groupCount; ++g) {
+				stack[stackPos].tNear[g] = Packet::select(dist[g] > tNear[g], dist[g], tNear[g]);
+				stack[stackPos].tFar[g] = tFar[g];
+				tFar[g] = Packet::select(dist[g] < tFar[g], dist[g], tFar[g]);
+			}
+			++stackPos;
+
+			tMax = std::min(tMax, distMax);
+			active = goNear;
+			currNode = nearChild;
+		}
+
+		/* Reached a leaf node */
+		IndexType start = currNode->getPrimStart(), end = currNode->getPrimEnd();
+		for (uint32_t i=0; i<count; ++i) {
+			if (!(active & (1 << i)))
+				continue;
+			++steps;
+			tests += end - start;
+			if (intersectLeaf(start, end, packet.rays[i], mint[i], maxt[i],
+					false, packet.its[i], primIndex[i]))
+				packet.hit[i] = true;
+
+			/* The closest intersection lies within this leaf */
+			if (maxt[i] <= tf[i])
+				alive &= ~(1 << i);
+		}
+
+		/* Pop from the stack, skipping nodes that lie beyond the
+		   closest intersections found so far */
+		active = 0;
+		while (stackPos > 0 && active == 0) {
+			--stackPos;
+			active = stack[stackPos].active & alive;
+			const float *entryNear = reinterpret_cast<const float *>(stack[stackPos].tNear);
+			for (uint32_t i=0; i<count; ++i) {
+				if ((active & (1 << i)) && entryNear[i] > maxt[i])
+					active &= ~(1 << i);
+			}
+		}
+
+		if (active != 0) {
+			currNode = stack[stackPos].node;
+			tMin = stack[stackPos].tMin;
+			tMax = stack[stackPos].tMax;
+			for (int g=0; g<groupCount; ++g) {
+				tNear[g] = stack[stackPos].tNear[g];
+				tFar[g] = stack[stackPos].tFar[g];
+			}
+		}
+	}
+
+	if (EXPECT_NOT_TAKEN(m_statistics))
+		recordTraversal(0, steps, tests);
+
+	for (uint32_t i=0; i<count; ++i) {
+		if (packet.hit[i])
+			fillIntersection(primIndex[i], packet.its[i]);
+	}
+}
+
+void KDTree::writeStatistics(const QString &filename) const {
+	/* Visit all nodes along with their bounding boxes and depths */
+	struct {
+		const KDNode *node;
+		BoundingBox3f bbox;
+		uint32_t depth;
+	} stack[NORI_KD_MAXDEPTH + 1];
+	uint32_t stackPos = 1;
+	stack[0].node = m_nodes;
+	stack[0].bbox = m_tightBBox;
+	stack[0].depth = 0;
+
+	int64_t innerNodes = 0, leaves = 0, emptyLeaves = 0;
+	IndexType maxPrimsInLeaf = 0;
+	std::vector<int64_t> depthHistogram;
+	double sahCost = 0;
+
+	while (stackPos > 0) {
+		--stackPos;
+		const KDNode *node = stack[stackPos].node;
+		const BoundingBox3f bbox = stack[stackPos].bbox;
+		const uint32_t depth = stack[stackPos].depth;
+		float area = SurfaceAreaHeuristic3::getQuantity(bbox);
+
+		if (node->isLeaf()) {
+			IndexType primCount = node->getPrimEnd() - node->getPrimStart();
+			sahCost += getQueryCost() * primCount * area;
+			maxPrimsInLeaf = std::max(maxPrimsInLeaf, primCount);
+			if (primCount == 0)
+				++emptyLeaves;
+			++leaves;
+			if (depthHistogram.size() <= depth)
+				depthHistogram.resize(depth + 1, 0);
+			++depthHistogram[depth];
+			continue;
+		}
+
+		sahCost += getTraversalCost() * area;
+		++innerNodes;
+
+		/* Push the right child first, which visits the leaves from left to right */
+		int axis = node->getAxis();
+		float split = (float) node->getSplit();
+		for (int i=1; i>=0; --i) {
+			stack[stackPos].node = node->getLeft() + i;
+			stack[stackPos].bbox = bbox;
+			if (i == 0)
+				stack[stackPos].bbox.max[axis] = split;
+			else
+				stack[stackPos].bbox.min[axis] = split;
+			stack[stackPos].depth = depth + 1;
+			++stackPos;
+		}
+	}
+	sahCost /= SurfaceAreaHeuristic3::getQuantity(m_tightBBox);
+
+	QFile file(filename);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+		cerr << "Warning: unable to write the kd-tree statistics to \""
+			 << qPrintable(filename) << "\"" << endl;
+		return;
+	}
+
+	IndexType primCount = getPrimitiveCount();
+	size_t nodeMemory = m_nodeCount * sizeof(KDNode),
+	       indexMemory = m_indexCount * sizeof(IndexType),
+	       triangleMemory = getTriangleBufferSize();
+	int64_t rays = m_statRays;
+
+	QString histogram;
+	for (size_t i=0; i<depthHistogram.size(); ++i)
+		histogram += QString(i == 0 ? "%1" : ", %1").arg((qlonglong) depthHistogram[i]);
+
+	QTextStream out(&file);
+	out << "{\n"
+		<< "  \"accel\": \"kdtree\",\n"
+		<< "  \"parameters\": {\n"
+		<< "    \"traversalCost\": " << getTraversalCost() << ",\n"
+		<< "    \"queryCost\": " << getQueryCost() << ",\n"
+		<< "    \"emptySpaceBonus\": " << getEmptySpaceBonus() << ",\n"
+		<< "    \"stopPrims\": " << getStopPrims() << ",\n"
+		<< "    \"clip\": " << (getClip() ? "true" : "false") << "\n"
+		<< "  },\n"
+		<< "  \"tree\": {\n"
+		<< "    \"triangles\": " << primCount << ",\n"
+		<< "    \"sahCost\": " << sahCost << ",\n"
+		<< "    \"innerNodes\": " << innerNodes << ",\n"
+		<< "    \"leaves\": " << leaves << ",\n"
+		<< "    \"emptyLeaves\": " << emptyLeaves << ",\n"
+		<< "    \"emptyLeafRatio\": " << (leaves > 0 ? emptyLeaves / (double) leaves : 0.0) << ",\n"
+		<< "    \"maxDepth\": " << (int) depthHistogram.size() - 1 << ",\n"
+		<< "    \"leafDepthHistogram\": [" << histogram << "],\n"
+		<< "    \"maxTrianglesInLeaf\": " << maxPrimsInLeaf << ",\n"
+		<< "    \"duplicationFactor\": " << (primCount > 0 ? m_indexCount / (double) primCount : 0.0) << "\n"
+		<< "  },\n"
+		<< "  \"memory\": {\n"
+		<< "    \"nodes\": " << (qulonglong) nodeMemory << ",\n"
+		<< "    \"indices\": " << (qulonglong) indexMemory << ",\n"
+		<< "    \"triangles\": " << (qulonglong) triangleMemory << ",\n"
+		<< "    \"total\": " << (qulonglong) (nodeMemory + indexMemory + triangleMemory) << "\n"
+		<< "  },\n"
+		<< "  \"traversal\": {\n"
+		<< "    \"rays\": " << rays << ",\n"
+		<< "    \"nodesPerRay\": " << (rays > 0 ? m_statSteps / (double) rays : 0.0) << ",\n"
+		<< "    \"trianglesPerRay\": " << (rays > 0 ? m_statTests / (double) rays : 0.0) << "\n"
+		<< "  }\n"
+		<< "}\n";
+	out.flush();
+
+	cout << "Wrote the kd-tree statistics to \"" << qPrintable(filename) << "\"" << endl;
+}
+
+QString KDTree::toString() const {
+	return QString("KDTree[traversalCost=%1, queryCost=%2, emptySpaceBonus=%3, "
+		"stopPrims=%4, clip=%5, cache=%6]")
+		.arg(getTraversalCost())
+		.arg(getQueryCost())
+		.arg(getEmptySpaceBonus())
+		.arg(getStopPrims())
+		.arg(getClip() ? "true" : "false")
+		.arg(m_cache ? m_cacheDir : QString("false"));
 }
 
+NORI_REGISTER_CLASS(KDTree, "kdtree");
 NORI_NAMESPACE_END
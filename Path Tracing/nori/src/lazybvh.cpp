@@ -0,0 +1,257 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/lazybvh.h>
+#include <QMutexLocker>
+
+NORI_NAMESPACE_BEGIN
+
+LazyBVH::LazyBVH(const PropertyList &propList) : BVH(propList), m_propList(propList) {
+	/* Subtrees with at most this many triangles are built on demand */
+	int lazyThreshold = propList.getInteger("lazyThreshold", 4096);
+
+	if (lazyThreshold < 1)
+		throw NoriException("The lazy build threshold must be >= 1");
+	if (m_compressed)
+		throw NoriException("LazyBVH: the compressed representation is only "
+			"supported by the binary BVH!");
+
+	m_lazyThreshold = (uint32_t) lazyThreshold;
+	m_packetBuffer = false;
+}
+
+LazyBVH::~LazyBVH() {
+	for (size_t i=0; i<m_subtrees.size(); ++i)
+		delete[] (BVHNode *) m_subtrees[i].nodes;
+}
+
+void LazyBVH::build() {
+	BVH::build();
+
+	/* Store the right child relative to its parent, which stays valid
+	   within subtrees that are allocated separately */
+	uint32_t deferred = 0;
+	for (size_t i=0; i<m_nodes.size(); ++i) {
+		BVHNode &node = m_nodes[i];
+		if (node.flags == EUnexpanded)
+			deferred += m_subtrees[node.offset].count;
+		else if (!node.isLeaf())
+			node.offset -= (uint32_t) i;
+	}
+
+	if (!m_subtrees.empty())
+		cout << "Deferred the construction of " << m_subtrees.size() << " subtrees ("
+			<< deferred << " triangles)" << endl;
+}
+
+void LazyBVH::update(const std::vector<const Mesh *> &changed) {
+	/* The subtrees use relative offsets, which the refit does not expect */
+	Accel::update(changed);
+}
+
+void LazyBVH::clear() {
+	for (size_t i=0; i<m_subtrees.size(); ++i)
+		delete[] (BVHNode *) m_subtrees[i].nodes;
+	m_subtrees.clear();
+	m_expandedCount = 0;
+	BVH::clear();
+}
+
+bool LazyBVH::deferSubtree(uint32_t nodeIdx, BuildPrimitive *prims,
+		uint32_t start, uint32_t end, uint32_t depth) {
+	uint32_t primCount = end - start;
+	if (primCount > m_lazyThreshold || primCount <= (uint32_t) m_maxLeafSize)
+		return false;
+
+	LazySubtree subtree;
+	subtree.offset = (uint32_t) m_indices.size();
+	subtree.count = primCount;
+	subtree.depth = depth;
+	subtree.nodes = NULL;
+	for (uint32_t i=start; i<end; ++i)
+		m_indices.push_back(prims[i].index);
+
+	BVHNode &node = m_nodes[nodeIdx];
+	node.offset = (uint32_t) m_subtrees.size();
+	node.primCount = 0;
+	node.axis = 0;
+	node.flags = EUnexpanded;
+	m_subtrees.push_back(subtree);
+	return true;
+}
+
+const LazyBVH::BVHNode *LazyBVH::expand(uint32_t index) const {
+	const LazySubtree &subtree = m_subtrees[index];
+
+	BVHNode *nodes = subtree.nodes;
+	if (EXPECT_TAKEN(nodes != NULL))
+		return nodes;
+
+	QMutexLocker locker(&m_locks[index % NORI_LAZYBVH_LOCKS]);
+
+	/* Another thread may have built the subtree in the meantime */
+	nodes = subtree.nodes;
+	if (nodes != NULL)
+		return nodes;
+
+	/* The triangle buffer contains the subtree's triangles in build order */
+	BuildPrimitive *prims = new BuildPrimitive[subtree.count];
+	for (uint32_t i=0; i<subtree.count; ++i) {
+		const TriAccel &tri = m_triangles[subtree.offset + i];
+		BuildPrimitive &prim = prims[i];
+		prim.bbox = m_meshes[tri.meshIndex]->getBoundingBox(tri.primIndex);
+		prim.centroid = prim.bbox.getCenter();
+		prim.index = tri.index;
+	}
+
+	SubtreeBuilder builder(m_propList);
+	builder.buildSubtree(prims, subtree.count, subtree.depth);
+	delete[] prims;
+
+	/* Nobody else reads this part of the triangle buffer before the
+	   subtree has been published, hence it can be reordered in place */
+	const std::vector<IndexType> &indices = builder.getIndices();
+	for (uint32_t i=0; i<subtree.count; ++i) {
+		IndexType primIndex = indices[i];
+		uint32_t meshIdx = findMesh(primIndex);
+		fillTriAccel(m_triangles[subtree.offset + i], meshIdx, primIndex);
+	}
+
+	const std::vector<BVHNode> &builderNodes = builder.getNodes();
+	nodes = new BVHNode[builderNodes.size()];
+	for (size_t i=0; i<builderNodes.size(); ++i) {
+		BVHNode &node = nodes[i];
+		node = builderNodes[i];
+		node.flags = 0;
+		if (node.isLeaf())
+			node.offset += subtree.offset;
+		else
+			node.offset -= (uint32_t) i;
+	}
+
+	subtree.nodes.fetchAndStoreOrdered(nodes);
+	m_expandedCount.ref();
+	return nodes;
+}
+
+bool LazyBVH::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const {
+	its.t = std::numeric_limits<float>::infinity();
+
+	if (m_nodes.empty())
+		return false;
+
+	/* Use an adaptive ray epsilon */
+	float mint = ray.mint, maxt = ray.maxt;
+	if (mint == Epsilon)
+		mint = std::max(mint, mint * ray.o.array().abs().maxCoeff());
+
+	if (maxt < mint)
+		return false;
+
+	/* Traversal stack holding the far children */
+	const BVHNode *stack[NORI_BVH_MAXDEPTH];
+	const BVHNode *node = &m_nodes[0];
+	uint32_t stackPos = 0;
+
+	bool foundIntersection = false;
+	IndexType foundPrimIndex = 0;
+
+	while (true) {
+		if (intersectBox(node->bbox, ray, mint, maxt)) {
+			if (EXPECT_TAKEN(!node->isLeaf())) {
+				if (EXPECT_NOT_TAKEN(node->flags == EUnexpanded)) {
+					/* Continue with the root of the subtree (same bounds) */
+					node = expand(node->offset);
+					continue;
+				}
+
+				/* Visit the near child first */
+				if (ray.d[node->axis] < 0) {
+					stack[stackPos++] = node + 1;
+					node = node + node->offset;
+				} else {
+					stack[stackPos++] = node + node->offset;
+					node = node + 1;
+				}
+				continue;
+			}
+
+			if (intersectLeaf(node->offset, node->offset + node->primCount,
+					ray, mint, maxt, shadowRay, its, foundPrimIndex)) {
+				if (shadowRay)
+					return true;
+				foundIntersection = true;
+			}
+		}
+
+		if (stackPos == 0)
+			break;
+		node = stack[--stackPos];
+	}
+
+	if (foundIntersection && !shadowRay)
+		fillIntersection(foundPrimIndex, its);
+
+	return foundIntersection;
+}
+
+bool LazyBVH::findOccluder(const Ray3f &ray, float mint, float maxt, IndexType &entry) const {
+	if (m_nodes.empty())
+		return false;
+
+	/* Any hit will do -- the children are visited in memory order */
+	const BVHNode *stack[NORI_BVH_MAXDEPTH];
+	const BVHNode *node = &m_nodes[0];
+	uint32_t stackPos = 0;
+
+	while (true) {
+		if (intersectBox(node->bbox, ray, mint, maxt)) {
+			if (EXPECT_TAKEN(!node->isLeaf())) {
+				if (EXPECT_NOT_TAKEN(node->flags == EUnexpanded))
+					node = expand(node->offset);
+				else {
+					stack[stackPos++] = node + node->offset;
+					node = node + 1;
+				}
+				continue;
+			}
+
+			if (occludedLeaf(node->offset, node->offset + node->primCount,
+					ray, mint, maxt, entry))
+				return true;
+		}
+
+		if (stackPos == 0)
+			break;
+		node = stack[--stackPos];
+	}
+
+	return false;
+}
+
+QString LazyBVH::toString() const {
+	return QString("LazyBVH[traversalCost=%1, queryCost=%2, binCount=%3, maxLeafSize=%4, lazyThreshold=%5]")
+		.arg(m_traversalCost)
+		.arg(m_queryCost)
+		.arg(m_binCount)
+		.arg(m_maxLeafSize)
+		.arg(m_lazyThreshold);
+}
+
+NORI_REGISTER_CLASS(LazyBVH, "lazybvh");
+NORI_NAMESPACE_END
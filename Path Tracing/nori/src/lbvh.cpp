@@ -0,0 +1,450 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/lbvh.h>
+#include <QElapsedTimer>
+#include <QThread>
+
+/// Inputs with fewer primitives are sorted by the calling thread alone
+#define NORI_LBVH_PARALLEL_THRESHOLD 65536
+
+NORI_NAMESPACE_BEGIN
+
+/// Quantize a coordinate to 10 bits
+static inline uint32_t quantize(float value, float min, float scale) {
+	float q = (value - min) * scale;
+	return (uint32_t) std::max(0.0f, std::min(q, 1023.0f));
+}
+
+namespace {
+	/**
+	 * \brief Processes one chunk of the input during a pass of the
+	 * radix sort: first counting the 8-bit digits, then moving the
+	 * elements to the offsets computed from the counts of all chunks
+	 */
+	template <typename T> class RadixSortWorker : public QThread {
+	public:
+		const T *source;
+		T *target;
+		uint32_t begin, end;
+		int shift;
+		bool scatter;
+		uint32_t histogram[256];
+		uint32_t offsets[256];
+
+		void process() {
+			if (!scatter) {
+				memset(histogram, 0, sizeof(histogram));
+				for (uint32_t i=begin; i<end; ++i)
+					histogram[(source[i].code >> shift) & 0xFF]++;
+			} else {
+				for (uint32_t i=begin; i<end; ++i)
+					target[offsets[(source[i].code >> shift) & 0xFF]++] = source[i];
+			}
+		}
+	protected:
+		void run() {
+			process();
+		}
+	};
+
+	/// Run one phase of the radix sort on all workers
+	template <typename T> void runWorkers(RadixSortWorker<T> *workers, int count) {
+		if (count == 1) {
+			workers[0].process();
+			return;
+		}
+		for (int i=0; i<count; ++i)
+			workers[i].start();
+		for (int i=0; i<count; ++i)
+			workers[i].wait();
+	}
+
+	/// Dynamic programming tables of a treelet
+	struct Treelet {
+		uint32_t leaves[NORI_LBVH_TREELET_SIZE];
+		uint32_t internal[NORI_LBVH_TREELET_SIZE - 1];
+		BoundingBox3f bbox[1 << NORI_LBVH_TREELET_SIZE];
+		float cost[1 << NORI_LBVH_TREELET_SIZE];
+		uint8_t partition[1 << NORI_LBVH_TREELET_SIZE];
+		int next;
+	};
+
+	/// Index of the lowest set bit
+	inline int lowestBit(uint32_t value) {
+		int index = 0;
+		while (!(value & 1)) {
+			value >>= 1;
+			++index;
+		}
+		return index;
+	}
+
+	/**
+	 * \brief Recreate the part of a treelet that contains the given subset
+	 * of its leaves according to the optimal partitions, reusing the inner
+	 * nodes of the original treelet
+	 */
+	template <typename Node> uint32_t rebuildTreelet(std::vector<Node> &nodes,
+			Treelet &treelet, uint32_t subset) {
+		if ((subset & (subset - 1)) == 0)
+			return treelet.leaves[lowestBit(subset)];
+
+		uint32_t nodeIdx = treelet.internal[treelet.next++];
+		uint32_t part = treelet.partition[subset];
+		uint32_t left = rebuildTreelet(nodes, treelet, part),
+		         right = rebuildTreelet(nodes, treelet, subset ^ part);
+
+		/* Order the children along the axis that separates their centers
+		   the most, which is used to visit the near child first */
+		Vector3f delta = nodes[right].bbox.getCenter() - nodes[left].bbox.getCenter();
+		int axis = 0;
+		for (int i=1; i<3; ++i) {
+			if (std::abs(delta[i]) > std::abs(delta[axis]))
+				axis = i;
+		}
+		if (delta[axis] < 0)
+			std::swap(left, right);
+
+		Node &node = nodes[nodeIdx];
+		node.bbox = treelet.bbox[subset];
+		node.left = left;
+		node.right = right;
+		node.primCount = nodes[left].primCount + nodes[right].primCount;
+		node.cost = treelet.cost[subset];
+		node.axis = (uint8_t) axis;
+		node.leaf = false;
+		return nodeIdx;
+	}
+}
+
+LBVH::LBVH(const PropertyList &propList) : BVH(propList), m_treeletCount(0) {
+	/* Ranges of sorted triangles up to this size become leaves */
+	m_leafSize = propList.getInteger("leafSize", 4);
+
+	/* Reorganize treelets after the build to improve the SAH cost? */
+	m_treeletOptimization = propList.getBoolean("treeletOptimization", false);
+
+	/* Number of threads used by the radix sort */
+	m_threadCount = propList.getInteger("buildThreads", getCoreCount());
+
+	if (m_leafSize < 1 || m_leafSize > m_maxLeafSize)
+		throw NoriException("The leaf size must be in [1, maxLeafSize]");
+	if (m_threadCount < 1)
+		throw NoriException("The number of build threads must be >= 1");
+}
+
+void LBVH::buildHierarchy(BuildPrimitive *prims, uint32_t primCount) {
+	QElapsedTimer timer;
+	timer.start();
+
+	/* Compute the Morton codes of the centroids */
+	BoundingBox3f centroidBBox;
+	for (uint32_t i=0; i<primCount; ++i)
+		centroidBBox.expandBy(prims[i].centroid);
+
+	float scale[3];
+	for (int i=0; i<3; ++i) {
+		float extent = centroidBBox.max[i] - centroidBBox.min[i];
+		scale[i] = extent > 0 ? 1024.0f / extent : 0.0f;
+	}
+
+	std::vector<MortonPrimitive> codes(primCount);
+	for (uint32_t i=0; i<primCount; ++i) {
+		const Point3f &c = prims[i].centroid;
+		uint32_t x = quantize(c.x(), centroidBBox.min.x(), scale[0]),
+		         y = quantize(c.y(), centroidBBox.min.y(), scale[1]),
+		         z = quantize(c.z(), centroidBBox.min.z(), scale[2]);
+		codes[i].code = (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+		codes[i].index = i;
+	}
+
+	radixSort(codes);
+	qint64 sortTime = timer.elapsed();
+
+	std::vector<BuildPrimitive> sorted(primCount);
+	for (uint32_t i=0; i<primCount; ++i)
+		sorted[i] = prims[codes[i].index];
+
+	m_tempNodes.reserve(2 * (primCount / m_leafSize) + 1);
+	emitRecursive(&codes[0], &sorted[0], 0, primCount, 0);
+	std::vector<MortonPrimitive>().swap(codes);
+
+	m_treeletCount = 0;
+	if (m_treeletOptimization)
+		optimizeRecursive(0);
+
+	flattenRecursive(0, &sorted[0], 0);
+	std::vector<TempNode>().swap(m_tempNodes);
+
+	cout << "Sorted the Morton codes after " << sortTime << " ms";
+	if (m_treeletOptimization)
+		cout << ", reorganized " << m_treeletCount << " treelets";
+	cout << " (" << timer.elapsed() << " ms in total)" << endl;
+}
+
+void LBVH::radixSort(std::vector<MortonPrimitive> &prims) const {
+	uint32_t count = (uint32_t) prims.size();
+	if (count == 0)
+		return;
+
+	std::vector<MortonPrimitive> temp(count);
+	int threadCount = count < NORI_LBVH_PARALLEL_THRESHOLD ? 1 : m_threadCount;
+	RadixSortWorker<MortonPrimitive> *workers = new RadixSortWorker<MortonPrimitive>[threadCount];
+
+	MortonPrimitive *source = &prims[0], *target = &temp[0];
+	for (int shift=0; shift<30; shift += 8) {
+		for (int i=0; i<threadCount; ++i) {
+			RadixSortWorker<MortonPrimitive> &worker = workers[i];
+			worker.source = source;
+			worker.target = target;
+			worker.begin = (uint32_t) (((uint64_t) count * i) / threadCount);
+			worker.end = (uint32_t) (((uint64_t) count * (i+1)) / threadCount);
+			worker.shift = shift;
+			worker.scatter = false;
+		}
+		runWorkers(workers, threadCount);
+
+		/* Digits are placed in order, and each digit in chunk order,
+		   which keeps the sort stable */
+		uint32_t offset = 0;
+		for (int digit=0; digit<256; ++digit) {
+			for (int i=0; i<threadCount; ++i) {
+				workers[i].offsets[digit] = offset;
+				offset += workers[i].histogram[digit];
+			}
+		}
+
+		for (int i=0; i<threadCount; ++i)
+			workers[i].scatter = true;
+		runWorkers(workers, threadCount);
+
+		std::swap(source, target);
+	}
+	delete[] workers;
+
+	if (source != &prims[0])
+		prims.swap(temp);
+}
+
+uint32_t LBVH::emitRecursive(const MortonPrimitive *codes, const BuildPrimitive *prims,
+		uint32_t start, uint32_t end, uint32_t depth) {
+	uint32_t nodeIdx = (uint32_t) m_tempNodes.size();
+	m_tempNodes.push_back(TempNode());
+
+	uint32_t primCount = end - start;
+	uint32_t diff = codes[start].code ^ codes[end-1].code;
+
+	if (primCount <= (uint32_t) m_leafSize || depth + 1 >= NORI_BVH_MAXDEPTH ||
+		(diff == 0 && primCount <= (uint32_t) m_maxLeafSize)) {
+		TempNode &node = m_tempNodes[nodeIdx];
+		node.bbox.reset();
+		for (uint32_t i=start; i<end; ++i)
+			node.bbox.expandBy(prims[i].bbox);
+		node.left = start;
+		node.right = 0;
+		node.primCount = primCount;
+		node.cost = m_queryCost * primCount * node.bbox.getSurfaceArea();
+		node.axis = 0;
+		node.leaf = true;
+		return nodeIdx;
+	}
+
+	uint32_t mid;
+	int axis;
+	if (diff == 0) {
+		/* Identical codes -- split in the middle */
+		mid = start + primCount / 2;
+		axis = 0;
+	} else {
+		/* Split where the highest differing bit changes from 0 to 1. The
+		   bits are interleaved as xyz, hence they map to the axes */
+		int bit = 29;
+		while (!(diff & (1u << bit)))
+			--bit;
+		axis = 2 - bit % 3;
+
+		uint32_t lo = start, hi = end - 1;
+		while (lo + 1 < hi) {
+			uint32_t m = lo + (hi - lo) / 2;
+			if (codes[m].code & (1u << bit))
+				hi = m;
+			else
+				lo = m;
+		}
+		mid = hi;
+	}
+
+	uint32_t left = emitRecursive(codes, prims, start, mid, depth + 1);
+	uint32_t right = emitRecursive(codes, prims, mid, end, depth + 1);
+
+	TempNode &node = m_tempNodes[nodeIdx];
+	node.bbox = m_tempNodes[left].bbox;
+	node.bbox.expandBy(m_tempNodes[right].bbox);
+	node.left = left;
+	node.right = right;
+	node.primCount = primCount;
+	node.cost = m_traversalCost * node.bbox.getSurfaceArea()
+		+ m_tempNodes[left].cost + m_tempNodes[right].cost;
+	node.axis = (uint8_t) axis;
+	node.leaf = false;
+	return nodeIdx;
+}
+
+void LBVH::optimizeRecursive(uint32_t nodeIdx) {
+	if (m_tempNodes[nodeIdx].leaf)
+		return;
+
+	optimizeRecursive(m_tempNodes[nodeIdx].left);
+	optimizeRecursive(m_tempNodes[nodeIdx].right);
+
+	/* The subtrees may have been reorganized */
+	TempNode &node = m_tempNodes[nodeIdx];
+	node.cost = m_traversalCost * node.bbox.getSurfaceArea()
+		+ m_tempNodes[node.left].cost + m_tempNodes[node.right].cost;
+
+	if (optimizeTreelet(nodeIdx))
+		m_treeletCount++;
+}
+
+bool LBVH::optimizeTreelet(uint32_t rootIdx) {
+	Treelet treelet;
+	treelet.internal[0] = rootIdx;
+	treelet.leaves[0] = m_tempNodes[rootIdx].left;
+	treelet.leaves[1] = m_tempNodes[rootIdx].right;
+	int leafCount = 2, internalCount = 1;
+
+	/* Grow the treelet by repeatedly expanding the largest leaf */
+	while (leafCount < NORI_LBVH_TREELET_SIZE) {
+		int largest = -1;
+		float largestArea = -1;
+		for (int i=0; i<leafCount; ++i) {
+			const TempNode &node = m_tempNodes[treelet.leaves[i]];
+			if (!node.leaf && node.bbox.getSurfaceArea() > largestArea) {
+				largest = i;
+				largestArea = node.bbox.getSurfaceArea();
+			}
+		}
+		if (largest == -1)
+			break;
+
+		const TempNode &node = m_tempNodes[treelet.leaves[largest]];
+		treelet.internal[internalCount++] = treelet.leaves[largest];
+		treelet.leaves[largest] = node.left;
+		treelet.leaves[leafCount++] = node.right;
+	}
+
+	/* Two leaves only admit a single topology */
+	if (leafCount < 3)
+		return false;
+
+	/* Bounds of all subsets of the treelet's leaves */
+	uint32_t subsetCount = 1u << leafCount;
+	for (uint32_t s=1; s<subsetCount; ++s) {
+		uint32_t lowest = s & (~s + 1);
+		const TempNode &leaf = m_tempNodes[treelet.leaves[lowestBit(lowest)]];
+		if (s == lowest) {
+			treelet.bbox[s] = leaf.bbox;
+			treelet.cost[s] = leaf.cost;
+		} else {
+			treelet.bbox[s] = treelet.bbox[s ^ lowest];
+			treelet.bbox[s].expandBy(leaf.bbox);
+		}
+	}
+
+	/* Optimal cost of each subset over all of its partitions. Subsets
+	   of a set are numerically smaller, hence they are processed first */
+	for (uint32_t s=1; s<subsetCount; ++s) {
+		uint32_t lowest = s & (~s + 1);
+		if (s == lowest)
+			continue;
+
+		/* Only visit partitions where the lowest leaf is on the left side */
+		float bestCost = std::numeric_limits<float>::infinity();
+		uint32_t bestPart = lowest;
+		for (uint32_t p=(s - 1) & s; p != 0; p = (p - 1) & s) {
+			if (!(p & lowest))
+				continue;
+			float cost = treelet.cost[p] + treelet.cost[s ^ p];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestPart = p;
+			}
+		}
+		treelet.cost[s] = m_traversalCost * treelet.bbox[s].getSurfaceArea() + bestCost;
+		treelet.partition[s] = (uint8_t) bestPart;
+	}
+
+	uint32_t all = subsetCount - 1;
+	if (treelet.cost[all] >= m_tempNodes[rootIdx].cost * (1 - 1e-4f))
+		return false;
+
+	treelet.next = 0;
+	rebuildTreelet(m_tempNodes, treelet, all);
+	return true;
+}
+
+void LBVH::flattenRecursive(uint32_t tempIdx, BuildPrimitive *prims, uint32_t depth) {
+	uint32_t nodeIdx = (uint32_t) m_nodes.size();
+	m_nodes.push_back(BVHNode());
+	m_maxDepth = std::max(m_maxDepth, depth);
+
+	const TempNode &temp = m_tempNodes[tempIdx];
+	m_nodes[nodeIdx].bbox = temp.bbox;
+
+	if (temp.leaf) {
+		createLeaf(nodeIdx, prims, temp.left, temp.left + temp.primCount);
+		return;
+	}
+
+	if (depth + 1 >= NORI_BVH_MAXDEPTH) {
+		/* Treelet reorganization made the hierarchy too deep */
+		std::vector<BuildPrimitive> subtree;
+		collectRecursive(tempIdx, prims, subtree);
+		createLeaf(nodeIdx, &subtree[0], 0, (uint32_t) subtree.size());
+		return;
+	}
+
+	flattenRecursive(temp.left, prims, depth + 1);
+	m_nodes[nodeIdx].offset = (uint32_t) m_nodes.size();
+	m_nodes[nodeIdx].primCount = 0;
+	m_nodes[nodeIdx].axis = temp.axis;
+	flattenRecursive(temp.right, prims, depth + 1);
+}
+
+void LBVH::collectRecursive(uint32_t tempIdx, const BuildPrimitive *prims,
+		std::vector<BuildPrimitive> &result) const {
+	const TempNode &temp = m_tempNodes[tempIdx];
+	if (temp.leaf) {
+		result.insert(result.end(), prims + temp.left, prims + temp.left + temp.primCount);
+	} else {
+		collectRecursive(temp.left, prims, result);
+		collectRecursive(temp.right, prims, result);
+	}
+}
+
+QString LBVH::toString() const {
+	return QString("LBVH[traversalCost=%1, queryCost=%2, leafSize=%3, treeletOptimization=%4]")
+		.arg(m_traversalCost)
+		.arg(m_queryCost)
+		.arg(m_leafSize)
+		.arg(m_treeletOptimization ? "true" : "false");
+}
+
+NORI_REGISTER_CLASS(LBVH, "lbvh");
+NORI_NAMESPACE_END
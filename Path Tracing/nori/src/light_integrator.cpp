@@ -83,7 +83,7 @@ public:
                 
                 if (dp > 0) {
                         // 5. Check the visibility
-                        if (scene->rayIntersect(Ray3f(lRec.ref, lRec.d, Epsilon, lRec.dist * (1 - 1e-4f))))
+                        if (scene->occluded(Ray3f(lRec.ref, lRec.d, Epsilon, lRec.dist * (1 - 1e-4f))))
                                 return Color3f(0.0f);
                         // 6. Geometry term on luminaire's side
                         // Visiblity + Geometric term on the luminaire's side 
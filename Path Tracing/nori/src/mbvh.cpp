@@ -0,0 +1,31 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mbvh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// 4-wide hierarchy (one SSE slab test per node)
+typedef MBVH<4> QBVH;
+
+/// 8-wide hierarchy (one AVX slab test per node, or two SSE tests)
+typedef MBVH<8> OBVH;
+
+NORI_REGISTER_CLASS(QBVH, "qbvh");
+NORI_REGISTER_CLASS(OBVH, "obvh");
+NORI_NAMESPACE_END
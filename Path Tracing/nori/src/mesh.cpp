@@ -22,22 +22,43 @@
 #include <nori/luminaire.h>
 #include <nori/transform.h>
 #include <Eigen/Geometry>
+#include <QFile>
+#include <QElapsedTimer>
 
 #define NORI_TRICLIP_MAXVERTS 10
 
+/// Number of entries of the FIFO vertex cache that is simulated by the locality metrics
+#define NORI_REORDER_CACHE_SIZE 32
+
 NORI_NAMESPACE_BEGIN
 
 Mesh::Mesh(const PropertyList& propList) : m_vertexPositions(0), m_vertexNormals(0),
   m_vertexTexCoords(0), m_indices(0), m_vertexCount(0),
-  m_triangleCount(0), m_bsdf(NULL), m_luminaire(NULL), m_originalTransform(propList.getTransform("toWorld", Transform())) { }
+  m_triangleCount(0), m_bsdf(NULL), m_luminaire(NULL), m_id(propList.getString("id", "")),
+  m_originalTransform(propList.getTransform("toWorld", Transform())),
+  m_mappedFile(NULL), m_reorder(propList.getBoolean("reorder", false)),
+  m_compressed(propList.getBoolean("compressed", false)),
+  m_packedNormals(NULL), m_packedTexCoords(NULL), m_shortIndices(NULL) { }
 
 Mesh::~Mesh() {
+	if (m_mappedFile) {
+		/* The arrays point into the memory mapping -- don't free them */
+		m_vertexPositions = NULL;
+		m_vertexNormals = NULL;
+		m_vertexTexCoords = NULL;
+		m_indices = NULL;
+		delete m_mappedFile;
+	}
+
 	delete[] m_vertexPositions;
 	if (m_vertexNormals)
 		delete[] m_vertexNormals;
 	if (m_vertexTexCoords)
 		delete[] m_vertexTexCoords;
 	delete[] m_indices;
+	delete[] m_packedNormals;
+	delete[] m_packedTexCoords;
+	delete[] m_shortIndices;
 
 	if (m_bsdf)
 		delete m_bsdf;
@@ -46,11 +67,14 @@ Mesh::~Mesh() {
 }
 
 void Mesh::activate() {
+	if (m_reorder)
+		reorder();
+
 	/* Create a discrete distribution for sampling triangles
 	   with respect to their surface area */
 	m_distr.clear();
 	m_distr.reserve(m_triangleCount);
-	for (uint32_t i=0; i<m_triangleCount; ++i)
+	for (IndexType i=0; i<m_triangleCount; ++i)
 		m_distr.append(surfaceArea(i));
 	m_distr.normalize();
 
@@ -59,6 +83,247 @@ void Mesh::activate() {
 		m_bsdf = static_cast<BSDF *>(
 			NoriObjectFactory::createInstance("diffuse", PropertyList()));
 	}
+
+	if (m_compressed)
+		compress();
+}
+
+void Mesh::compress() {
+	size_t before = 0, after = 0;
+
+	if (m_vertexNormals) {
+		m_packedNormals = new uint32_t[m_vertexCount];
+		for (IndexType i=0; i<m_vertexCount; ++i)
+			m_packedNormals[i] = encodeOctahedral(m_vertexNormals[i]);
+		before += sizeof(Normal3f) * m_vertexCount;
+		after += sizeof(uint32_t) * m_vertexCount;
+	}
+
+	if (m_vertexTexCoords) {
+		m_packedTexCoords = new half[2 * (size_t) m_vertexCount];
+		for (IndexType i=0; i<m_vertexCount; ++i) {
+			m_packedTexCoords[2*i]   = half(m_vertexTexCoords[i].x());
+			m_packedTexCoords[2*i+1] = half(m_vertexTexCoords[i].y());
+		}
+		before += sizeof(Point2f) * m_vertexCount;
+		after += sizeof(half) * 2 * (size_t) m_vertexCount;
+	}
+
+	size_t indexCount = 3 * (size_t) m_triangleCount;
+	if (m_indices && m_vertexCount <= 0x10000) {
+		m_shortIndices = new uint16_t[indexCount];
+		for (size_t i=0; i<indexCount; ++i)
+			m_shortIndices[i] = (uint16_t) m_indices[i];
+		before += sizeof(IndexType) * indexCount;
+		after += sizeof(uint16_t) * indexCount;
+	}
+
+	/* Arrays that point into a memory mapping are simply not touched
+	   anymore, which leaves their pages to the operating system */
+	if (!m_mappedFile) {
+		delete[] m_vertexNormals;
+		delete[] m_vertexTexCoords;
+		if (m_shortIndices)
+			delete[] m_indices;
+	}
+	m_vertexNormals = NULL;
+	m_vertexTexCoords = NULL;
+	if (m_shortIndices)
+		m_indices = NULL;
+
+	if (before > 0)
+		cout << "Compressed the vertex attributes of \"" << qPrintable(m_name) << "\" ("
+			 << before / 1024 << " KiB -> " << after / 1024 << " KiB)" << endl;
+}
+
+/// Locality of the triangle and vertex order of a mesh (used by Mesh::reorder())
+struct MeshLocality {
+	/// Average distance between the smallest and largest vertex index of a triangle
+	double vertexSpan;
+	/// Average number of misses per triangle in a simulated FIFO vertex cache
+	double acmr;
+	/// Average distance between the centroids of consecutive triangles (relative to the bounding box diagonal)
+	double centroidDistance;
+};
+
+static MeshLocality measureLocality(const Point3f *positions, const IndexType *indices,
+		IndexType triangleCount, float diagonal) {
+	IndexType cache[NORI_REORDER_CACHE_SIZE];
+	std::fill(cache, cache + NORI_REORDER_CACHE_SIZE, (IndexType) -1);
+	int cacheHead = 0;
+
+	double span = 0, misses = 0, distance = 0;
+	Point3f lastCentroid;
+	for (IndexType i=0; i<triangleCount; ++i) {
+		const IndexType *tri = indices + 3 * (size_t) i;
+		span += std::max(tri[0], std::max(tri[1], tri[2]))
+		      - std::min(tri[0], std::min(tri[1], tri[2]));
+
+		for (int j=0; j<3; ++j) {
+			if (std::find(cache, cache + NORI_REORDER_CACHE_SIZE, tri[j]) != cache + NORI_REORDER_CACHE_SIZE)
+				continue;
+			cache[cacheHead] = tri[j];
+			cacheHead = (cacheHead + 1) % NORI_REORDER_CACHE_SIZE;
+			misses += 1;
+		}
+
+		Point3f centroid = (positions[tri[0]] + positions[tri[1]] + positions[tri[2]]) / 3.0f;
+		if (i > 0)
+			distance += (centroid - lastCentroid).norm();
+		lastCentroid = centroid;
+	}
+
+	MeshLocality result;
+	result.vertexSpan = triangleCount > 0 ? span / triangleCount : 0;
+	result.acmr = triangleCount > 0 ? misses / triangleCount : 0;
+	result.centroidDistance = (triangleCount > 1 && diagonal > 0)
+		? distance / ((triangleCount - 1) * (double) diagonal) : 0;
+	return result;
+}
+
+void Mesh::reorder() {
+	if (m_triangleCount == 0)
+		return;
+
+	QElapsedTimer timer;
+	timer.start();
+
+	/* The arrays are modified in place */
+	releaseMapping();
+
+	BoundingBox3f bbox;
+	for (IndexType i=0; i<m_vertexCount; ++i)
+		bbox.expandBy(m_vertexPositions[i]);
+	float diagonal = bbox.getExtents().norm();
+	MeshLocality before = measureLocality(m_vertexPositions, m_indices, m_triangleCount, diagonal);
+
+	/* Compute the Morton codes of the triangle centroids */
+	float scale[3];
+	for (int i=0; i<3; ++i) {
+		float extent = bbox.max[i] - bbox.min[i];
+		scale[i] = extent > 0 ? 1024.0f / extent : 0.0f;
+	}
+
+	std::vector<std::pair<uint32_t, IndexType> > codes(m_triangleCount);
+	for (IndexType i=0; i<m_triangleCount; ++i) {
+		Point3f centroid = (m_vertexPositions[m_indices[3*(size_t) i]] +
+			m_vertexPositions[m_indices[3*(size_t) i+1]] +
+			m_vertexPositions[m_indices[3*(size_t) i+2]]) / 3.0f;
+
+		uint32_t code = 0;
+		for (int j=0; j<3; ++j) {
+			int q = clamp((int) ((centroid[j] - bbox.min[j]) * scale[j]), 0, 1023);
+			code |= expandBits((uint32_t) q) << (2 - j);
+		}
+		codes[i] = std::make_pair(code, i);
+	}
+	std::sort(codes.begin(), codes.end());
+
+	/* Emit the triangles in curve order and number the vertices by first use */
+	std::vector<IndexType> vertexMap(m_vertexCount, (IndexType) -1);
+	IndexType *indices = new IndexType[3 * (size_t) m_triangleCount];
+	IndexType vertexCount = 0;
+	for (IndexType i=0; i<m_triangleCount; ++i) {
+		const IndexType *tri = m_indices + 3 * (size_t) codes[i].second;
+		for (int j=0; j<3; ++j) {
+			IndexType &vertex = vertexMap[tri[j]];
+			if (vertex == (IndexType) -1)
+				vertex = vertexCount++;
+			indices[3*(size_t) i+j] = vertex;
+		}
+	}
+	std::vector<std::pair<uint32_t, IndexType> >().swap(codes);
+	delete[] m_indices;
+	m_indices = indices;
+
+	/* Unreferenced vertices are moved to the end */
+	for (IndexType i=0; i<m_vertexCount; ++i) {
+		if (vertexMap[i] == (IndexType) -1)
+			vertexMap[i] = vertexCount++;
+	}
+
+	Point3f *positions = new Point3f[m_vertexCount];
+	for (IndexType i=0; i<m_vertexCount; ++i)
+		positions[vertexMap[i]] = m_vertexPositions[i];
+	delete[] m_vertexPositions;
+	m_vertexPositions = positions;
+
+	if (m_vertexNormals) {
+		Normal3f *normals = new Normal3f[m_vertexCount];
+		for (IndexType i=0; i<m_vertexCount; ++i)
+			normals[vertexMap[i]] = m_vertexNormals[i];
+		delete[] m_vertexNormals;
+		m_vertexNormals = normals;
+	}
+
+	if (m_vertexTexCoords) {
+		Point2f *texCoords = new Point2f[m_vertexCount];
+		for (IndexType i=0; i<m_vertexCount; ++i)
+			texCoords[vertexMap[i]] = m_vertexTexCoords[i];
+		delete[] m_vertexTexCoords;
+		m_vertexTexCoords = texCoords;
+	}
+
+	MeshLocality after = measureLocality(m_vertexPositions, m_indices, m_triangleCount, diagonal);
+
+	cout << "Reordered the triangles of \"" << qPrintable(m_name) << "\" along a Morton curve ("
+		 << timer.elapsed() << " ms)" << endl;
+	cout << "  Avg. vertex index span per triangle: " << before.vertexSpan << " -> " << after.vertexSpan << endl;
+	cout << "  Vertex cache misses per triangle (FIFO, " << NORI_REORDER_CACHE_SIZE << " entries): "
+		 << before.acmr << " -> " << after.acmr << endl;
+	cout << "  Avg. distance between consecutive triangles: " << before.centroidDistance
+		 << " -> " << after.centroidDistance << " (relative to the bounding box diagonal)" << endl;
+}
+
+void Mesh::releaseMapping() {
+	if (!m_mappedFile)
+		return;
+
+	Point3f *positions = new Point3f[m_vertexCount];
+	std::copy(m_vertexPositions, m_vertexPositions + m_vertexCount, positions);
+	m_vertexPositions = positions;
+	if (m_vertexNormals) {
+		Normal3f *normals = new Normal3f[m_vertexCount];
+		std::copy(m_vertexNormals, m_vertexNormals + m_vertexCount, normals);
+		m_vertexNormals = normals;
+	}
+	if (m_vertexTexCoords) {
+		Point2f *texCoords = new Point2f[m_vertexCount];
+		std::copy(m_vertexTexCoords, m_vertexTexCoords + m_vertexCount, texCoords);
+		m_vertexTexCoords = texCoords;
+	}
+	if (m_indices) {
+		IndexType *indices = new IndexType[3 * (size_t) m_triangleCount];
+		std::copy(m_indices, m_indices + 3 * (size_t) m_triangleCount, indices);
+		m_indices = indices;
+	}
+
+	delete m_mappedFile;
+	m_mappedFile = NULL;
+}
+
+void Mesh::setTransform(const Transform &toWorld) {
+	Transform delta = toWorld * m_originalTransform.inverse();
+	releaseMapping();
+
+	for (IndexType i=0; i<m_vertexCount; ++i)
+		m_vertexPositions[i] = delta * m_vertexPositions[i];
+	if (m_vertexNormals) {
+		for (IndexType i=0; i<m_vertexCount; ++i)
+			m_vertexNormals[i] = (delta * m_vertexNormals[i]).normalized();
+	}
+	if (m_packedNormals) {
+		for (IndexType i=0; i<m_vertexCount; ++i)
+			m_packedNormals[i] = encodeOctahedral(delta * decodeOctahedral(m_packedNormals[i]));
+	}
+	m_originalTransform = toWorld;
+
+	/* The triangle areas change when the transformation contains a scale */
+	m_distr.clear();
+	m_distr.reserve(m_triangleCount);
+	for (IndexType i=0; i<m_triangleCount; ++i)
+		m_distr.append(surfaceArea(i));
+	m_distr.normalize();
 }
 
 void Mesh::samplePosition(const Point2f &_sample, Point3f &p, Normal3f &n) const {
@@ -68,9 +333,9 @@ void Mesh::samplePosition(const Point2f &_sample, Point3f &p, Normal3f &n) const
 	size_t index = m_distr.sampleReuse(sample.x());
 
 	/* Lookup vertex positions for the chosen triangle */
-	int i0 = m_indices[3*index],
-		i1 = m_indices[3*index+1],
-		i2 = m_indices[3*index+2];
+	IndexType i0 = getIndex(3*(size_t) index),
+		i1 = getIndex(3*(size_t) index+1),
+		i2 = getIndex(3*(size_t) index+2);
 
 	const Point3f
 		&p0 = m_vertexPositions[i0],
@@ -83,21 +348,21 @@ void Mesh::samplePosition(const Point2f &_sample, Point3f &p, Normal3f &n) const
 	p = p0 * (1.0f - b.x() - b.y()) + p1 * b.x() + p2 * b.y();
 
 	/* Also provide a normal (interpolated if vertex normals are provided) */
-	if (m_vertexNormals) {
-		const Normal3f 
-			&n0 = m_vertexNormals[i0],
-			&n1 = m_vertexNormals[i1],
-			&n2 = m_vertexNormals[i2];
+	if (hasVertexNormals()) {
+		const Normal3f
+			n0 = getVertexNormal(i0),
+			n1 = getVertexNormal(i1),
+			n2 = getVertexNormal(i2);
 		n = (n0 * (1.0f - b.x() - b.y()) + n1 * b.x() + n2 * b.y()).normalized();
 	} else {
 		n = (p1-p0).cross(p2-p0).normalized();
 	}
 }
 
-float Mesh::surfaceArea(uint32_t index) const {
-	int i0 = m_indices[3*index],
-		i1 = m_indices[3*index+1],
-		i2 = m_indices[3*index+2];
+float Mesh::surfaceArea(IndexType index) const {
+	IndexType i0 = getIndex(3*(size_t) index),
+		i1 = getIndex(3*(size_t) index+1),
+		i2 = getIndex(3*(size_t) index+2);
 
 	const Point3f
 		&p0 = m_vertexPositions[i0],
@@ -107,10 +372,10 @@ float Mesh::surfaceArea(uint32_t index) const {
 	return 0.5f * Vector3f((p1-p0).cross(p2-p0)).norm();
 }
 
-bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
-	int i0 = m_indices[3*index],
-		i1 = m_indices[3*index+1],
-		i2 = m_indices[3*index+2];
+bool Mesh::rayIntersect(IndexType index, const Ray3f &ray, float &u, float &v, float &t) const {
+	IndexType i0 = getIndex(3*(size_t) index),
+		i1 = getIndex(3*(size_t) index+1),
+		i2 = getIndex(3*(size_t) index+2);
 
 	const Point3f
 		&p0 = m_vertexPositions[i0],
@@ -152,10 +417,10 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
 	return true;
 }
 	
-BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
-	BoundingBox3f result(m_vertexPositions[m_indices[3*index]]);
-	result.expandBy(m_vertexPositions[m_indices[3*index+1]]);
-	result.expandBy(m_vertexPositions[m_indices[3*index+2]]);
+BoundingBox3f Mesh::getBoundingBox(IndexType index) const {
+	BoundingBox3f result(m_vertexPositions[getIndex(3*(size_t) index)]);
+	result.expandBy(m_vertexPositions[getIndex(3*(size_t) index+1)]);
+	result.expandBy(m_vertexPositions[getIndex(3*(size_t) index+2)]);
 	return result;
 }
 
@@ -207,7 +472,7 @@ static int sutherlandHodgman(Point3d *input, int inCount, Point3d *output, int a
 	return outCount;
 }
 
-BoundingBox3f Mesh::getClippedBoundingBox(uint32_t index, const BoundingBox3f &bbox) const {
+BoundingBox3f Mesh::getClippedBoundingBox(IndexType index, const BoundingBox3f &bbox) const {
 	/* Reserve room for some additional vertices */
 	Point3d vertices1[NORI_TRICLIP_MAXVERTS], vertices2[NORI_TRICLIP_MAXVERTS];
 	int nVertices = 3;
@@ -218,7 +483,7 @@ BoundingBox3f Mesh::getClippedBoundingBox(uint32_t index, const BoundingBox3f &b
 	   remove triangles from the associated nodes. Hence, do the
 	   following computation in double precision! */
 	for (int i=0; i<3; ++i) 
-		vertices1[i] = m_vertexPositions[m_indices[3*index+i]].cast<double>();
+		vertices1[i] = m_vertexPositions[getIndex(3*(size_t) index+i)].cast<double>();
 
 	for (int axis=0; axis<3; ++axis) {
 		nVertices = sutherlandHodgman(vertices1, nVertices, vertices2, axis, bbox.min[axis], true);
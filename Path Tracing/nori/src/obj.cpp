@@ -18,44 +18,682 @@
 
 #include <nori/mesh.h>
 #include <nori/obj.h>
+#include <nori/hash.h>
 #include <boost/unordered_map.hpp>
+#include <QCoreApplication>
+#include <QElapsedTimer>
 #include <QTextStream>
 #include <QStringList>
 #include <QFileInfo>
+#include <QThread>
 #include <QtCore/qfileinfo.h>
 
+/// Files are split into chunks of at least this size, which are parsed in parallel
+#define NORI_OBJ_MIN_CHUNK_SIZE (1024*1024)
+
+/// Version of the binary mesh cache format (increase when changing the layout)
+#define NORI_OBJ_CACHE_VERSION 1
+
 NORI_NAMESPACE_BEGIN
 
+namespace {
+	/// Vertex indices used by the OBJ format
+	struct OBJVertex {
+		uint32_t p, n, uv;
+
+		inline OBJVertex() { }
+
+		inline OBJVertex(uint32_t p, uint32_t n, uint32_t uv)
+			: p(p), n(n), uv(uv) { }
+
+		OBJVertex(const QString &string)
+			: n((uint32_t) -1), uv((uint32_t) -1) {
+			QStringList tokens = string.split("/");
+
+			if (tokens.size() != 1 && tokens.size() != 3)
+				goto fail;
+
+			bool ok;
+			p  = (uint32_t) tokens[0].toInt(&ok) - 1; if (!ok) goto fail;
+
+			if (tokens.size() == 3) {
+				if (tokens[1].length() > 0) {
+					uv = (uint32_t) tokens[1].toInt(&ok) - 1; if (!ok) goto fail;
+				}
+				if (tokens[2].length() > 0) {
+					n  = (uint32_t) tokens[2].toInt(&ok) - 1; if (!ok) goto fail;
+				}
+			}
+
+			return;
+		fail:
+			throw NoriException(QString("Could not parse vertex data: '%1'!").arg(string));
+		}
+
+		inline bool operator==(const OBJVertex &v) const {
+			return v.p == p && v.n == n && v.uv == uv;
+		}
+	};
+
+	/// Hash function for \ref OBJVertex
+	struct OBJVertexHash : std::unary_function<OBJVertex, size_t> {
+		std::size_t operator()(const OBJVertex &v) const {
+			size_t hash = 0;
+			boost::hash_combine(hash, v.p);
+			boost::hash_combine(hash, v.n);
+			boost::hash_combine(hash, v.uv);
+			return hash;
+		}
+	};
+
+	typedef boost::unordered_map<OBJVertex, IndexType, OBJVertexHash> VertexMap;
+
+	/**
+	 * \brief Header of a binary mesh cache file
+	 *
+	 * The header is followed by the vertex positions, normals, texture
+	 * coordinates and the index list, each starting at a 64 byte aligned
+	 * file offset. Missing attributes have an offset of zero.
+	 */
+	struct MeshCacheHeader {
+		char magic[4];
+		uint32_t version;
+		uint64_t key;
+		uint64_t fileSize;
+		uint64_t vertexCount, triangleCount;
+		uint64_t positionOffset, normalOffset, texCoordOffset, indexOffset;
+
+		/**
+		 * \brief Check that an array of \c count elements at \c offset lies
+		 * within the file (without overflowing for corrupt counts)
+		 */
+		inline bool isInside(uint64_t offset, uint64_t elementSize, uint64_t count) const {
+			return offset >= sizeof(MeshCacheHeader) && offset <= fileSize
+				&& count <= (fileSize - offset) / elementSize;
+		}
+	};
+
+	/// Contents of an OBJ file (or of a part of it)
+	struct OBJData {
+		std::vector<Point3f>   positions;
+		std::vector<Point2f>   texcoords;
+		std::vector<Normal3f>  normals;
+		std::vector<IndexType> indices;
+		std::vector<OBJVertex> vertices;
+		VertexMap vertexMap;
+
+		/// Exchange the contents with another instance
+		inline void swap(OBJData &data) {
+			positions.swap(data.positions);
+			texcoords.swap(data.texcoords);
+			normals.swap(data.normals);
+			indices.swap(data.indices);
+			vertices.swap(data.vertices);
+			vertexMap.swap(data.vertexMap);
+		}
+
+		/// Return the index of a vertex, adding it if it has not been seen before
+		inline IndexType addVertex(const OBJVertex &v) {
+			std::pair<VertexMap::iterator, bool> result =
+				vertexMap.insert(std::make_pair(v, (IndexType) vertices.size()));
+			if (result.second)
+				vertices.push_back(v);
+			return result.first->second;
+		}
+	};
+
+	inline bool isDigit(char c) {
+		return c >= '0' && c <= '9';
+	}
+
+	inline void skipSpace(const char *&p, const char *end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+			++p;
+	}
+
+	/// Parse an unsigned decimal integer (returns \c false if there are no digits)
+	inline bool parseIndex(const char *&p, const char *end, uint32_t &result) {
+		if (p == end || !isDigit(*p))
+			return false;
+		uint32_t value = 0;
+		do {
+			value = value * 10 + (uint32_t) (*p++ - '0');
+		} while (p < end && isDigit(*p));
+		result = value;
+		return true;
+	}
+
+	/**
+	 * \brief Parse a floating point value
+	 *
+	 * Up to 19 significant digits are accumulated in an integer, which is
+	 * then scaled by an exact power of ten in double precision. Special
+	 * values like "nan" and "inf" are passed on to \c strtod().
+	 */
+	bool parseFloat(const char *&p, const char *end, float &result) {
+		static const double powersOfTen[] = {
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+		};
+
+		const char *start = p;
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative = *p++ == '-';
+
+		uint64_t mantissa = 0;
+		int exponent = 0, significant = 0;
+		bool hasDigits = false;
+		for (; p < end && isDigit(*p); ++p) {
+			hasDigits = true;
+			if (significant < 19) {
+				mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+				if (mantissa > 0)
+					++significant;
+			} else {
+				++exponent;
+			}
+		}
+		if (p < end && *p == '.') {
+			for (++p; p < end && isDigit(*p); ++p) {
+				hasDigits = true;
+				if (significant < 19) {
+					mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+					if (mantissa > 0)
+						++significant;
+					--exponent;
+				}
+			}
+		}
+
+		if (!hasDigits) {
+			/* Not a plain number -- let the C library handle it */
+			char buf[64];
+			size_t length = 0;
+			p = start;
+			while (p + length < end && length < sizeof(buf) - 1 && p[length] != ' '
+					&& p[length] != '\t' && p[length] != '\r' && p[length] != '\n')
+				buf[length] = p[length], ++length;
+			buf[length] = '\0';
+			char *endptr = NULL;
+			double value = strtod(buf, &endptr);
+			if (endptr == buf)
+				return false;
+			p += endptr - buf;
+			result = (float) value;
+			return true;
+		}
+
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			const char *expStart = p++;
+			bool negativeExp = false;
+			if (p < end && (*p == '-' || *p == '+'))
+				negativeExp = *p++ == '-';
+			uint32_t value;
+			if (parseIndex(p, end, value))
+				exponent += negativeExp ? -(int) std::min(value, 1000u) : (int) std::min(value, 1000u);
+			else
+				p = expStart; /* Not an exponent after all */
+		}
+
+		double value = (double) mantissa;
+		if (mantissa != 0 && exponent != 0) {
+			if (exponent > 0)
+				value *= exponent <= 22 ? powersOfTen[exponent] : std::pow(10.0, exponent);
+			else
+				value /= exponent >= -22 ? powersOfTen[-exponent] : std::pow(10.0, -exponent);
+		}
+		result = (float) (negative ? -value : value);
+		return true;
+	}
+
+	/**
+	 * \brief Parses one chunk of an OBJ file
+	 *
+	 * Every chunk starts at the beginning of a line and is parsed into
+	 * its own \ref OBJData. Since the indices in OBJ files refer to the
+	 * whole file, the vertices are deduplicated within the chunk first
+	 * and merged with those of the other chunks afterwards.
+	 */
+	class OBJChunkParser : public QThread {
+	public:
+		const char *begin, *end;
+		const Transform *trafo;
+		OBJData *data;
+		/// Description of the first parse error (empty if there was none)
+		QString error;
+
+		void process() {
+			for (const char *p = begin; p < end; ) {
+				const char *lineEnd = (const char *) memchr(p, '\n', end - p);
+				if (!lineEnd)
+					lineEnd = end;
+				if (!parseLine(p, lineEnd)) {
+					error = QString("Could not parse line '%1'!").arg(
+						QString::fromLatin1(p, (int) (lineEnd - p)).trimmed());
+					return;
+				}
+				p = lineEnd + 1;
+			}
+		}
+	protected:
+		void run() {
+			process();
+		}
+
+		static inline bool isSpace(char c) {
+			return c == ' ' || c == '\t';
+		}
+
+		/// Parse a sequence of whitespace-separated floating point values
+		static inline bool parseFloats(const char *p, const char *end, float *values, int count) {
+			for (int i=0; i<count; ++i) {
+				skipSpace(p, end);
+				if (!parseFloat(p, end, values[i]))
+					return false;
+			}
+			return true;
+		}
+
+		/// Parse a one-based index and convert it to a zero-based one
+		static inline bool parseVertexIndex(const char *&p, const char *end, uint32_t &result) {
+			if (!parseIndex(p, end, result) || result == 0)
+				return false;
+			--result;
+			return true;
+		}
+
+		/// Parse the vertex data of a single line
+		bool parseLine(const char *p, const char *end) {
+			skipSpace(p, end);
+			if (end - p < 3)
+				return true;
+
+			if (p[0] == 'v' && isSpace(p[1])) {
+				Point3f v;
+				if (!parseFloats(p + 1, end, v.data(), 3))
+					return false;
+				data->positions.push_back(*trafo * v);
+			} else if (p[0] == 'v' && p[1] == 't' && isSpace(p[2])) {
+				Point2f tc;
+				if (!parseFloats(p + 2, end, tc.data(), 2))
+					return false;
+				data->texcoords.push_back(tc);
+			} else if (p[0] == 'v' && p[1] == 'n' && isSpace(p[2])) {
+				Normal3f n;
+				if (!parseFloats(p + 2, end, n.data(), 3))
+					return false;
+				data->normals.push_back((*trafo * n).normalized());
+			} else if (p[0] == 'f' && isSpace(p[1])) {
+				/* Polygons are split into a fan of triangles, in the
+				   same order in which quads have always been split */
+				IndexType first = 0, prev = 0;
+				int count = 0;
+				++p;
+				while (true) {
+					skipSpace(p, end);
+					if (p == end)
+						break;
+					OBJVertex v((uint32_t) -1, (uint32_t) -1, (uint32_t) -1);
+					if (!parseVertexIndex(p, end, v.p))
+						return false;
+					if (p < end && *p == '/') {
+						++p;
+						if (p < end && *p != '/' && !parseVertexIndex(p, end, v.uv))
+							return false;
+						if (p < end && *p == '/') {
+							++p;
+							if (!parseVertexIndex(p, end, v.n))
+								return false;
+						}
+					}
+
+					IndexType index = data->addVertex(v);
+					if (count >= 3) {
+						data->indices.push_back(index);
+						data->indices.push_back(first);
+						data->indices.push_back(prev);
+					} else {
+						data->indices.push_back(index);
+						if (count == 0)
+							first = index;
+					}
+					prev = index;
+					++count;
+				}
+				if (count < 3)
+					return false;
+			}
+			return true;
+		}
+	};
+};
+
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is mapped into memory and split into chunks at line
+ * boundaries, which are parsed by one thread per core using
+ * hand-written number parsing. Each thread deduplicates the vertices
+ * of its chunk, and the per-chunk vertex tables are merged at the end
+ * (in file order, hence the result does not depend on the number of
+ * threads). Polygons with more than three vertices are triangulated.
+ *
+ * After parsing, the mesh is written to a binary cache file next to the
+ * OBJ file (with the extension <tt>.nmesh</tt>), unless the <tt>cache</tt>
+ * property is set to \c false. Later loads map the cache into memory and
+ * use its arrays directly. The cache is only used if it was created from
+ * the same file contents and <tt>toWorld</tt> transformation, which
+ * costs one pass over the OBJ file to compute its hash.
+ *
+ * Setting the <tt>benchmark</tt> property additionally loads the file
+ * with the original line-by-line parser based on \c QTextStream, prints
+ * the throughput of both loaders and checks that their results match.
+ * The cache is not used in this case.
  */
 class WavefrontOBJ : public Mesh {
 public:
 	WavefrontOBJ(const PropertyList &propList) : Mesh(propList) {
-		typedef boost::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-
-		/* Process the OBJ-file line by line */	
 		QString filename = propList.getString("filename");
 		QFile input(QFile::exists(filename) ? filename : absFileName(filename));
-		if (!input.open(QIODevice::ReadOnly | QIODevice::Text))
+		if (!input.open(QIODevice::ReadOnly))
 			throw NoriException(QString("Cannot open \"%1\"").arg(filename));
 
 		Transform trafo = propList.getTransform("toWorld", Transform());
+		bool benchmark = propList.getBoolean("benchmark", false);
+		bool cache = propList.getBoolean("cache", true) && !benchmark;
 
 		cout << "Loading \"" << qPrintable(filename) << "\" .." << endl;
 		m_name = QFileInfo(filename).fileName();
 
+		qint64 size = input.size();
+		const char *contents = NULL;
+		if (size > 0) {
+			contents = reinterpret_cast<const char *>(input.map(0, size));
+			if (!contents)
+				throw NoriException(QString("Unable to map \"%1\" into memory").arg(filename));
+		}
+
+		QString cacheFilename = input.fileName() + ".nmesh";
+		uint64_t key = 0;
+		if (cache) {
+			key = getCacheKey(contents, size, trafo);
+			if (loadCache(cacheFilename, key)) {
+				cout << "Loaded " << m_triangleCount << " triangles and " << m_vertexCount
+					 << " vertices from \"" << qPrintable(cacheFilename) << "\"" << endl;
+				return;
+			}
+		}
+
+		QElapsedTimer timer;
+		timer.start();
+		OBJData data;
+		int threadCount = parse(contents, size, trafo, data);
+		qint64 elapsed = timer.elapsed();
+
+		if (benchmark) {
+			OBJData reference;
+			timer.start();
+			parseReference(input.fileName(), trafo, reference);
+			qint64 referenceElapsed = timer.elapsed();
+
+			double megabytes = size / (1024.0 * 1024.0);
+			cout << "OBJ loader benchmark (" << qPrintable(QString::number(megabytes, 'f', 1))
+				 << " MiB): " << threadCount << " threads: " << elapsed << " ms ("
+				 << qPrintable(QString::number(megabytes * 1000 / std::max(elapsed, (qint64) 1), 'f', 1))
+				 << " MiB/s), QTextStream: " << referenceElapsed << " ms ("
+				 << qPrintable(QString::number(megabytes * 1000 / std::max(referenceElapsed, (qint64) 1), 'f', 1))
+				 << " MiB/s)" << endl;
+
+			if (reference.indices != data.indices || reference.vertices.size() != data.vertices.size()
+					|| reference.positions.size() != data.positions.size())
+				cerr << "Warning: the OBJ loaders produced different meshes (the reference "
+					"loader only supports triangles and quads)" << endl;
+		}
+
+		create(data);
+
+		cout << "Read " << m_triangleCount << " triangles and "
+			 << m_vertexCount << " vertices." << endl;
+
+		if (cache && m_triangleCount > 0)
+			saveCache(cacheFilename, key);
+	}
+
+protected:
+	/**
+	 * \brief Parse a memory-mapped OBJ file using multiple threads
+	 *
+	 * \return The number of threads that were used
+	 */
+	int parse(const char *data, qint64 size, const Transform &trafo, OBJData &result) {
+		if (size == 0)
+			return 1;
+
+		/* Split the file into chunks that start at the beginning of a line */
+		int chunkCount = (int) std::max((qint64) 1, std::min((qint64) getCoreCount(),
+			size / NORI_OBJ_MIN_CHUNK_SIZE));
+		std::vector<OBJData> chunkData(chunkCount > 1 ? chunkCount : 0);
+		OBJChunkParser *chunks = new OBJChunkParser[chunkCount];
+		const char *end = data + size, *pos = data;
+		for (int i=0; i<chunkCount; ++i) {
+			const char *chunkEnd = std::max(pos, data + size * (i + 1) / chunkCount);
+			const char *newline = (const char *) memchr(chunkEnd, '\n', end - chunkEnd);
+			chunkEnd = newline ? newline + 1 : end;
+			chunks[i].begin = pos;
+			chunks[i].end = chunkEnd;
+			chunks[i].trafo = &trafo;
+			chunks[i].data = chunkCount == 1 ? &result : &chunkData[i];
+			pos = chunkEnd;
+		}
+
+		if (chunkCount == 1) {
+			chunks[0].process();
+		} else {
+			for (int i=0; i<chunkCount; ++i)
+				chunks[i].start();
+			for (int i=0; i<chunkCount; ++i)
+				chunks[i].wait();
+		}
+
+		QString error;
+		for (int i=chunkCount-1; i>=0; --i) {
+			if (!chunks[i].error.isEmpty())
+				error = chunks[i].error;
+		}
+		delete[] chunks;
+		if (!error.isEmpty())
+			throw NoriException(error);
+
+		if (chunkCount == 1)
+			return 1;
+
+		/* Concatenate the vertex data and merge the per-chunk vertex tables */
+		size_t positionCount = 0, texcoordCount = 0, normalCount = 0, indexCount = 0;
+		for (int i=0; i<chunkCount; ++i) {
+			positionCount += chunkData[i].positions.size();
+			texcoordCount += chunkData[i].texcoords.size();
+			normalCount += chunkData[i].normals.size();
+			indexCount += chunkData[i].indices.size();
+		}
+		result.positions.reserve(positionCount);
+		result.texcoords.reserve(texcoordCount);
+		result.normals.reserve(normalCount);
+		result.indices.reserve(indexCount);
+
+		std::vector<IndexType> remap;
+		for (int i=0; i<chunkCount; ++i) {
+			OBJData &chunk = chunkData[i];
+			result.positions.insert(result.positions.end(), chunk.positions.begin(), chunk.positions.end());
+			result.texcoords.insert(result.texcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+			result.normals.insert(result.normals.end(), chunk.normals.begin(), chunk.normals.end());
+
+			remap.resize(chunk.vertices.size());
+			for (size_t j=0; j<chunk.vertices.size(); ++j)
+				remap[j] = result.addVertex(chunk.vertices[j]);
+			for (size_t j=0; j<chunk.indices.size(); ++j)
+				result.indices.push_back(remap[chunk.indices[j]]);
+
+			/* Release the chunk's memory early */
+			OBJData().swap(chunk);
+		}
+
+		return chunkCount;
+	}
+
+	/// Compute the key of the mesh cache from the file contents and the transformation
+	uint64_t getCacheKey(const char *contents, qint64 size, const Transform &trafo) const {
+		Hasher hasher;
+		hasher.update((uint32_t) NORI_OBJ_CACHE_VERSION);
+		hasher.update((uint32_t) sizeof(IndexType));
+		hasher.update(trafo.getMatrix().data(), sizeof(float) * 16);
+		hasher.update(size);
+		if (size > 0)
+			hasher.update(contents, (size_t) size);
+		return hasher.get();
+	}
+
+	/**
+	 * \brief Map a previously cached mesh into memory
+	 *
+	 * \return \c false if the file does not exist or is not a valid
+	 *     cache file for the current OBJ file and transformation
+	 */
+	bool loadCache(const QString &filename, uint64_t key) {
+		QFile *file = new QFile(filename);
+		if (!file->open(QIODevice::ReadOnly)) {
+			delete file;
+			return false;
+		}
+
+		MeshCacheHeader header;
+		uchar *data = NULL;
+		if (file->size() >= (qint64) sizeof(MeshCacheHeader))
+			data = file->map(0, file->size());
+
+		if (data)
+			memcpy(&header, data, sizeof(MeshCacheHeader));
+
+		/* A cache for different file contents or another transformation
+		   is silently replaced. Otherwise, check that all arrays lie
+		   within the file */
+		if (data && memcmp(header.magic, "NMSH", 4) == 0 && header.key != key) {
+			delete file;
+			return false;
+		}
+
+		bool valid = data && memcmp(header.magic, "NMSH", 4) == 0
+			&& header.version == NORI_OBJ_CACHE_VERSION
+			&& header.fileSize == (uint64_t) file->size()
+			&& header.triangleCount > 0
+			&& header.vertexCount <= (uint64_t) std::numeric_limits<IndexType>::max()
+			&& header.triangleCount <= (uint64_t) std::numeric_limits<IndexType>::max()
+			&& header.triangleCount <= header.fileSize / (3 * sizeof(IndexType))
+			&& header.isInside(header.positionOffset, sizeof(Point3f), header.vertexCount)
+			&& (!header.normalOffset || header.isInside(header.normalOffset, sizeof(Normal3f), header.vertexCount))
+			&& (!header.texCoordOffset || header.isInside(header.texCoordOffset, sizeof(Point2f), header.vertexCount))
+			&& header.isInside(header.indexOffset, sizeof(IndexType), 3 * header.triangleCount);
+
+		if (valid) {
+			/* The indices are used without further checks later on */
+			const IndexType *indices = reinterpret_cast<const IndexType *>(data + header.indexOffset);
+			for (uint64_t i=0; i<3 * header.triangleCount; ++i) {
+				if (indices[i] >= header.vertexCount) {
+					valid = false;
+					break;
+				}
+			}
+		}
+
+		if (!valid) {
+			if (data)
+				cerr << "Warning: ignoring invalid mesh cache file \""
+					 << qPrintable(filename) << "\"" << endl;
+			delete file;
+			return false;
+		}
+
+		m_mappedFile = file;
+		m_vertexCount = (IndexType) header.vertexCount;
+		m_triangleCount = (IndexType) header.triangleCount;
+		m_vertexPositions = reinterpret_cast<Point3f *>(data + header.positionOffset);
+		if (header.normalOffset)
+			m_vertexNormals = reinterpret_cast<Normal3f *>(data + header.normalOffset);
+		if (header.texCoordOffset)
+			m_vertexTexCoords = reinterpret_cast<Point2f *>(data + header.texCoordOffset);
+		m_indices = reinterpret_cast<IndexType *>(data + header.indexOffset);
+		return true;
+	}
+
+	/// Write the vertex and index arrays to a cache file
+	void saveCache(const QString &filename, uint64_t key) const {
+		MeshCacheHeader header;
+		memset(&header, 0, sizeof(MeshCacheHeader));
+		memcpy(header.magic, "NMSH", 4);
+		header.version = NORI_OBJ_CACHE_VERSION;
+		header.key = key;
+		header.vertexCount = m_vertexCount;
+		header.triangleCount = m_triangleCount;
+
+		uint64_t offset = alignCacheOffset(sizeof(MeshCacheHeader));
+		header.positionOffset = offset;
+		offset = alignCacheOffset(offset + sizeof(Point3f) * m_vertexCount);
+		if (m_vertexNormals) {
+			header.normalOffset = offset;
+			offset = alignCacheOffset(offset + sizeof(Normal3f) * m_vertexCount);
+		}
+		if (m_vertexTexCoords) {
+			header.texCoordOffset = offset;
+			offset = alignCacheOffset(offset + sizeof(Point2f) * m_vertexCount);
+		}
+		header.indexOffset = offset;
+		header.fileSize = offset + sizeof(IndexType) * 3 * (uint64_t) m_triangleCount;
+
+		/* Write to a temporary file first, so that concurrent render processes
+		   never map a partially written cache file */
+		QString tmpFilename = QString("%1.%2.tmp").arg(filename)
+			.arg(QCoreApplication::applicationPid());
+		QFile file(tmpFilename);
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+			cerr << "Warning: unable to write the mesh cache file \""
+				 << qPrintable(tmpFilename) << "\"" << endl;
+			return;
+		}
+
+		bool success =
+			writeCacheSection(file, 0, &header, sizeof(MeshCacheHeader)) &&
+			writeCacheSection(file, header.positionOffset, m_vertexPositions, sizeof(Point3f) * m_vertexCount) &&
+			(!m_vertexNormals || writeCacheSection(file, header.normalOffset,
+				m_vertexNormals, sizeof(Normal3f) * m_vertexCount)) &&
+			(!m_vertexTexCoords || writeCacheSection(file, header.texCoordOffset,
+				m_vertexTexCoords, sizeof(Point2f) * m_vertexCount)) &&
+			writeCacheSection(file, header.indexOffset, m_indices, sizeof(IndexType) * 3 * (size_t) m_triangleCount);
+		file.close();
+
+		/* QFile::rename() does not overwrite existing files. Replace stale
+		   cache files -- processes that have mapped them are unaffected */
+		if (success && !QFile::rename(tmpFilename, filename)) {
+			QFile::remove(filename);
+			success = QFile::rename(tmpFilename, filename);
+		}
+
+		if (!success) {
+			QFile::remove(tmpFilename);
+			cerr << "Warning: unable to write the mesh cache file \""
+				 << qPrintable(filename) << "\"" << endl;
+		}
+	}
+
+	/// Process the OBJ-file line by line (used by the benchmark)
+	void parseReference(const QString &filename, const Transform &trafo, OBJData &data) {
+		QFile input(filename);
+		if (!input.open(QIODevice::ReadOnly | QIODevice::Text))
+			throw NoriException(QString("Cannot open \"%1\"").arg(filename));
+
 		QTextStream stream(&input);
 		QTextStream line;
 		QString temp, prefix;
 
-		std::vector<Point3f>   positions;
-		std::vector<Point2f>   texcoords;
-		std::vector<Normal3f>  normals;
-		std::vector<uint32_t>  indices;
-		std::vector<OBJVertex> vertices;
-		VertexMap vertexMap;
-
 		while (!(temp = stream.readLine()).isNull()) {
 			line.setString(&temp);
 
@@ -64,16 +702,16 @@ public:
 				Point3f p;
 				line >> p.x() >> p.y() >> p.z();
 				p = trafo * p;
-				positions.push_back(p);
+				data.positions.push_back(p);
 			} else if (prefix == "vt") {
 				Point2f tc;
 				line >> tc.x() >> tc.y();
-				texcoords.push_back(tc);
+				data.texcoords.push_back(tc);
 			} else if (prefix == "vn") {
 				Normal3f n;
 				line >> n.x() >> n.y() >> n.z();
 				n = (trafo * n).normalized();
-				normals.push_back(n);
+				data.normals.push_back(n);
 			} else if (prefix == "f") {
 				QString v1, v2, v3, v4;
 				line >> v1 >> v2 >> v3 >> v4;
@@ -94,97 +732,55 @@ public:
 
 				/* Now convert from the Wavefront OBJ indexing scheme to a good
 				   old indexed vertex list (i.e. just one index per vertex) */
-				for (int i=0; i<nVertices; ++i) {
-					const OBJVertex &v = tri[i];
-					VertexMap::const_iterator it = vertexMap.find(v);
-					if (it == vertexMap.end()) {
-						vertexMap[v] = (uint32_t) vertices.size();
-						indices.push_back((uint32_t) vertices.size());
-						vertices.push_back(v);
-					} else {
-						indices.push_back(it->second);
-					}
-				}
+				for (int i=0; i<nVertices; ++i)
+					data.indices.push_back(data.addVertex(tri[i]));
 			}
 		}
+	}
 
-		m_triangleCount = (uint32_t) (indices.size() / 3);
-		m_vertexCount = (uint32_t) vertices.size();
-
-		cout << "Read " << m_triangleCount << " triangles and "
-			 << m_vertexCount << " vertices." << endl;
-
-		/* Create the compact in-memory representation (i.e. without 
-		   unused buffer space). This involves some copying and following
-		   of indirections. */
+	/**
+	 * \brief Create the compact in-memory representation (i.e. without
+	 * unused buffer space). This involves some copying and following
+	 * of indirections.
+	 */
+	void create(const OBJData &data) {
+		if (data.vertices.size() > (size_t) std::numeric_limits<IndexType>::max())
+			throw NoriException(QString("\"%1\": too many vertices for the index width!").arg(m_name));
+		if (data.indices.size() / 3 > (size_t) std::numeric_limits<IndexType>::max())
+			throw NoriException(QString("\"%1\": too many triangles for the index width!").arg(m_name));
+
+		m_triangleCount = (IndexType) (data.indices.size() / 3);
+		m_vertexCount = (IndexType) data.vertices.size();
+
+		/* Either all vertices have normals (texture coordinates) or none */
+		for (size_t i=0; i<m_vertexCount; ++i) {
+			const OBJVertex &v = data.vertices[i];
+			if (v.p >= data.positions.size()
+					|| (!data.normals.empty() && v.n >= data.normals.size())
+					|| (!data.texcoords.empty() && v.uv >= data.texcoords.size()))
+				throw NoriException(QString("\"%1\": invalid vertex index (or a face without normals or texture coordinates)!").arg(m_name));
+		}
 
-		m_indices = new uint32_t[indices.size()];
-		for (size_t i=0; i<indices.size(); ++i)
-			m_indices[i] = indices[i];
+		m_indices = new IndexType[data.indices.size()];
+		for (size_t i=0; i<data.indices.size(); ++i)
+			m_indices[i] = data.indices[i];
 
 		m_vertexPositions = new Point3f[m_vertexCount];
 		for (size_t i=0; i<m_vertexCount; ++i)
-			m_vertexPositions[i] = positions.at(vertices[i].p);
+			m_vertexPositions[i] = data.positions[data.vertices[i].p];
 
-		if (!normals.empty()) {
+		if (!data.normals.empty()) {
 			m_vertexNormals = new Normal3f[m_vertexCount];
 			for (size_t i=0; i<m_vertexCount; ++i)
-				m_vertexNormals[i] = normals.at(vertices[i].n);
+				m_vertexNormals[i] = data.normals[data.vertices[i].n];
 		}
 
-		if (!texcoords.empty()) {
+		if (!data.texcoords.empty()) {
 			m_vertexTexCoords = new Point2f[m_vertexCount];
 			for (size_t i=0; i<m_vertexCount; ++i)
-				m_vertexTexCoords[i] = texcoords.at(vertices[i].uv);
+				m_vertexTexCoords[i] = data.texcoords[data.vertices[i].uv];
 		}
 	}
-
-protected:
-	/// Vertex indices used by the OBJ format
-	struct OBJVertex {
-		uint32_t p, n, uv;
-
-		inline OBJVertex() { }
-
-		OBJVertex(const QString &string) 
-			: n((uint32_t) -1), uv((uint32_t) -1) {
-			QStringList tokens = string.split("/");
-
-			if (tokens.size() != 1 && tokens.size() != 3)
-				goto fail;
-
-			bool ok;
-			p  = (uint32_t) tokens[0].toInt(&ok) - 1; if (!ok) goto fail;
-
-			if (tokens.size() == 3) {
-				if (tokens[1].length() > 0) {
-					uv = (uint32_t) tokens[1].toInt(&ok) - 1; if (!ok) goto fail;
-				}
-				if (tokens[2].length() > 0) {
-					n  = (uint32_t) tokens[2].toInt(&ok) - 1; if (!ok) goto fail;
-				}
-			}
-
-			return;
-		fail:
-			throw NoriException(QString("Could not parse vertex data: '%1'!").arg(string));
-		}
-
-		inline bool operator==(const OBJVertex &v) const {
-			return v.p == p && v.n == n && v.uv == uv;
-		}
-	};
-
-	/// Hash function for \ref OBJVertex
-	struct OBJVertexHash : std::unary_function<OBJVertex, size_t> {
-		std::size_t operator()(const OBJVertex &v) const {
-			size_t hash = 0;
-			boost::hash_combine(hash, v.p);
-			boost::hash_combine(hash, v.n);
-			boost::hash_combine(hash, v.uv);
-			return hash;
-		}
-	};
 };
 
 extern Mesh *loadOBJFile(const QString &filename){
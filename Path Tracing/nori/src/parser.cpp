@@ -42,7 +42,9 @@ public:
 		ESampler              = NoriObject::ESampler,
 		ETest                 = NoriObject::ETest,
                 EEvaluator            = NoriObject::EEvaluator,
+		EAccel                = NoriObject::EAccel,
 		EReconstructionFilter = NoriObject::EReconstructionFilter,
+		EInstance             = NoriObject::EInstance,
 
 		/* Properties */
 		EBoolean = NoriObject::EClassTypeCount,
@@ -56,7 +58,8 @@ public:
 		ETranslate,
 		ERotate,
 		EScale,
-		ELookAt
+		ELookAt,
+		EReference
 	};
 
 	NoriParser() : m_root(NULL) {
@@ -73,6 +76,8 @@ public:
 		m_tags["rfilter"]    = EReconstructionFilter;
 		m_tags["test"]       = ETest;
                 m_tags["evaluator"]  = EEvaluator;
+		m_tags["accel"]      = EAccel;
+		m_tags["instance"]   = EInstance;
 		m_tags["boolean"]    = EBoolean;
 		m_tags["integer"]    = EInteger;
 		m_tags["float"]      = EFloat;
@@ -85,6 +90,7 @@ public:
 		m_tags["rotate"]     = ERotate;
 		m_tags["scale"]      = EScale;
 		m_tags["lookat"]     = ELookAt;
+		m_tags["ref"]        = EReference;
 	}
 
 	struct ParserContext {
@@ -141,6 +147,8 @@ public:
 			m_transform.setIdentity();
 		else if (name == "scene")
 			ctx.attr.append("type", "", "type", "scene");
+		else if (name == "instance")
+			ctx.attr.append("type", "", "type", "instance");
 
 		m_context.push_back(ctx);
 		return true;
@@ -157,6 +165,14 @@ public:
 		int tag = (int) it->second;
 
 		if (tag < NoriObject::EClassTypeCount) {
+			/* Objects with an identifier can later be referenced using <ref> */
+			QString id = context.attr.value("id");
+			if (!id.isEmpty()) {
+				if (m_ids.find(id) != m_ids.end())
+					throw NoriException(QString("Encountered a duplicate object identifier '%1'!").arg(id));
+				context.propList.setString("id", id);
+			}
+
 			/* This is an object, first instantiate it */
 			NoriObject *obj = NoriObjectFactory::createInstance(
 				context.attr.value("type"),
@@ -179,6 +195,9 @@ public:
 			/* Activate / configure the object */
 			obj->activate();
 
+			if (!id.isEmpty())
+				m_ids[id] = obj;
+
 			/* Add it to its parent, if there is one */
 			if (m_context.size() >= 2)
 				m_context[m_context.size() - 2].children.push_back(obj);
@@ -267,6 +286,19 @@ public:
 					}
 					break;
 
+				case EReference: {
+						/* Pass a previously declared object to the parent */
+						QString id = context.attr.value("id");
+						std::map<QString, NoriObject *>::const_iterator ref = m_ids.find(id);
+						if (ref == m_ids.end())
+							throw NoriException(QString("Unable to resolve the reference '%1' -- "
+								"objects must be declared before they are referenced!").arg(id));
+						if (ref->second->getClassType() != NoriObject::EMesh)
+							throw NoriException(QString("The reference '%1' does not refer to a mesh!").arg(id));
+						m_context[m_context.size() - 2].children.push_back(ref->second);
+					}
+					break;
+
 				case ELookAt: {
 						Point3f origin = parseVector(context.attr.value("origin"));
 						Point3f target = parseVector(context.attr.value("target"));
@@ -298,6 +330,7 @@ private:
 	std::map<QString, ETag> m_tags;
 	std::vector<ParserContext> m_context;
 	Eigen::Affine3f m_transform;
+	std::map<QString, NoriObject *> m_ids;
 	NoriObject *m_root;
 };
 
@@ -126,6 +126,38 @@ public:
 		return Color3f(1.0f);
 	}
 
+	void sampleRayPacket(RayPacketN &packet, Color3f *weights,
+			const Point2f *samplePositions,
+			const Point2f *apertureSamples) const {
+		if (m_apertureRadius != 0) {
+			Camera::sampleRayPacket(packet, weights, samplePositions, apertureSamples);
+			return;
+		}
+
+		/* Pinhole camera: all rays share the same origin, and the
+		   direction is the normalized position on the near plane */
+		const Eigen::Matrix4f &M = m_sampleToCamera.getMatrix();
+		const Eigen::Vector4f colX = M.col(0) * m_invOutputSize.x(),
+		                      colY = M.col(1) * m_invOutputSize.y();
+		const Eigen::Matrix3f cameraToWorld = m_cameraToWorld.getMatrix().topLeftCorner<3, 3>();
+		const Point3f origin = m_cameraToWorld * Point3f(0.0f, 0.0f, 0.0f);
+
+		for (uint32_t i=0; i<packet.count; ++i) {
+			Eigen::Vector4f nearP = colX * samplePositions[i].x()
+				+ colY * samplePositions[i].y() + M.col(3);
+			Vector3f d = (nearP.head<3>() / nearP.w()).normalized();
+			float invZ = 1.0f / d.z();
+
+			Ray3f &ray = packet.rays[i];
+			ray.o = origin;
+			ray.d = cameraToWorld * d;
+			ray.mint = m_nearClip * invZ;
+			ray.maxt = m_farClip * invZ;
+			ray.update();
+			weights[i] = Color3f(1.0f);
+		}
+	}
+
 	void addChild(NoriObject *obj) {
 		switch (obj->getClassType()) {
 			case EReconstructionFilter:
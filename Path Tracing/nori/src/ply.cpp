@@ -0,0 +1,462 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <QStringList>
+#include <QFileInfo>
+#include <QFile>
+
+NORI_NAMESPACE_BEGIN
+
+namespace {
+	/// Scalar types supported by the PLY format
+	enum PLYType {
+		EInt8 = 0, EUInt8, EInt16, EUInt16,
+		EInt32, EUInt32, EFloat32, EFloat64, EInvalid
+	};
+
+	/// Size of the scalar types in bytes
+	const size_t plyTypeSize[] = { 1, 1, 2, 2, 4, 4, 4, 8, 0 };
+
+	/// Parse the name of a scalar type (both the old and the sized names)
+	PLYType parsePLYType(const QString &name) {
+		if (name == "char" || name == "int8") return EInt8;
+		else if (name == "uchar" || name == "uint8") return EUInt8;
+		else if (name == "short" || name == "int16") return EInt16;
+		else if (name == "ushort" || name == "uint16") return EUInt16;
+		else if (name == "int" || name == "int32") return EInt32;
+		else if (name == "uint" || name == "uint32") return EUInt32;
+		else if (name == "float" || name == "float32") return EFloat32;
+		else if (name == "double" || name == "float64") return EFloat64;
+		return EInvalid;
+	}
+
+	/// Vertex attributes that are loaded from a PLY file
+	enum PLYAttribute {
+		EPositionX = 0, EPositionY, EPositionZ,
+		ENormalX, ENormalY, ENormalZ,
+		ETexCoordU, ETexCoordV,
+		EAttributeCount, EIgnored = EAttributeCount
+	};
+
+	/// Property of an element in the header of a PLY file
+	struct PLYProperty {
+		PLYType type;
+		/// Type of the element count for list properties (\c EInvalid otherwise)
+		PLYType countType;
+		/// Vertex attribute stored in this property (vertex element only)
+		PLYAttribute attribute;
+	};
+
+	/// Element declaration in the header of a PLY file
+	struct PLYElement {
+		QString name;
+		size_t count;
+		std::vector<PLYProperty> properties;
+		/// Index of the vertex index list (face element only)
+		int indexProperty;
+	};
+
+	/**
+	 * \brief Sequential reader for the binary body of a PLY file
+	 *
+	 * Converts the values to the requested type on the fly, swapping
+	 * their bytes if the file's byte order differs from the machine's.
+	 */
+	class PLYReader {
+	public:
+		inline PLYReader(const uchar *ptr, const uchar *end, bool swap)
+			: m_ptr(ptr), m_end(end), m_swap(swap) { }
+
+		/// Read a scalar value and convert it to type \c T
+		template <typename T> inline T read(PLYType type) {
+			size_t size = plyTypeSize[type];
+			if (EXPECT_NOT_TAKEN((size_t) (m_end - m_ptr) < size))
+				throw NoriException("PLY: unexpected end of file!");
+
+			uchar buf[8];
+			if (EXPECT_TAKEN(!m_swap)) {
+				memcpy(buf, m_ptr, size);
+			} else {
+				for (size_t i=0; i<size; ++i)
+					buf[i] = m_ptr[size-1-i];
+			}
+			m_ptr += size;
+
+			switch (type) {
+				case EInt8:    return (T) *reinterpret_cast<int8_t *>(buf);
+				case EUInt8:   return (T) *reinterpret_cast<uint8_t *>(buf);
+				case EInt16:   return (T) *reinterpret_cast<int16_t *>(buf);
+				case EUInt16:  return (T) *reinterpret_cast<uint16_t *>(buf);
+				case EInt32:   return (T) *reinterpret_cast<int32_t *>(buf);
+				case EUInt32:  return (T) *reinterpret_cast<uint32_t *>(buf);
+				case EFloat32: return (T) *reinterpret_cast<float *>(buf);
+				default:       return (T) *reinterpret_cast<double *>(buf);
+			}
+		}
+
+		/// Skip a number of values of the given type
+		inline void skip(PLYType type, size_t count) {
+			size_t size = plyTypeSize[type] * count;
+			if (EXPECT_NOT_TAKEN((size_t) (m_end - m_ptr) < size))
+				throw NoriException("PLY: unexpected end of file!");
+			m_ptr += size;
+		}
+
+		/// Skip a property
+		inline void skip(const PLYProperty &prop) {
+			skip(prop.type, prop.countType != EInvalid ? read<size_t>(prop.countType) : 1);
+		}
+
+		/// Skip a whole element
+		void skip(const PLYElement &element) {
+			for (size_t i=0; i<element.count; ++i)
+				for (size_t j=0; j<element.properties.size(); ++j)
+					skip(element.properties[j]);
+		}
+
+		inline const uchar *getPointer() const { return m_ptr; }
+		inline void setPointer(const uchar *ptr) { m_ptr = ptr; }
+		inline size_t getRemaining() const { return (size_t) (m_end - m_ptr); }
+		inline bool isSwapped() const { return m_swap; }
+	private:
+		const uchar *m_ptr, *m_end;
+		bool m_swap;
+	};
+};
+
+/**
+ * \brief Loader for binary PLY triangle meshes
+ *
+ * Reads meshes in the binary (little- or big-endian) variant of the
+ * Stanford PLY format, which is commonly used for scanned data. The
+ * <tt>vertex</tt> element must provide the positions (<tt>x</tt>,
+ * <tt>y</tt>, <tt>z</tt>) and may provide normals (<tt>nx</tt>,
+ * <tt>ny</tt>, <tt>nz</tt>) and texture coordinates (<tt>u</tt>/<tt>v</tt>,
+ * <tt>s</tt>/<tt>t</tt> or <tt>texture_u</tt>/<tt>texture_v</tt>) in any
+ * order and scalar type. Polygons in the <tt>face</tt> element are split
+ * into triangle fans, and all other elements and properties are skipped.
+ *
+ * The file is mapped into memory, and the elements are converted
+ * directly into the arrays of the mesh without intermediate copies.
+ * Can be selected using <tt>&lt;mesh type="ply"&gt;</tt> with the
+ * <tt>filename</tt> and (optionally) <tt>toWorld</tt> properties.
+ */
+class PLYMesh : public Mesh {
+public:
+	PLYMesh(const PropertyList &propList) : Mesh(propList) {
+		QString filename = propList.getString("filename");
+		QFile input(QFile::exists(filename) ? filename : absFileName(filename));
+		if (!input.open(QIODevice::ReadOnly))
+			throw NoriException(QString("Cannot open \"%1\"").arg(filename));
+
+		Transform trafo = propList.getTransform("toWorld", Transform());
+
+		cout << "Loading \"" << qPrintable(filename) << "\" .." << endl;
+		m_name = QFileInfo(filename).fileName();
+
+		qint64 size = input.size();
+		const uchar *data = size > 0 ? input.map(0, size) : NULL;
+		if (!data)
+			throw NoriException(QString("Unable to map \"%1\" into memory").arg(filename));
+		const uchar *end = data + size;
+
+		/* Parse the header */
+		std::vector<PLYElement> elements;
+		bool swap = false;
+		const uchar *ptr = parseHeader(data, end, elements, swap);
+
+		int vertexElement = -1, faceElement = -1;
+		for (size_t i=0; i<elements.size(); ++i) {
+			if (elements[i].name == "vertex" && vertexElement < 0)
+				vertexElement = (int) i;
+			else if (elements[i].name == "face" && faceElement < 0)
+				faceElement = (int) i;
+		}
+		if (vertexElement < 0 || faceElement < 0)
+			throw NoriException(QString("\"%1\": the PLY file must contain a vertex "
+				"and a face element!").arg(m_name));
+
+		const PLYElement &vertices = elements[vertexElement],
+		                 &faces = elements[faceElement];
+		bool attributes[EAttributeCount] = { false };
+		for (size_t i=0; i<vertices.properties.size(); ++i) {
+			if (vertices.properties[i].attribute != EIgnored)
+				attributes[vertices.properties[i].attribute] = true;
+		}
+		if (!attributes[EPositionX] || !attributes[EPositionY] || !attributes[EPositionZ])
+			throw NoriException(QString("\"%1\": the PLY vertices have no positions!").arg(m_name));
+		if (faces.indexProperty < 0)
+			throw NoriException(QString("\"%1\": the PLY faces have no vertex indices!").arg(m_name));
+		if (vertices.count > (size_t) std::numeric_limits<IndexType>::max())
+			throw NoriException(QString("\"%1\": too many vertices for the index width!").arg(m_name));
+
+		m_vertexCount = (IndexType) vertices.count;
+		m_vertexPositions = new Point3f[m_vertexCount];
+		if (attributes[ENormalX] && attributes[ENormalY] && attributes[ENormalZ])
+			m_vertexNormals = new Normal3f[m_vertexCount];
+		if (attributes[ETexCoordU] && attributes[ETexCoordV])
+			m_vertexTexCoords = new Point2f[m_vertexCount];
+
+		/* Stream through the elements in the order of the file */
+		PLYReader reader(ptr, end, swap);
+		for (size_t i=0; i<elements.size(); ++i) {
+			if ((int) i == vertexElement)
+				readVertices(reader, vertices, trafo);
+			else if ((int) i == faceElement)
+				readFaces(reader, faces);
+			else
+				reader.skip(elements[i]);
+		}
+
+		cout << "Read " << m_triangleCount << " triangles and "
+			 << m_vertexCount << " vertices." << endl;
+	}
+
+protected:
+	/**
+	 * \brief Parse the header of a PLY file
+	 *
+	 * \return A pointer to the first byte after the header
+	 */
+	const uchar *parseHeader(const uchar *data, const uchar *end,
+			std::vector<PLYElement> &elements, bool &swap) const {
+		const uchar *ptr = data;
+		int lineNumber = 0;
+		bool formatSeen = false;
+
+		while (true) {
+			const uchar *lineEnd = ptr;
+			while (lineEnd < end && *lineEnd != '\n')
+				++lineEnd;
+			if (lineEnd == end)
+				throw NoriException(QString("\"%1\": the PLY header is incomplete!").arg(m_name));
+
+			QString line = QString::fromLatin1(reinterpret_cast<const char *>(ptr),
+				(int) (lineEnd - ptr)).simplified();
+			QStringList tokens = line.split(' ');
+			ptr = lineEnd + 1;
+			++lineNumber;
+
+			if (lineNumber == 1) {
+				if (line != "ply")
+					throw NoriException(QString("\"%1\" is not a PLY file!").arg(m_name));
+				continue;
+			}
+
+			const QString &keyword = tokens[0];
+			if (keyword == "end_header") {
+				break;
+			} else if (keyword == "format" && tokens.size() == 3) {
+				/* The byte order of the machine */
+				const uint16_t one = 1;
+				bool littleEndian = *reinterpret_cast<const uint8_t *>(&one) == 1;
+				if (tokens[1] == "binary_little_endian")
+					swap = !littleEndian;
+				else if (tokens[1] == "binary_big_endian")
+					swap = littleEndian;
+				else
+					throw NoriException(QString("\"%1\": unsupported PLY format \"%2\" "
+						"(only binary files can be loaded)!").arg(m_name).arg(tokens[1]));
+				formatSeen = true;
+			} else if (keyword == "element" && tokens.size() == 3) {
+				PLYElement element;
+				bool ok;
+				element.name = tokens[1];
+				element.count = (size_t) tokens[2].toULongLong(&ok);
+				element.indexProperty = -1;
+				if (!ok)
+					goto fail;
+				elements.push_back(element);
+			} else if (keyword == "property" && !elements.empty()) {
+				PLYElement &element = elements.back();
+				PLYProperty prop;
+				QString name;
+				prop.attribute = EIgnored;
+				if (tokens.size() == 3) {
+					prop.type = parsePLYType(tokens[1]);
+					prop.countType = EInvalid;
+					name = tokens[2];
+				} else if (tokens.size() == 5 && tokens[1] == "list") {
+					prop.countType = parsePLYType(tokens[2]);
+					prop.type = parsePLYType(tokens[3]);
+					name = tokens[4];
+					if (prop.countType == EInvalid || prop.countType == EFloat32
+							|| prop.countType == EFloat64)
+						goto fail;
+				} else {
+					goto fail;
+				}
+				if (prop.type == EInvalid)
+					goto fail;
+
+				if (element.name == "vertex" && prop.countType == EInvalid) {
+					if (name == "x") prop.attribute = EPositionX;
+					else if (name == "y") prop.attribute = EPositionY;
+					else if (name == "z") prop.attribute = EPositionZ;
+					else if (name == "nx") prop.attribute = ENormalX;
+					else if (name == "ny") prop.attribute = ENormalY;
+					else if (name == "nz") prop.attribute = ENormalZ;
+					else if (name == "u" || name == "s" || name == "texture_u") prop.attribute = ETexCoordU;
+					else if (name == "v" || name == "t" || name == "texture_v") prop.attribute = ETexCoordV;
+				} else if (element.name == "face" && prop.countType != EInvalid
+						&& (name == "vertex_indices" || name == "vertex_index")) {
+					if (prop.type == EFloat32 || prop.type == EFloat64)
+						goto fail;
+					element.indexProperty = (int) element.properties.size();
+				}
+				element.properties.push_back(prop);
+			} else if (keyword != "comment" && keyword != "obj_info") {
+				goto fail;
+			}
+			continue;
+
+		fail:
+			throw NoriException(QString("\"%1\": could not parse line %2 of the PLY header: '%3'!")
+				.arg(m_name).arg(lineNumber).arg(line));
+		}
+
+		if (!formatSeen)
+			throw NoriException(QString("\"%1\": the PLY header has no format line!").arg(m_name));
+
+		return ptr;
+	}
+
+	/// Convert the vertex element into the vertex arrays
+	void readVertices(PLYReader &reader, const PLYElement &element, const Transform &trafo) {
+		const std::vector<PLYProperty> &properties = element.properties;
+		float values[EAttributeCount + 1];
+
+		/* Most files store all attributes as floats. When the rows have a
+		   fixed size and the byte order matches, copy them without conversion */
+		size_t offsets[EAttributeCount + 1], stride = 0;
+		bool direct = !reader.isSwapped();
+		for (size_t j=0; j<properties.size(); ++j) {
+			const PLYProperty &prop = properties[j];
+			if (prop.countType != EInvalid || (prop.attribute != EIgnored && prop.type != EFloat32))
+				direct = false;
+			offsets[prop.attribute] = stride;
+			stride += plyTypeSize[prop.type];
+		}
+
+		if (direct) {
+			if (reader.getRemaining() / stride < (size_t) m_vertexCount)
+				throw NoriException("PLY: unexpected end of file!");
+			const uchar *row = reader.getPointer();
+			for (IndexType i=0; i<m_vertexCount; ++i, row += stride) {
+				for (size_t j=0; j<properties.size(); ++j) {
+					PLYAttribute attribute = properties[j].attribute;
+					if (attribute != EIgnored)
+						memcpy(&values[attribute], row + offsets[attribute], sizeof(float));
+				}
+				storeVertex(i, values, trafo);
+			}
+			reader.setPointer(row);
+			return;
+		}
+
+		for (IndexType i=0; i<m_vertexCount; ++i) {
+			for (size_t j=0; j<properties.size(); ++j) {
+				const PLYProperty &prop = properties[j];
+				if (EXPECT_NOT_TAKEN(prop.countType != EInvalid))
+					reader.skip(prop);
+				else
+					values[prop.attribute] = reader.read<float>(prop.type);
+			}
+			storeVertex(i, values, trafo);
+		}
+	}
+
+	/// Transform the attributes of a vertex and store them in the vertex arrays
+	inline void storeVertex(IndexType i, const float *values, const Transform &trafo) {
+		m_vertexPositions[i] = trafo * Point3f(values[EPositionX],
+			values[EPositionY], values[EPositionZ]);
+		if (m_vertexNormals)
+			m_vertexNormals[i] = (trafo * Normal3f(values[ENormalX],
+				values[ENormalY], values[ENormalZ])).normalized();
+		if (m_vertexTexCoords)
+			m_vertexTexCoords[i] = Point2f(values[ETexCoordU], values[ETexCoordV]);
+	}
+
+	/**
+	 * \brief Convert the face element into the index array
+	 *
+	 * The faces are read twice: first to count the triangles, so that
+	 * the index array can be allocated with its final size, and then
+	 * to convert the vertex indices.
+	 */
+	void readFaces(PLYReader &reader, const PLYElement &element) {
+		const std::vector<PLYProperty> &properties = element.properties;
+		const PLYProperty &indexProp = properties[element.indexProperty];
+		const uchar *start = reader.getPointer();
+
+		size_t triangleCount = 0;
+		for (size_t i=0; i<element.count; ++i) {
+			for (size_t j=0; j<properties.size(); ++j) {
+				if ((int) j != element.indexProperty) {
+					reader.skip(properties[j]);
+					continue;
+				}
+				size_t count = reader.read<size_t>(indexProp.countType);
+				if (count < 3)
+					throw NoriException(QString("\"%1\": PLY face %2 has fewer than "
+						"three vertices!").arg(m_name).arg((qulonglong) i));
+				triangleCount += count - 2;
+				reader.skip(indexProp.type, count);
+			}
+		}
+		if (triangleCount > (size_t) std::numeric_limits<IndexType>::max())
+			throw NoriException(QString("\"%1\": too many triangles for the index width!").arg(m_name));
+
+		m_triangleCount = (IndexType) triangleCount;
+		m_indices = new IndexType[3 * triangleCount];
+		reader.setPointer(start);
+
+		IndexType *target = m_indices;
+		for (size_t i=0; i<element.count; ++i) {
+			for (size_t j=0; j<properties.size(); ++j) {
+				if ((int) j != element.indexProperty) {
+					reader.skip(properties[j]);
+					continue;
+				}
+
+				/* Split polygons into triangle fans */
+				size_t count = reader.read<size_t>(indexProp.countType);
+				IndexType first = 0, prev = 0;
+				for (size_t k=0; k<count; ++k) {
+					uint64_t index = reader.read<uint64_t>(indexProp.type);
+					if (index >= m_vertexCount)
+						throw NoriException(QString("\"%1\": PLY face %2 references "
+							"vertex %3, which does not exist!").arg(m_name)
+							.arg((qulonglong) i).arg((qulonglong) index));
+					if (k == 0) {
+						first = (IndexType) index;
+					} else if (k >= 2) {
+						*target++ = first;
+						*target++ = prev;
+						*target++ = (IndexType) index;
+					}
+					prev = (IndexType) index;
+				}
+			}
+		}
+	}
+};
+
+NORI_REGISTER_CLASS(PLYMesh, "ply");
+NORI_NAMESPACE_END
@@ -0,0 +1,359 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/sbvh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// Surface area of a bounding box, which is zero for invalid (empty) boxes
+static inline float getArea(const BoundingBox3f &bbox) {
+	return bbox.isValid() ? bbox.getSurfaceArea() : 0.0f;
+}
+
+/// Union of two bounding boxes
+static inline BoundingBox3f merge(const BoundingBox3f &a, const BoundingBox3f &b) {
+	BoundingBox3f result(a);
+	result.expandBy(b);
+	return result;
+}
+
+/// Order references by their centroid along an axis
+struct CentroidOrder {
+	int axis;
+
+	inline CentroidOrder(int axis) : axis(axis) { }
+
+	template <typename Primitive> inline bool operator()(const Primitive &a,
+			const Primitive &b) const {
+		return a.centroid[axis] < b.centroid[axis];
+	}
+};
+
+SBVH::SBVH(const PropertyList &propList) : BVH(propList), m_spatialSplitCount(0) {
+	/* Minimum overlap of the children of an object split (relative to
+	   the surface area of the scene) before spatial splits are evaluated */
+	m_splitAlpha = propList.getFloat("splitAlpha", 1e-5f);
+
+	if (m_splitAlpha < 0)
+		throw NoriException("The overlap threshold must be >= 0");
+}
+
+void SBVH::buildHierarchy(BuildPrimitive *prims, uint32_t primCount) {
+	std::vector<BuildPrimitive> refs(prims, prims + primCount);
+	m_minOverlap = m_splitAlpha * m_bbox.getSurfaceArea();
+	m_spatialSplitCount = 0;
+
+	buildNode(refs, 0);
+
+	size_t duplicates = m_indices.size() - primCount;
+	cout << "Performed " << m_spatialSplitCount << " spatial splits, which created "
+		<< duplicates << " additional references (+"
+		<< qPrintable(QString::number(100.0 * duplicates / primCount, 'f', 1)) << "%)" << endl;
+}
+
+void SBVH::buildNode(std::vector<BuildPrimitive> &refs, uint32_t depth) {
+	uint32_t nodeIdx = (uint32_t) m_nodes.size();
+	m_nodes.push_back(BVHNode());
+	m_maxDepth = std::max(m_maxDepth, depth);
+
+	BoundingBox3f bbox, centroidBBox;
+	for (size_t i=0; i<refs.size(); ++i) {
+		bbox.expandBy(refs[i].bbox);
+		centroidBBox.expandBy(refs[i].centroid);
+	}
+	m_nodes[nodeIdx].bbox = bbox;
+
+	uint32_t refCount = (uint32_t) refs.size();
+	if (refCount == 1 || depth + 1 >= NORI_BVH_MAXDEPTH) {
+		createLeaf(nodeIdx, &refs[0], 0, refCount);
+		return;
+	}
+
+	ObjectSplit object;
+	findObjectSplit(refs, bbox, centroidBBox, object);
+
+	/* Only look for spatial splits when the object split leads to
+	   significantly overlapping children */
+	SpatialSplit spatial;
+	spatial.cost = std::numeric_limits<float>::infinity();
+	if (object.axis == -1) {
+		findSpatialSplit(refs, bbox, spatial);
+	} else {
+		BoundingBox3f overlap(object.leftBBox);
+		overlap.clip(object.rightBBox);
+		if (getArea(overlap) > m_minOverlap)
+			findSpatialSplit(refs, bbox, spatial);
+	}
+
+	float bestCost = std::min(object.cost, spatial.cost);
+	if (bestCost >= m_queryCost * refCount && refCount <= (uint32_t) m_maxLeafSize) {
+		createLeaf(nodeIdx, &refs[0], 0, refCount);
+		return;
+	}
+
+	std::vector<BuildPrimitive> left, right;
+	int axis = 0;
+
+	if (spatial.cost < object.cost) {
+		performSpatialSplit(refs, spatial, left, right);
+		axis = spatial.axis;
+		m_spatialSplitCount++;
+	} else if (object.axis != -1) {
+		float min = centroidBBox.min[object.axis],
+		      scale = m_binCount / (centroidBBox.max[object.axis] - min);
+		for (size_t i=0; i<refs.size(); ++i) {
+			int bin = std::min((int) ((refs[i].centroid[object.axis] - min) * scale), m_binCount - 1);
+			(bin < object.bin ? left : right).push_back(refs[i]);
+		}
+		axis = object.axis;
+	}
+
+	if (left.empty() || right.empty()) {
+		/* No usable split -- fall back to a median split */
+		if (refCount <= (uint32_t) m_maxLeafSize) {
+			createLeaf(nodeIdx, &refs[0], 0, refCount);
+			return;
+		}
+		axis = centroidBBox.getMajorAxis();
+		uint32_t mid = refCount / 2;
+		std::nth_element(refs.begin(), refs.begin() + mid, refs.end(),
+			CentroidOrder(axis));
+		left.assign(refs.begin(), refs.begin() + mid);
+		right.assign(refs.begin() + mid, refs.end());
+	}
+
+	/* Release the memory of this level before descending */
+	std::vector<BuildPrimitive>().swap(refs);
+
+	m_nodes[nodeIdx].primCount = 0;
+	m_nodes[nodeIdx].axis = (uint8_t) axis;
+	buildNode(left, depth + 1);
+	m_nodes[nodeIdx].offset = (uint32_t) m_nodes.size();
+	buildNode(right, depth + 1);
+}
+
+void SBVH::findObjectSplit(const std::vector<BuildPrimitive> &refs,
+		const BoundingBox3f &bbox, const BoundingBox3f &centroidBBox,
+		ObjectSplit &split) const {
+	struct Bin {
+		BoundingBox3f bbox;
+		uint32_t count;
+	} bins[NORI_BVH_MAXBINS];
+
+	BoundingBox3f rightBBox[NORI_BVH_MAXBINS];
+	uint32_t rightCount[NORI_BVH_MAXBINS];
+	float invNodeArea = 1.0f / std::max(getArea(bbox), std::numeric_limits<float>::min());
+
+	split.cost = std::numeric_limits<float>::infinity();
+	split.axis = split.bin = -1;
+
+	for (int axis=0; axis<3; ++axis) {
+		float min = centroidBBox.min[axis],
+		      extent = centroidBBox.max[axis] - min;
+		if (extent <= 0)
+			continue;
+		float scale = m_binCount / extent;
+
+		for (int i=0; i<m_binCount; ++i) {
+			bins[i].bbox.reset();
+			bins[i].count = 0;
+		}
+
+		for (size_t i=0; i<refs.size(); ++i) {
+			int bin = std::min((int) ((refs[i].centroid[axis] - min) * scale), m_binCount - 1);
+			bins[bin].bbox.expandBy(refs[i].bbox);
+			bins[bin].count++;
+		}
+
+		BoundingBox3f accum;
+		uint32_t count = 0;
+		for (int i=m_binCount-1; i>0; --i) {
+			accum.expandBy(bins[i].bbox);
+			count += bins[i].count;
+			rightBBox[i] = accum;
+			rightCount[i] = count;
+		}
+
+		accum.reset();
+		count = 0;
+		for (int i=1; i<m_binCount; ++i) {
+			accum.expandBy(bins[i-1].bbox);
+			count += bins[i-1].count;
+			if (count == 0 || rightCount[i] == 0)
+				continue;
+			float cost = m_traversalCost + m_queryCost * invNodeArea *
+				(getArea(accum) * count + getArea(rightBBox[i]) * rightCount[i]);
+			if (cost < split.cost) {
+				split.cost = cost;
+				split.axis = axis;
+				split.bin = i;
+				split.leftBBox = accum;
+				split.rightBBox = rightBBox[i];
+			}
+		}
+	}
+}
+
+void SBVH::findSpatialSplit(const std::vector<BuildPrimitive> &refs,
+		const BoundingBox3f &bbox, SpatialSplit &split) const {
+	struct Bin {
+		BoundingBox3f bbox;
+		uint32_t enter, exit;
+	} bins[NORI_BVH_MAXBINS];
+
+	BoundingBox3f rightBBox[NORI_BVH_MAXBINS];
+	uint32_t rightCount[NORI_BVH_MAXBINS];
+	float invNodeArea = 1.0f / std::max(getArea(bbox), std::numeric_limits<float>::min());
+
+	split.cost = std::numeric_limits<float>::infinity();
+	split.axis = -1;
+
+	for (int axis=0; axis<3; ++axis) {
+		float min = bbox.min[axis],
+		      extent = bbox.max[axis] - min;
+		if (extent <= 0)
+			continue;
+		float binSize = extent / m_binCount, scale = m_binCount / extent;
+
+		for (int i=0; i<m_binCount; ++i) {
+			bins[i].bbox.reset();
+			bins[i].enter = bins[i].exit = 0;
+		}
+
+		/* Chop each reference into the bins that it overlaps */
+		for (size_t i=0; i<refs.size(); ++i) {
+			const BuildPrimitive &ref = refs[i];
+			int first = std::max(0, std::min((int) ((ref.bbox.min[axis] - min) * scale), m_binCount - 1)),
+			    last  = std::max(first, std::min((int) ((ref.bbox.max[axis] - min) * scale), m_binCount - 1));
+
+			if (first == last) {
+				bins[first].bbox.expandBy(ref.bbox);
+			} else {
+				for (int j=first; j<=last; ++j) {
+					BoundingBox3f clip(ref.bbox);
+					if (j > first)
+						clip.min[axis] = std::max(clip.min[axis], min + j * binSize);
+					if (j < last)
+						clip.max[axis] = std::min(clip.max[axis], min + (j+1) * binSize);
+					BoundingBox3f clipped = getClippedBoundingBox(ref.index, clip);
+					if (clipped.isValid())
+						bins[j].bbox.expandBy(clipped);
+				}
+			}
+			bins[first].enter++;
+			bins[last].exit++;
+		}
+
+		BoundingBox3f accum;
+		uint32_t count = 0;
+		for (int i=m_binCount-1; i>0; --i) {
+			accum.expandBy(bins[i].bbox);
+			count += bins[i].exit;
+			rightBBox[i] = accum;
+			rightCount[i] = count;
+		}
+
+		accum.reset();
+		count = 0;
+		for (int i=1; i<m_binCount; ++i) {
+			accum.expandBy(bins[i-1].bbox);
+			count += bins[i-1].enter;
+			if (count == 0 || rightCount[i] == 0)
+				continue;
+			float cost = m_traversalCost + m_queryCost * invNodeArea *
+				(getArea(accum) * count + getArea(rightBBox[i]) * rightCount[i]);
+			if (cost < split.cost) {
+				split.cost = cost;
+				split.axis = axis;
+				split.pos = min + i * binSize;
+				split.leftCount = count;
+				split.rightCount = rightCount[i];
+				split.leftBBox = accum;
+				split.rightBBox = rightBBox[i];
+			}
+		}
+	}
+}
+
+void SBVH::performSpatialSplit(const std::vector<BuildPrimitive> &refs,
+		const SpatialSplit &split, std::vector<BuildPrimitive> &left,
+		std::vector<BuildPrimitive> &right) const {
+	int axis = split.axis;
+	float pos = split.pos;
+	float leftArea = getArea(split.leftBBox), rightArea = getArea(split.rightBBox);
+	float nl = (float) split.leftCount, nr = (float) split.rightCount;
+
+	for (size_t i=0; i<refs.size(); ++i) {
+		const BuildPrimitive &ref = refs[i];
+
+		if (ref.bbox.max[axis] <= pos) {
+			left.push_back(ref);
+			continue;
+		} else if (ref.bbox.min[axis] >= pos) {
+			right.push_back(ref);
+			continue;
+		}
+
+		/* Reference unsplitting: keep the triangle on one side when
+		   that is cheaper than referencing it from both children */
+		float splitCost = leftArea * nl + rightArea * nr,
+		      leftCost  = getArea(merge(split.leftBBox, ref.bbox)) * nl + rightArea * (nr - 1),
+		      rightCost = leftArea * (nl - 1) + getArea(merge(split.rightBBox, ref.bbox)) * nr;
+
+		if (leftCost < splitCost && leftCost <= rightCost) {
+			left.push_back(ref);
+			continue;
+		} else if (rightCost < splitCost) {
+			right.push_back(ref);
+			continue;
+		}
+
+		BoundingBox3f leftClip(ref.bbox), rightClip(ref.bbox);
+		leftClip.max[axis] = pos;
+		rightClip.min[axis] = pos;
+
+		BuildPrimitive leftRef(ref), rightRef(ref);
+		leftRef.bbox = getClippedBoundingBox(ref.index, leftClip);
+		rightRef.bbox = getClippedBoundingBox(ref.index, rightClip);
+
+		/* Clipping can remove one of the two parts (e.g. when the
+		   triangle only touches the plane within the reference's bounds) */
+		if (!leftRef.bbox.isValid()) {
+			right.push_back(ref);
+		} else if (!rightRef.bbox.isValid()) {
+			left.push_back(ref);
+		} else {
+			leftRef.centroid = leftRef.bbox.getCenter();
+			rightRef.centroid = rightRef.bbox.getCenter();
+			left.push_back(leftRef);
+			right.push_back(rightRef);
+		}
+	}
+}
+
+QString SBVH::toString() const {
+	return QString("SBVH[traversalCost=%1, queryCost=%2, binCount=%3, maxLeafSize=%4, splitAlpha=%5]")
+		.arg(m_traversalCost)
+		.arg(m_queryCost)
+		.arg(m_binCount)
+		.arg(m_maxLeafSize)
+		.arg(m_splitAlpha);
+}
+
+NORI_REGISTER_CLASS(SBVH, "sbvh");
+NORI_NAMESPACE_END
@@ -28,12 +28,18 @@ NORI_NAMESPACE_BEGIN
 
 Scene::Scene(const PropertyList &) 
 	: m_integrator(NULL), m_sampler(NULL), m_camera(NULL), 
-	  m_medium(NULL), m_envLuminaire(NULL), m_evaluator(NULL) {
-	m_kdtree = new KDTree();
+	  m_medium(NULL), m_accel(NULL), m_envLuminaire(NULL), m_evaluator(NULL) {
 }
 
 Scene::~Scene() {
-	delete m_kdtree;
+	if (m_accel)
+		delete m_accel;
+	for (size_t i=0; i<m_meshes.size(); ++i)
+		delete m_meshes[i];
+	for (size_t i=0; i<m_instances.size(); ++i)
+		delete m_instances[i];
+	for (size_t i=0; i<m_sharedMeshes.size(); ++i)
+		delete m_sharedMeshes[i];
 	if (m_sampler)
 		delete m_sampler;
 	if (m_camera)
@@ -58,7 +64,7 @@ Color3f Scene::sampleDirect(LuminaireQueryRecord &lRec, const Point2f &_sample)
 	Color3f value = lRec.luminaire->sample(lRec, sample);
 
 	if (lRec.pdf != 0) {
-		if (rayIntersect(Ray3f(lRec.ref, lRec.d, Epsilon, lRec.dist * (1-1e-4f))))
+		if (occluded(Ray3f(lRec.ref, lRec.d, Epsilon, lRec.dist * (1-1e-4f))))
 			return Color3f(0.0f);
 		lRec.pdf /= m_luminaires.size();
 		return value * m_luminaires.size();
@@ -89,7 +95,24 @@ Color3f Scene::evalTransmittance(const Ray3f &ray, Sampler *sampler) const {
 }
 
 void Scene::activate() {
-	m_kdtree->build();
+	if (!m_accel) {
+		/* Default to the SAH kd-tree */
+		m_accel = static_cast<Accel *>(
+			NoriObjectFactory::createInstance("kdtree", PropertyList()));
+	}
+
+	for (size_t i=0; i<m_meshes.size(); ++i)
+		m_accel->addMesh(m_meshes[i]);
+
+	if (!m_instances.empty()) {
+		/* Two-level hierarchy: the accelerator specified in the scene only
+		   contains the meshes that are not instanced */
+		InstanceAccel *accel = new InstanceAccel(m_accel);
+		for (size_t i=0; i<m_instances.size(); ++i)
+			accel->addInstance(m_instances[i]);
+		m_accel = accel;
+	}
+	m_accel->build();
 
 	if (!m_integrator)
 		throw NoriException("No integrator was specified!");
@@ -111,7 +134,15 @@ void Scene::addChild(NoriObject *obj) {
 	switch (obj->getClassType()) {
 		case EMesh: {
 				Mesh *mesh = static_cast<Mesh *>(obj);
-				m_kdtree->addMesh(mesh);
+				if (!mesh->getId().isEmpty()) {
+					/* Shared meshes are only rendered through instances */
+					if (mesh->isLuminaire())
+						throw NoriException(QString("The shared mesh \"%1\" cannot be "
+							"a luminaire!").arg(mesh->getId()));
+					if (std::find(m_sharedMeshes.begin(), m_sharedMeshes.end(), mesh) == m_sharedMeshes.end())
+						m_sharedMeshes.push_back(mesh);
+					break;
+				}
 				m_meshes.push_back(mesh);
 				if (mesh->isLuminaire())
 					m_luminaires.push_back(mesh->getLuminaire());
@@ -137,6 +168,24 @@ void Scene::addChild(NoriObject *obj) {
 			}
 			break;  
 
+		case EInstance: {
+				Instance *instance = static_cast<Instance *>(obj);
+				Mesh *mesh = instance->getMesh();
+				if (mesh->isLuminaire())
+					throw NoriException(QString("The shared mesh \"%1\" cannot be "
+						"a luminaire!").arg(mesh->getId()));
+				if (std::find(m_sharedMeshes.begin(), m_sharedMeshes.end(), mesh) == m_sharedMeshes.end())
+					m_sharedMeshes.push_back(mesh);
+				m_instances.push_back(instance);
+			}
+			break;
+
+		case EAccel:
+			if (m_accel)
+				throw NoriException("There can only be one accelerator per scene!");
+			m_accel = static_cast<Accel *>(obj);
+			break;
+
 		case ESampler:
 			if (m_sampler)
 				throw NoriException("There can only be one sampler per scene!");
@@ -181,9 +230,11 @@ QString Scene::toString() const {
 		"  sampler = %2\n"
 		"  camera = %3,\n"
 		"  medium = %4,\n"
+		"  accel = %8,\n"
 		"  envLuminaire = %5,\n"
 		"  meshes = {\n"
 		"  %6},\n"
+		"  instanceCount = %9,\n"
                 "  evaluator = %7\n"
 		"]")
 	.arg(indent(m_integrator->toString()))
@@ -192,7 +243,9 @@ QString Scene::toString() const {
 	.arg(m_medium ? indent(m_medium->toString()) : QString("null"))
 	.arg(indent(m_envLuminaire ? m_envLuminaire->toString() : QString("null")))
 	.arg(indent(meshes, 2))
-        .arg(indent(m_evaluator ? m_evaluator->toString() : QString("null")));
+        .arg(indent(m_evaluator ? m_evaluator->toString() : QString("null")))
+	.arg(m_accel ? indent(m_accel->toString()) : QString("null"))
+	.arg(m_instances.size());
 }
 
 NORI_REGISTER_CLASS(Scene, "scene");
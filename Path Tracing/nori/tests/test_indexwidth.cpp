@@ -0,0 +1,274 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2012 by Wenzel Jakob and Steve Marschner.
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+    Checks the index arithmetic of 64-bit builds (NORI_INDEX_WIDTH=64)
+    across the 2^32 boundary. Scenes of that size do not fit into the
+    memory of a test machine, hence the data structures are exercised
+    directly with synthetic offsets and counts.
+*/
+
+#include <nori/kdtree.h>
+#include <nori/mesh.h>
+#include <QDir>
+
+#if NORI_INDEX_WIDTH != 64
+#error These tests require a build with NORI_INDEX_WIDTH=64
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << endl; \
+			++failures; \
+		} \
+	} while (0)
+
+static const IndexType Boundary = (IndexType) 1 << 32;
+
+/// Mesh with a single triangle
+class TriangleMesh : public Mesh {
+public:
+	TriangleMesh() : Mesh(PropertyList()) {
+		m_vertexCount = 3;
+		m_triangleCount = 1;
+		m_vertexPositions = new Point3f[3];
+		m_vertexPositions[0] = Point3f(0, 0, 0);
+		m_vertexPositions[1] = Point3f(1, 0, 0);
+		m_vertexPositions[2] = Point3f(0, 1, 0);
+		m_indices = new IndexType[3];
+		for (int i=0; i<3; ++i)
+			m_indices[i] = i;
+	}
+};
+
+/// Accelerator whose size map can be set up directly
+class SyntheticAccel : public Accel {
+public:
+	void build() { }
+
+	bool rayIntersect(const Ray3f &, Intersection &, bool) const { return false; }
+
+	const BoundingBox3f &getBoundingBox() const { return m_bbox; }
+
+	QString toString() const { return "SyntheticAccel[]"; }
+
+	/// Register meshes with the given triangle counts (without storing any triangles)
+	void setSizes(const std::vector<IndexType> &sizes) {
+		m_sizeMap.clear();
+		m_sizeMap.push_back(0);
+		for (size_t i=0; i<sizes.size(); ++i)
+			m_sizeMap.push_back(m_sizeMap.back() + sizes[i]);
+	}
+
+	void addMeshWithOffset(Mesh *mesh, IndexType offset) {
+		m_meshes.push_back(mesh);
+		m_sizeMap.clear();
+		m_sizeMap.push_back(offset);
+	}
+
+	using Accel::findMesh;
+	using Accel::fillTriAccel;
+private:
+	BoundingBox3f m_bbox;
+};
+
+static void testKDNode() {
+	typedef KDTreeBase<BoundingBox3f, IndexType>::KDNode KDNode;
+	KDNode node;
+
+	node.initLeafNode(Boundary + 5, 3);
+	CHECK(node.isLeaf());
+	CHECK(node.getPrimStart() == Boundary + 5);
+	CHECK(node.getPrimEnd() == Boundary + 8);
+
+	IndexType farOffset = (IndexType) 1 << 40;
+	node.initLeafNode(farOffset, Boundary);
+	CHECK(node.isLeaf());
+	CHECK(node.getPrimStart() == farOffset);
+	CHECK(node.getPrimEnd() == farOffset + Boundary);
+
+	CHECK(KDNode::ERelOffsetLimit > Boundary);
+
+	ptrdiff_t relOffset = (ptrdiff_t) Boundary * 2 + 2;
+	CHECK(node.initInnerNode(2, 1.5f, relOffset));
+	CHECK(!node.isLeaf());
+	CHECK(!node.isIndirection());
+	CHECK(node.getAxis() == 2);
+	CHECK(node.getSplit() == 1.5f);
+	CHECK(node.getLeft() - &node == relOffset);
+
+	/* getLeft() would leave the address space here, so decode the field directly */
+	CHECK(node.initInnerNode(1, 0.0f, (ptrdiff_t) KDNode::ERelOffsetLimit));
+	CHECK(!node.isLeaf());
+	CHECK(!node.isIndirection());
+	CHECK(node.getAxis() == 1);
+	CHECK(((node.inner.combined & KDNode::EInnerOffsetMask) >> 2) == KDNode::ERelOffsetLimit);
+	CHECK(!node.initInnerNode(0, 0.0f, (ptrdiff_t) KDNode::ERelOffsetLimit + 1));
+	CHECK(!node.initInnerNode(0, 0.0f, -1));
+}
+
+static void testClassificationStorage() {
+	/* Needs 1 GiB of address space, but only a few pages are touched */
+	ClassificationStorage storage;
+	try {
+		storage.setPrimitiveCount((size_t) Boundary + 16);
+	} catch (const std::bad_alloc &) {
+		cout << "Skipping the classification storage test (out of memory)" << endl;
+		return;
+	}
+	CHECK(storage.size() == (size_t) Boundary / 4 + 4);
+
+	for (size_t i=0; i<16; ++i) {
+		storage.set(i, 0);
+		storage.set((size_t) Boundary + i, (int) (i % 4));
+	}
+	for (size_t i=0; i<16; ++i) {
+		CHECK(storage.get((size_t) Boundary + i) == (int) (i % 4));
+		CHECK(storage.get(i) == 0);
+	}
+
+	storage.set((size_t) Boundary + 5, 3);
+	CHECK(storage.get((size_t) Boundary + 4) == 0);
+	CHECK(storage.get((size_t) Boundary + 5) == 3);
+	CHECK(storage.get((size_t) Boundary + 6) == 2);
+}
+
+static void testFindMesh() {
+	SyntheticAccel accel;
+	std::vector<IndexType> sizes;
+	sizes.push_back(3000000000ULL);
+	sizes.push_back(2000000000ULL);
+	sizes.push_back(7);
+	sizes.push_back(Boundary * 3);
+	accel.setSizes(sizes);
+
+	IndexType idx = 2999999999ULL;
+	CHECK(accel.findMesh(idx) == 0 && idx == 2999999999ULL);
+
+	idx = 3000000000ULL;
+	CHECK(accel.findMesh(idx) == 1 && idx == 0);
+
+	idx = Boundary + 5;
+	CHECK(accel.findMesh(idx) == 1 && idx == Boundary + 5 - 3000000000ULL);
+
+	idx = 5000000006ULL;
+	CHECK(accel.findMesh(idx) == 2 && idx == 6);
+
+	idx = 5000000007ULL + Boundary * 2;
+	CHECK(accel.findMesh(idx) == 3 && idx == Boundary * 2);
+}
+
+static void testTriAccel() {
+	TriangleMesh mesh;
+	SyntheticAccel accel;
+	IndexType offset = Boundary * 3 + 7;
+	accel.addMeshWithOffset(&mesh, offset);
+
+	TriAccel tri;
+	accel.fillTriAccel(tri, 0, 0);
+	CHECK(tri.meshIndex == 0);
+	CHECK(tri.primIndex == 0);
+	CHECK(tri.index == offset);
+	CHECK(tri.e1 == Vector3f(1, 0, 0));
+
+	tri.primIndex = Boundary + 1;
+	tri.index = offset + Boundary + 1;
+	TriAccelN packet;
+	packet.clear();
+	CHECK(packet.index[0] == (IndexType) -1);
+	packet.set(NORI_SIMD_WIDTH - 1, tri);
+	CHECK(packet.primIndex[NORI_SIMD_WIDTH - 1] == Boundary + 1);
+	CHECK(packet.index[NORI_SIMD_WIDTH - 1] == offset + Boundary + 1);
+	CHECK(packet.meshIndex[NORI_SIMD_WIDTH - 1] == 0);
+}
+
+static void testCacheHeader() {
+	typedef KDTreeBase<BoundingBox3f, IndexType>::KDNode KDNode;
+
+	KDCacheHeader header;
+	memset(&header, 0, sizeof(KDCacheHeader));
+	memcpy(header.magic, "NKDT", 4);
+	header.nodeCount = Boundary * 2 + 1;
+	header.indexCount = Boundary * 3 + 5;
+	header.packetCount = Boundary + 3;
+	header.packetOffsetCount = Boundary + 9;
+	header.computeLayout();
+
+	/* Recompute the offsets independently */
+	uint64_t offset = alignCacheOffset(sizeof(KDCacheHeader));
+	CHECK(header.nodeOffset == offset);
+	offset = alignCacheOffset(offset + (uint64_t) sizeof(KDNode) * (Boundary * 2 + 2));
+	CHECK(header.indexOffset == offset);
+	offset = alignCacheOffset(offset + (uint64_t) sizeof(IndexType) * (Boundary * 3 + 5));
+	CHECK(header.triangleOffset == offset);
+	offset = alignCacheOffset(offset + (uint64_t) sizeof(TriAccel) * (Boundary * 3 + 5));
+	CHECK(header.packetOffset == offset);
+	offset = alignCacheOffset(offset + (uint64_t) sizeof(TriAccelN) * (Boundary + 3));
+	CHECK(header.packetOffsetsOffset == offset);
+	CHECK(header.fileSize == offset + (uint64_t) sizeof(IndexType) * (Boundary + 9));
+
+	/* Write the header and read it back */
+	QString filename = QDir::temp().filePath("nori-test-indexwidth.tmp");
+	QFile file(filename);
+	CHECK(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+	CHECK(writeCacheSection(file, 0, &header, sizeof(KDCacheHeader)));
+	file.close();
+
+	KDCacheHeader loaded;
+	memset(&loaded, 0, sizeof(KDCacheHeader));
+	CHECK(file.open(QIODevice::ReadOnly));
+	CHECK(file.size() == (qint64) sizeof(KDCacheHeader));
+	const uchar *data = file.map(0, sizeof(KDCacheHeader));
+	CHECK(data != NULL);
+	if (data)
+		memcpy(&loaded, data, sizeof(KDCacheHeader));
+	file.close();
+	QFile::remove(filename);
+
+	CHECK(memcmp(&header, &loaded, sizeof(KDCacheHeader)) == 0);
+	CHECK(loaded.nodeCount == Boundary * 2 + 1);
+	CHECK(loaded.indexCount == Boundary * 3 + 5);
+
+	/* The loader recomputes the layout to validate a header */
+	KDCacheHeader layout = loaded;
+	layout.computeLayout();
+	CHECK(memcmp(&layout, &loaded, sizeof(KDCacheHeader)) == 0);
+}
+
+NORI_NAMESPACE_END
+
+int main() {
+	using namespace nori;
+
+	testKDNode();
+	testClassificationStorage();
+	testFindMesh();
+	testTriAccel();
+	testCacheHeader();
+
+	if (failures > 0) {
+		cerr << failures << " check(s) failed" << endl;
+		return 1;
+	}
+	cout << "All index width tests passed" << endl;
+	return 0;
+}
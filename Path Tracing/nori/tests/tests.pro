@@ -0,0 +1,47 @@
+# Checks of the 64-bit index arithmetic. Build and run with
+#   qmake tests.pro && make && ./test_indexwidth
+
+TEMPLATE = app
+TARGET = test_indexwidth
+CONFIG += console
+CONFIG -= app_bundle
+QT -= gui
+
+DEFINES += NORI_INDEX_WIDTH=64
+
+SOURCES += test_indexwidth.cpp \
+	../src/accel.cpp \
+	../src/common.cpp \
+	../src/kdtree.cpp \
+	../src/mesh.cpp \
+	../src/object.cpp \
+	../src/proplist.cpp \
+	../src/random.cpp
+
+INCLUDEPATH += $$PWD/../include
+
+OBJECTS_DIR = build
+DESTDIR = .
+
+unix {
+        QMAKE_CXXFLAGS += -O3 -march=nocona -msse2 -mfpmath=sse -fstrict-aliasing
+        QMAKE_LIBDIR += /usr/local/lib
+        INCLUDEPATH += /usr/local/include/OpenEXR
+        QMAKE_LIBDIR += /opt/local/lib
+        INCLUDEPATH += /opt/local/include/OpenEXR
+        LIBS += -lIlmImf -lIex -lHalf
+        # Remove if you have Boost >=1.49
+        INCLUDEPATH += $$PWD/../include/boost1.49_min
+        # Remove if you have OpenEXR installed
+        INCLUDEPATH += $$PWD/../include/OpenEXR
+        QMAKE_RPATHDIR += $$PWD/../lib
+        LIBS += -L$$PWD/../lib
+}
+
+win32 {
+        QMAKE_LIBDIR += ../openexr/lib/x64
+        INCLUDEPATH += ../openexr/include
+        INCLUDEPATH += ../include/boost1.49_min
+        QMAKE_CXXFLAGS += /O2 /fp:fast /D_SCL_SECURE_NO_WARNINGS /D_CRT_SECURE_NO_WARNINGS
+        LIBS += IlmImf.lib Iex.lib Half.lib
+}